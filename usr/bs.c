@@ -31,6 +31,8 @@
 #include <syscall.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <linux/types.h>
 #include <dlfcn.h>
 
@@ -45,20 +47,72 @@
 LIST_HEAD(bst_list);
 static pthread_mutex_t bst_lock=PTHREAD_MUTEX_INITIALIZER;
 
-static LIST_HEAD(finished_list);
-static pthread_mutex_t finished_lock;
+/*
+ * Finished commands go back to the event loop that submitted them.
+ * Each loop has a lock-free list the I/O threads push onto; the loop
+ * takes the whole list at once. Only a push that finds the list empty
+ * writes the loop's eventfd, later ones ride on the same wakeup.
+ */
+struct bs_done_queue {
+	/* pushed in reverse order, linked by cmd->bs_done_next */
+	struct scsi_cmd *head;
+	int fd;
+};
+
+static struct bs_done_queue *bs_done_queues;
+
+/*
+ * Commands the transport marked as not the last of a burst wait on
+ * the event loop's batch and go to the I/O threads together, at the
+ * latest right before the loop sleeps again.
+ */
+struct bs_batch {
+	struct list_head cmds;
+	struct event_data flush_event;
+};
+
+static struct bs_batch *bs_batches;
+
+/*
+ * The I/O threads are shared by all the LUs. Each has its own queue;
+ * a command goes to an idle thread if there is one, a new thread is
+ * started if there is none and the pool isn't full yet, otherwise it
+ * is queued round robin. A thread that runs out of work takes
+ * commands queued on the others before going to sleep.
+ */
+struct bs_worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* commands to run, linked by cmd->bs_list */
+	struct list_head queue;
+	/*
+	 * Sleeping on cond, cleared by whoever wakes it up. Written under
+	 * lock, bs_pool_queue() peeks at it without.
+	 */
+	int idle;
+};
 
-/* used by both bs_rdwr.c and bs_rbd.c */
-int nr_iothreads = 16;
+/*
+ * Memory the transports keep as data buffers until exit, e.g. the
+ * hugepages of the iSCSI buffer pool. Backing stores that can pin
+ * buffers in advance look commands' buffers up here. A region keeps
+ * its index for good; the lookup table is sorted by address.
+ */
+static pthread_rwlock_t bs_buf_region_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct iovec bs_buf_regions[BS_BUF_REGIONS_MAX];
+static int bs_buf_sorted[BS_BUF_REGIONS_MAX];
+static int bs_nr_buf_regions;
 
-static int sig_fd = -1;
+/* 0 picks it from the number of CPUs */
+int nr_iothreads;
 
-static int command_fd[2];
-static int done_fd[2];
-static pthread_t ack_thread;
-/* protected by pipe */
-static LIST_HEAD(ack_list);
-static pthread_cond_t finished_cond;
+static pthread_mutex_t bs_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bs_worker *bs_workers;
+static int bs_max_workers;
+static int bs_nr_workers;
+static unsigned int bs_next_worker;
+static uint64_t bs_nr_steals;
 
 int register_backingstore_template(struct backingstore_template *bst)
 {
@@ -97,6 +151,13 @@ int backingstore_show(struct concat_buf *b)
 		concat_printf(b, _TAB1 "%s\n", bst->bs_name);
 	}
 	pthread_mutex_unlock(&bst_lock);
+
+	pthread_mutex_lock(&bs_pool_lock);
+	concat_printf(b, "I/O threads: %d running, %d max, %" PRIu64
+		      " commands taken over\n", bs_nr_workers,
+		      bs_max_workers,
+		      __atomic_load_n(&bs_nr_steals, __ATOMIC_RELAXED));
+	pthread_mutex_unlock(&bs_pool_lock);
 	return 0;
 }
 
@@ -132,341 +193,455 @@ int backingstore_new(char *buf, size_t sz)
 	return 0;
 }
 
-/* threading helper functions */
-
-static void *bs_thread_ack_fn(void *arg)
+int bs_buf_region_add(void *addr, size_t len)
 {
-	int command, ret, nr;
-	struct scsi_cmd *cmd;
-
-retry:
-	ret = read(command_fd[0], &command, sizeof(command));
-	if (ret < 0) {
-		eprintf("ack pthread will be dead, %m\n");
-		if (errno == EAGAIN || errno == EINTR)
-			goto retry;
+	int i, idx;
 
-		goto out;
+	pthread_rwlock_wrlock(&bs_buf_region_lock);
+	idx = bs_nr_buf_regions;
+	if (idx == BS_BUF_REGIONS_MAX) {
+		pthread_rwlock_unlock(&bs_buf_region_lock);
+		return -ENOSPC;
 	}
 
-	pthread_mutex_lock(&finished_lock);
-retest:
-	if (list_empty(&finished_list)) {
-		pthread_cond_wait(&finished_cond, &finished_lock);
-		goto retest;
-	}
+	bs_buf_regions[idx].iov_base = addr;
+	bs_buf_regions[idx].iov_len = len;
 
-	while (!list_empty(&finished_list)) {
-		cmd = list_first_entry(&finished_list,
-				 struct scsi_cmd, bs_list);
+	for (i = idx; i > 0; i--) {
+		if (bs_buf_regions[bs_buf_sorted[i - 1]].iov_base < addr)
+			break;
+		bs_buf_sorted[i] = bs_buf_sorted[i - 1];
+	}
+	bs_buf_sorted[i] = idx;
+	bs_nr_buf_regions++;
+	pthread_rwlock_unlock(&bs_buf_region_lock);
 
-		dprintf("found %p\n", cmd);
+	return 0;
+}
 
-		list_del(&cmd->bs_list);
-		list_add_tail(&cmd->bs_list, &ack_list);
+/* the index of the region holding [addr, addr + len), -1 if none */
+int bs_buf_region_find(void *addr, size_t len)
+{
+	int lo = 0, hi, mid, idx = -1;
+	struct iovec *r;
+
+	pthread_rwlock_rdlock(&bs_buf_region_lock);
+	hi = bs_nr_buf_regions - 1;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		r = &bs_buf_regions[bs_buf_sorted[mid]];
+		if ((char *)addr < (char *)r->iov_base)
+			hi = mid - 1;
+		else if ((char *)addr >= (char *)r->iov_base + r->iov_len)
+			lo = mid + 1;
+		else {
+			if ((char *)addr + len <= (char *)r->iov_base + r->iov_len)
+				idx = bs_buf_sorted[mid];
+			break;
+		}
 	}
+	pthread_rwlock_unlock(&bs_buf_region_lock);
+
+	return idx;
+}
+
+/*
+ * All the regions by index. Entries are never changed once added, so
+ * the first *nr stay valid after the lock is dropped.
+ */
+const struct iovec *bs_buf_region_table(int *nr)
+{
+	pthread_rwlock_rdlock(&bs_buf_region_lock);
+	*nr = bs_nr_buf_regions;
+	pthread_rwlock_unlock(&bs_buf_region_lock);
+	return bs_buf_regions;
+}
 
-	pthread_mutex_unlock(&finished_lock);
+/* threading helper functions */
 
-	nr = 1;
-rewrite:
-	ret = write(done_fd[1], &nr, sizeof(nr));
-	if (ret < 0) {
-		eprintf("can't ack tgtd, %m\n");
-		if (errno == EAGAIN || errno == EINTR)
-			goto rewrite;
+/* returns 1 if the queue was empty */
+static int bs_done_push(struct bs_done_queue *q, struct scsi_cmd *cmd)
+{
+	struct scsi_cmd *first = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
 
-		goto out;
-	}
+	do {
+		cmd->bs_done_next = first;
+	} while (!__atomic_compare_exchange_n(&q->head, &first, cmd, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
 
-	goto retry;
-out:
-	pthread_exit(NULL);
+	return !first;
 }
 
-static void bs_thread_request_done(int fd, int events, void *data)
+static void bs_done_handler(int fd, int events, void *data)
 {
-	struct scsi_cmd *cmd;
-	int nr_events, ret;
-
-	ret = read(done_fd[0], &nr_events, sizeof(nr_events));
-	if (ret < 0) {
-		eprintf("wrong wakeup\n");
-		return;
-	}
+	struct bs_done_queue *q = data;
+	struct scsi_cmd *cmd, *next, *list = NULL;
+	uint64_t count;
+	int ret;
 
-	while (!list_empty(&ack_list)) {
-		cmd = list_first_entry(&ack_list,
-				       struct scsi_cmd, bs_list);
+	/* a push after this will write again */
+	ret = read(fd, &count, sizeof(count));
+	if (ret < 0 && errno != EAGAIN)
+		eprintf("failed to read the completion eventfd, %m\n");
 
-		dprintf("back to tgtd, %p\n", cmd);
+	cmd = __atomic_exchange_n(&q->head, NULL, __ATOMIC_ACQUIRE);
 
-		list_del(&cmd->bs_list);
-		target_cmd_io_done(cmd, scsi_get_result(cmd));
+	/* back to the order the commands finished in */
+	while (cmd) {
+		next = cmd->bs_done_next;
+		cmd->bs_done_next = list;
+		list = cmd;
+		cmd = next;
 	}
 
-rewrite:
-	ret = write(command_fd[1], &nr_events, sizeof(nr_events));
-	if (ret < 0) {
-		eprintf("can't write done, %m\n");
-		if (errno == EAGAIN || errno == EINTR)
-			goto rewrite;
-
-		return;
+	for (cmd = list; cmd; cmd = next) {
+		next = cmd->bs_done_next;
+		target_cmd_io_done(cmd, scsi_get_result(cmd));
 	}
 }
 
-static void bs_sig_request_done(int fd, int events, void *data)
+/* finish @cmd on the reactor it was queued on, from any thread */
+void bs_cmd_done_post(struct scsi_cmd *cmd)
 {
+	struct bs_done_queue *q = &bs_done_queues[cmd->bs_reactor];
+	uint64_t one = 1;
 	int ret;
-	struct scsi_cmd *cmd;
-	struct signalfd_siginfo siginfo[16];
-	LIST_HEAD(list);
 
-	ret = read(fd, (char *)siginfo, sizeof(siginfo));
-	if (ret <= 0) {
+	if (!bs_done_push(q, cmd))
 		return;
-	}
 
-	pthread_mutex_lock(&finished_lock);
-	list_splice_init(&finished_list, &list);
-	pthread_mutex_unlock(&finished_lock);
+	ret = write(q->fd, &one, sizeof(one));
+	if (ret < 0)
+		eprintf("failed to wake up the event loop, %m\n");
+}
 
-	while (!list_empty(&list)) {
-		cmd = list_first_entry(&list, struct scsi_cmd, bs_list);
+static struct scsi_cmd *bs_worker_dequeue(struct bs_worker *w)
+{
+	struct scsi_cmd *cmd = NULL;
 
+	pthread_mutex_lock(&w->lock);
+	if (!list_empty(&w->queue)) {
+		cmd = list_first_entry(&w->queue, struct scsi_cmd, bs_list);
 		list_del(&cmd->bs_list);
-
-		target_cmd_io_done(cmd, scsi_get_result(cmd));
 	}
+	pthread_mutex_unlock(&w->lock);
+
+	return cmd;
 }
 
-static void *bs_thread_worker_fn(void *arg)
+static struct scsi_cmd *bs_worker_steal(struct bs_worker *self)
 {
-	struct bs_thread_info *info = arg;
+	int i, nr = __atomic_load_n(&bs_nr_workers, __ATOMIC_ACQUIRE);
+	int start = self - bs_workers;
 	struct scsi_cmd *cmd;
-	sigset_t set;
 
-	sigfillset(&set);
-	sigprocmask(SIG_BLOCK, &set, NULL);
+	for (i = 1; i < nr; i++) {
+		cmd = bs_worker_dequeue(&bs_workers[(start + i) % nr]);
+		if (cmd) {
+			__atomic_add_fetch(&bs_nr_steals, 1, __ATOMIC_RELAXED);
+			return cmd;
+		}
+	}
 
-	pthread_mutex_lock(&info->startup_lock);
-	dprintf("started this thread\n");
-	pthread_mutex_unlock(&info->startup_lock);
+	return NULL;
+}
 
-	while (!info->stop) {
-		pthread_mutex_lock(&info->pending_lock);
-	retest:
-		if (list_empty(&info->pending_list)) {
-			pthread_cond_wait(&info->pending_cond, &info->pending_lock);
-			if (info->stop) {
-				pthread_mutex_unlock(&info->pending_lock);
-				pthread_exit(NULL);
-			}
-			goto retest;
-		}
+/* the LU's next command held back by its limit, if any */
+static struct scsi_cmd *bs_thread_lu_next(struct bs_thread_info *info)
+{
+	struct scsi_cmd *cmd = NULL;
 
+	pthread_mutex_lock(&info->pending_lock);
+	if (list_empty(&info->pending_list))
+		info->inflight--;
+	else {
 		cmd = list_first_entry(&info->pending_list,
 				       struct scsi_cmd, bs_list);
-
 		list_del(&cmd->bs_list);
-		pthread_mutex_unlock(&info->pending_lock);
+	}
+	pthread_mutex_unlock(&info->pending_lock);
 
+	return cmd;
+}
+
+static void bs_thread_cmd_run(struct scsi_cmd *cmd)
+{
+	struct bs_thread_info *info;
+	struct scsi_cmd *next;
+
+	while (cmd) {
+		info = BS_THREAD_I(cmd->dev);
 		info->request_fn(cmd);
 
-		pthread_mutex_lock(&finished_lock);
-		list_add_tail(&cmd->bs_list, &finished_list);
-		pthread_mutex_unlock(&finished_lock);
+		/*
+		 * Done with the LU before the command goes back; once
+		 * the LU has no commands left, it may be removed.
+		 */
+		next = bs_thread_lu_next(info);
 
-		if (sig_fd < 0)
-			pthread_cond_signal(&finished_cond);
-		else
-			kill(getpid(), SIGUSR2);
+		bs_cmd_done_post(cmd);
+		cmd = next;
 	}
-
-	pthread_exit(NULL);
 }
 
-static int bs_init_signalfd(void)
+static void *bs_thread_worker_fn(void *arg)
 {
-	sigset_t mask;
-	int ret;
+	struct bs_worker *w = arg;
+	struct scsi_cmd *cmd;
+	sigset_t set;
 
-	pthread_mutex_init(&finished_lock, NULL);
+	sigfillset(&set);
+	sigprocmask(SIG_BLOCK, &set, NULL);
 
-	sigemptyset(&mask);
-	sigaddset(&mask, SIGUSR2);
-	sigprocmask(SIG_BLOCK, &mask, NULL);
+	for (;;) {
+		cmd = bs_worker_dequeue(w);
+		if (!cmd)
+			cmd = bs_worker_steal(w);
+		if (cmd) {
+			bs_thread_cmd_run(cmd);
+			continue;
+		}
 
-	sig_fd = __signalfd(-1, &mask, 0);
-	if (sig_fd < 0)
-		return 1;
+		pthread_mutex_lock(&w->lock);
+		if (list_empty(&w->queue)) {
+			__atomic_store_n(&w->idle, 1, __ATOMIC_RELAXED);
+			pthread_cond_wait(&w->cond, &w->lock);
+			__atomic_store_n(&w->idle, 0, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
 
-	ret = tgt_event_add(sig_fd, EPOLLIN, bs_sig_request_done, NULL);
-	if (ret < 0) {
-		close (sig_fd);
-		sig_fd = -1;
+	return NULL;
+}
 
-		return 1;
+static int bs_pool_init(void)
+{
+	int nr = nr_iothreads;
+
+	if (!nr) {
+		nr = 4 * sysconf(_SC_NPROCESSORS_ONLN);
+		if (nr < 16)
+			nr = 16;
 	}
 
+	bs_workers = zalloc(sizeof(*bs_workers) * nr);
+	if (!bs_workers)
+		return -ENOMEM;
+
+	bs_max_workers = nr;
 	return 0;
 }
 
-static int bs_init_notify_thread(void)
+static struct bs_worker *bs_pool_start_worker(void)
 {
+	struct bs_worker *w = &bs_workers[bs_nr_workers];
 	int ret;
 
-	pthread_cond_init(&finished_cond, NULL);
-	pthread_mutex_init(&finished_lock, NULL);
+	INIT_LIST_HEAD(&w->queue);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
 
-	ret = pipe(command_fd);
+	ret = pthread_create(&w->thread, NULL, bs_thread_worker_fn, w);
 	if (ret) {
-		eprintf("failed to create command pipe, %m\n");
-		goto destroy_cond_mutex;
+		eprintf("failed to create a worker thread, %s\n",
+			strerror(ret));
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		return NULL;
 	}
 
-	ret = pipe(done_fd);
-	if (ret) {
-		eprintf("failed to done command pipe, %m\n");
-		goto close_command_fd;
-	}
+	__atomic_store_n(&bs_nr_workers, bs_nr_workers + 1, __ATOMIC_RELEASE);
+	dprintf("started I/O thread %d\n", bs_nr_workers);
+	return w;
+}
 
-	ret = tgt_event_add(done_fd[0], EPOLLIN, bs_thread_request_done, NULL);
-	if (ret) {
-		eprintf("failed to add epoll event\n");
-		goto close_done_fd;
+static void bs_worker_queue(struct bs_worker *w, struct list_head *cmds)
+{
+	pthread_mutex_lock(&w->lock);
+	list_splice_tail_init(cmds, &w->queue);
+	/* so that the next command goes to another idle thread */
+	if (w->idle) {
+		__atomic_store_n(&w->idle, 0, __ATOMIC_RELAXED);
+		pthread_cond_signal(&w->cond);
 	}
+	pthread_mutex_unlock(&w->lock);
+}
 
-	ret = pthread_create(&ack_thread, NULL, bs_thread_ack_fn, NULL);
-	if (ret) {
-		eprintf("failed to create an ack thread, %s\n", strerror(ret));
-		goto event_del;
-	}
+/*
+ * Each idle thread gets one of the commands, then new threads are
+ * started while the pool isn't full. Whatever is left goes to the
+ * next thread in turn, the others take it from there once they are
+ * done.
+ */
+static void bs_pool_queue(struct list_head *cmds)
+{
+	struct bs_worker *w;
+	LIST_HEAD(one);
+	int i;
 
-	ret = write(command_fd[1], &ret, sizeof(ret));
-	if (ret <= 0)
-		goto event_del;
+	pthread_mutex_lock(&bs_pool_lock);
+	for (i = 0; i < bs_nr_workers && !list_empty(cmds); i++) {
+		w = &bs_workers[i];
+		/* a stale answer only costs a less even spread */
+		if (!__atomic_load_n(&w->idle, __ATOMIC_RELAXED))
+			continue;
+		list_move_tail(cmds->next, &one);
+		bs_worker_queue(w, &one);
+	}
 
-	return 0;
-event_del:
-	tgt_event_del(done_fd[0]);
-
-close_done_fd:
-	close(done_fd[0]);
-	close(done_fd[1]);
-close_command_fd:
-	close(command_fd[0]);
-	close(command_fd[1]);
-destroy_cond_mutex:
-	pthread_cond_destroy(&finished_cond);
-	pthread_mutex_destroy(&finished_lock);
+	while (!list_empty(cmds) && bs_nr_workers < bs_max_workers) {
+		w = bs_pool_start_worker();
+		if (!w)
+			break;
+		list_move_tail(cmds->next, &one);
+		bs_worker_queue(w, &one);
+	}
 
-	return 1;
+	if (!list_empty(cmds)) {
+		w = &bs_workers[bs_next_worker++ % bs_nr_workers];
+		bs_worker_queue(w, cmds);
+	}
+	pthread_mutex_unlock(&bs_pool_lock);
 }
 
-int bs_init(void)
+/* hand the batch to the I/O threads, holding back what is over a limit */
+static void bs_batch_flush(struct bs_batch *b)
 {
-	int ret;
+	struct bs_thread_info *info = NULL, *next_info;
+	struct scsi_cmd *cmd, *tmp;
+	LIST_HEAD(run);
+	int limit = 0;
 
-	ret = bs_init_signalfd();
-	if (!ret) {
-		eprintf("use signalfd notification\n");
-		return 0;
-	}
+	tgt_remove_sched_event(&b->flush_event);
+
+	list_for_each_entry_safe(cmd, tmp, &b->cmds, bs_list) {
+		next_info = BS_THREAD_I(cmd->dev);
+		if (next_info != info) {
+			if (info)
+				pthread_mutex_unlock(&info->pending_lock);
+			info = next_info;
+			pthread_mutex_lock(&info->pending_lock);
+
+			limit = info->max_inflight;
+			if (cmd->dev->iodepth &&
+			    (!limit || cmd->dev->iodepth < limit))
+				limit = cmd->dev->iodepth;
+		}
 
-	ret = bs_init_notify_thread();
-	if (!ret) {
-		eprintf("use pthread notification\n");
-		return 0;
+		if (limit && info->inflight >= limit)
+			list_move_tail(&cmd->bs_list, &info->pending_list);
+		else {
+			info->inflight++;
+			list_move_tail(&cmd->bs_list, &run);
+		}
 	}
+	if (info)
+		pthread_mutex_unlock(&info->pending_lock);
 
-	return 1;
+	if (!list_empty(&run))
+		bs_pool_queue(&run);
 }
 
-tgtadm_err bs_thread_open(struct bs_thread_info *info, request_func_t *rfn,
-			  int nr_threads)
+static void bs_batch_flush_event(struct event_data *tev)
 {
-	int i, ret;
+	bs_batch_flush(tev->data);
+}
 
-	info->worker_thread = zalloc(sizeof(pthread_t) * nr_threads);
-	if (!info->worker_thread)
-		return TGTADM_NOMEM;
+int bs_init(void)
+{
+	struct bs_done_queue *q;
+	int i, ret;
 
-	eprintf("%d\n", nr_threads);
-	info->request_fn = rfn;
+	bs_done_queues = zalloc(sizeof(*bs_done_queues) * nr_reactors);
+	bs_batches = zalloc(sizeof(*bs_batches) * nr_reactors);
+	if (!bs_done_queues || !bs_batches) {
+		free(bs_done_queues);
+		free(bs_batches);
+		return 1;
+	}
 
-	INIT_LIST_HEAD(&info->pending_list);
+	for (i = 0; i < nr_reactors; i++) {
+		INIT_LIST_HEAD(&bs_batches[i].cmds);
+		tgt_init_sched_event(&bs_batches[i].flush_event,
+				     bs_batch_flush_event, &bs_batches[i]);
 
-	pthread_cond_init(&info->pending_cond, NULL);
-	pthread_mutex_init(&info->pending_lock, NULL);
-	pthread_mutex_init(&info->startup_lock, NULL);
+		q = &bs_done_queues[i];
 
-	pthread_mutex_lock(&info->startup_lock);
-	for (i = 0; i < nr_threads; i++) {
-		ret = pthread_create(&info->worker_thread[i], NULL,
-				     bs_thread_worker_fn, info);
+		q->fd = eventfd(0, EFD_NONBLOCK);
+		if (q->fd < 0) {
+			eprintf("failed to create an eventfd, %m\n");
+			goto fail;
+		}
 
+		ret = tgt_reactor_event_add(tgt_reactor_get(i), q->fd, EPOLLIN,
+					    bs_done_handler, q);
 		if (ret) {
-			eprintf("failed to create a worker thread, %d %s\n",
-				i, strerror(ret));
-			if (ret)
-				goto destroy_threads;
+			close(q->fd);
+			goto fail;
 		}
 	}
-	pthread_mutex_unlock(&info->startup_lock);
-	info->nr_worker_threads = nr_threads;
 
-	return TGTADM_SUCCESS;
-destroy_threads:
-	info->stop = 1;
-
-	pthread_mutex_unlock(&info->startup_lock);
-	for (; i > 0; i--) {
-		pthread_join(info->worker_thread[i - 1], NULL);
-		eprintf("stopped the worker thread %d\n", i - 1);
+	return 0;
+fail:
+	while (--i >= 0) {
+		q = &bs_done_queues[i];
+		tgt_reactor_event_del(tgt_reactor_get(i), q->fd);
+		close(q->fd);
 	}
+	free(bs_done_queues);
+	bs_done_queues = NULL;
+	free(bs_batches);
+	bs_batches = NULL;
 
-	pthread_cond_destroy(&info->pending_cond);
-	pthread_mutex_destroy(&info->pending_lock);
-	pthread_mutex_destroy(&info->startup_lock);
-	free(info->worker_thread);
-
-	return TGTADM_NOMEM;
+	return 1;
 }
 
-void bs_thread_close(struct bs_thread_info *info)
+/*
+ * At most @max_inflight commands of the LU run at once, 0 for no limit
+ * other than the LU's iodepth.
+ */
+tgtadm_err bs_thread_open(struct bs_thread_info *info, request_func_t *rfn,
+			  int max_inflight)
 {
-	int i;
+	int ret = 0;
 
-	info->stop = 1;
-	pthread_cond_broadcast(&info->pending_cond);
+	pthread_mutex_lock(&bs_pool_lock);
+	if (!bs_workers)
+		ret = bs_pool_init();
+	pthread_mutex_unlock(&bs_pool_lock);
+	if (ret)
+		return TGTADM_NOMEM;
 
-	for (i = 0; info->worker_thread[i] && i < info->nr_worker_threads; i++)
-		pthread_join(info->worker_thread[i], NULL);
+	info->request_fn = rfn;
+	info->max_inflight = max_inflight;
+	info->inflight = 0;
+	INIT_LIST_HEAD(&info->pending_list);
+	pthread_mutex_init(&info->pending_lock, NULL);
 
-	pthread_cond_destroy(&info->pending_cond);
-	pthread_mutex_destroy(&info->pending_lock);
-	pthread_mutex_destroy(&info->startup_lock);
-	free(info->worker_thread);
+	return TGTADM_SUCCESS;
+}
 
-	info->stop = 0;
+void bs_thread_close(struct bs_thread_info *info)
+{
+	pthread_mutex_destroy(&info->pending_lock);
 }
 
 int bs_thread_cmd_submit(struct scsi_cmd *cmd)
 {
-	struct scsi_lu *lu = cmd->dev;
-	struct bs_thread_info *info = BS_THREAD_I(lu);
-
-	pthread_mutex_lock(&info->pending_lock);
+	struct tgt_reactor *r = tgt_current_reactor();
+	struct bs_batch *b;
 
-	list_add_tail(&cmd->bs_list, &info->pending_list);
-
-	pthread_mutex_unlock(&info->pending_lock);
+	set_cmd_async(cmd);
 
-	pthread_cond_signal(&info->pending_cond);
+	/* may be another reactor's command, queued behind one of ours */
+	b = &bs_batches[r ? tgt_reactor_id(r) : 0];
+	list_add_tail(&cmd->bs_list, &b->cmds);
 
-	set_cmd_async(cmd);
+	if (cmd_not_last(cmd))
+		tgt_add_sched_event(&b->flush_event);
+	else
+		bs_batch_flush(b);
 
 	return 0;
 }
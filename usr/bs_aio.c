@@ -22,6 +22,7 @@
  */
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,18 +39,54 @@
 #include "tgtd.h"
 #include "target.h"
 #include "scsi.h"
+#include "spc.h"
+#include "parser.h"
+#include "bs_thread.h"
 
 #ifndef O_DIRECT
 #define O_DIRECT 040000
 #endif
 
-#define AIO_MAX_IODEPTH    128
+#define AIO_DEF_IODEPTH    128
+#define AIO_MAX_IODEPTH    4096
+
+/* in iocb data, a struct bs_aio_req rather than the command */
+#define AIO_REQ_TAG        1UL
+
+/*
+ * A command that takes more than one request, each one submitted once
+ * the one before it has completed: a write followed by a sync, the
+ * read of VERIFY compared to the data out, and so on. WRITE SAME,
+ * UNMAP and the rest go to the I/O threads, see bs_aio_cmd_submit().
+ */
+struct bs_aio_step {
+	int opcode;
+	/* compare what was read with the data out */
+	int compare;
+	void *buf;
+	uint32_t len;
+};
+
+struct bs_aio_req {
+	struct scsi_cmd *cmd;
+	/* on req_wait_list of the LU until the next step is submitted */
+	struct list_head list;
+	/* read buffer of the compare */
+	void *buf;
+	int nr_steps;
+	int step;
+	struct bs_aio_step steps[3];
+};
 
 struct bs_aio_info {
-	struct list_head dev_list_entry;
+	/* first, for the commands the I/O threads do */
+	struct bs_thread_info th;
+
 	io_context_t ctx;
 
 	struct list_head cmd_wait_list;
+	/* requests waiting for their next step, submitted first */
+	struct list_head req_wait_list;
 	unsigned int nwaiting;
 	unsigned int npending;
 	unsigned int iodepth;
@@ -59,70 +96,134 @@ struct bs_aio_info {
 	struct scsi_lu *lu;
 	int evt_fd;
 
-	struct iocb iocb_arr[AIO_MAX_IODEPTH];
-	struct iocb *piocb_arr[AIO_MAX_IODEPTH];
-	struct io_event io_evts[AIO_MAX_IODEPTH];
-};
+	struct iocb *iocb_arr;
+	struct iocb **piocb_arr;
+	struct io_event *io_evts;
 
-static struct list_head bs_aio_dev_list = LIST_HEAD_INIT(bs_aio_dev_list);
+	/*
+	 * one per event loop, submits what a batch left waiting, see
+	 * bs_aio_cmd_submit()
+	 */
+	struct event_data *flush_events;
+};
 
 static inline struct bs_aio_info *BS_AIO_I(struct scsi_lu *lu)
 {
 	return (struct bs_aio_info *) ((char *)lu + sizeof(*lu));
 }
 
-static void bs_aio_iocb_prep(struct bs_aio_info *info, int idx,
-			     struct scsi_cmd *cmd)
+static inline struct event_data *bs_aio_flush_event(struct bs_aio_info *info)
+{
+	struct tgt_reactor *r = tgt_current_reactor();
+
+	if (!r)
+		r = tgt_main_reactor();
+	return &info->flush_events[tgt_reactor_id(r)];
+}
+
+static void bs_aio_iocb_set(struct bs_aio_info *info, int idx, void *data,
+			    int opcode, void *buf, unsigned long nbytes,
+			    uint64_t offset)
 {
 	struct iocb *iocb = &info->iocb_arr[idx];
-	unsigned int scsi_op = (unsigned int)cmd->scb[0];
 
-	iocb->data = cmd;
-	iocb->key = 0;
-	iocb->aio_reqprio = 0;
+	memset(iocb, 0, sizeof(*iocb));
+	iocb->data = data;
 	iocb->aio_fildes = info->lu->fd;
+	iocb->aio_lio_opcode = opcode;
+	iocb->u.c.buf = buf;
+	iocb->u.c.nbytes = nbytes;
+	iocb->u.c.offset = offset;
+	iocb->u.c.flags |= (1 << 0); /* IOCB_FLAG_RESFD - use eventfd file desc. */
+	iocb->u.c.resfd = info->evt_fd;
+}
+
+static void bs_aio_iocb_prep(struct bs_aio_info *info, int idx,
+			     struct scsi_cmd *cmd)
+{
+	unsigned int scsi_op = (unsigned int)cmd->scb[0];
 
 	switch (scsi_op) {
 	case WRITE_6:
 	case WRITE_10:
 	case WRITE_12:
 	case WRITE_16:
-		iocb->aio_lio_opcode = IO_CMD_PWRITE;
-		iocb->u.c.buf = scsi_get_out_buffer(cmd);
-		iocb->u.c.nbytes = scsi_get_out_length(cmd);
+		bs_aio_iocb_set(info, idx, cmd, IO_CMD_PWRITE,
+				scsi_get_out_buffer(cmd),
+				scsi_get_out_length(cmd), cmd->offset);
 
-		dprintf("prep WR cmd:%p op:%x buf:0x%p sz:%lx\n",
-			cmd, scsi_op, iocb->u.c.buf, iocb->u.c.nbytes);
+		dprintf("prep WR cmd:%p op:%x buf:0x%p sz:%x\n",
+			cmd, scsi_op, scsi_get_out_buffer(cmd),
+			scsi_get_out_length(cmd));
 		break;
 
 	case READ_6:
 	case READ_10:
 	case READ_12:
 	case READ_16:
-		iocb->aio_lio_opcode = IO_CMD_PREAD;
-		iocb->u.c.buf = scsi_get_in_buffer(cmd);
-		iocb->u.c.nbytes = scsi_get_in_length(cmd);
+		bs_aio_iocb_set(info, idx, cmd, IO_CMD_PREAD,
+				scsi_get_in_buffer(cmd),
+				scsi_get_in_length(cmd), cmd->offset);
 
-		dprintf("prep RD cmd:%p op:%x buf:0x%p sz:%lx\n",
-			cmd, scsi_op, iocb->u.c.buf, iocb->u.c.nbytes);
+		dprintf("prep RD cmd:%p op:%x buf:0x%p sz:%x\n",
+			cmd, scsi_op, scsi_get_in_buffer(cmd),
+			scsi_get_in_length(cmd));
 		break;
 
-	default:
-		return;
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+		bs_aio_iocb_set(info, idx, cmd, IO_CMD_FDSYNC, NULL, 0, 0);
+		dprintf("prep SYNC cmd:%p op:%x\n", cmd, scsi_op);
+		break;
 	}
+}
 
-	iocb->u.c.offset = cmd->offset;
-	iocb->u.c.flags |= (1 << 0); /* IOCB_FLAG_RESFD - use eventfd file desc. */
-	iocb->u.c.resfd = info->evt_fd;
+static void bs_aio_req_prep(struct bs_aio_info *info, int idx,
+			    struct bs_aio_req *req)
+{
+	struct bs_aio_step *step = &req->steps[req->step];
+	uint64_t offset = 0;
+
+	/* the kernel rejects an fdsync with any offset set */
+	if (step->opcode != IO_CMD_FDSYNC)
+		offset = req->cmd->offset;
+
+	bs_aio_iocb_set(info, idx, (void *)((unsigned long)req | AIO_REQ_TAG),
+			step->opcode, step->buf, step->len, offset);
+
+	dprintf("prep step %d of %d cmd:%p op:%x aio op:%d sz:%x\n",
+		req->step + 1, req->nr_steps, req->cmd, req->cmd->scb[0],
+		step->opcode, step->len);
 }
 
+/* commands in flight the LU allows, its iodepth may be set lower */
+static unsigned int bs_aio_depth(struct bs_aio_info *info)
+{
+	int depth = info->lu->iodepth;
+
+	if (depth > 0 && depth < info->iodepth)
+		return depth;
+	return info->iodepth;
+}
+
+static void bs_aio_wait(struct bs_aio_info *info)
+{
+	info->nwaiting++;
+}
+
+/* called with the LU lock held */
 static int bs_aio_submit_dev_batch(struct bs_aio_info *info)
 {
 	int nsubmit, nsuccess;
 	struct scsi_cmd *cmd, *next;
+	struct bs_aio_req *req, *rnext;
+	unsigned long data;
 	int i = 0;
 
-	nsubmit = info->iodepth - info->npending; /* max allowed to submit */
+	/* max allowed to submit */
+	nsubmit = (int)bs_aio_depth(info) - (int)info->npending;
+	if (nsubmit < 0)
+		nsubmit = 0;
 	if (nsubmit > info->nwaiting)
 		nsubmit = info->nwaiting;
 
@@ -133,11 +234,19 @@ static int bs_aio_submit_dev_batch(struct bs_aio_info *info)
 	if (!nsubmit)
 		return 0;
 
+	/* the next steps of the commands already in flight go first */
+	list_for_each_entry_safe(req, rnext, &info->req_wait_list, list) {
+		if (i == nsubmit)
+			break;
+		bs_aio_req_prep(info, i++, req);
+		list_del(&req->list);
+	}
+
 	list_for_each_entry_safe(cmd, next, &info->cmd_wait_list, bs_list) {
-		bs_aio_iocb_prep(info, i, cmd);
-		list_del(&cmd->bs_list);
-		if (++i == nsubmit)
+		if (i == nsubmit)
 			break;
+		bs_aio_iocb_prep(info, i++, cmd);
+		list_del(&cmd->bs_list);
 	}
 
 	nsuccess = io_submit(info->ctx, nsubmit, info->piocb_arr);
@@ -157,16 +266,19 @@ static int bs_aio_submit_dev_batch(struct bs_aio_info *info)
 	}
 	if (unlikely(nsuccess < nsubmit)) {
 		for (i=nsubmit-1; i >= nsuccess; i--) {
-			cmd = info->iocb_arr[i].data;
-			list_add(&cmd->bs_list, &info->cmd_wait_list);
+			data = (unsigned long)info->iocb_arr[i].data;
+			if (data & AIO_REQ_TAG) {
+				req = (void *)(data & ~AIO_REQ_TAG);
+				list_add(&req->list, &info->req_wait_list);
+			} else {
+				cmd = (void *)data;
+				list_add(&cmd->bs_list, &info->cmd_wait_list);
+			}
 		}
 	}
 
 	info->npending += nsuccess;
 	info->nwaiting -= nsuccess;
-	/* if no cmds remain, remove the dev from the pending list */
-	if (likely(!info->nwaiting))
-			list_del(&info->dev_list_entry);
 
 	dprintf("submitted %d of %d cmds to tgt:%d lun:%"PRId64
 		", waiting:%d pending:%d\n",
@@ -175,70 +287,258 @@ static int bs_aio_submit_dev_batch(struct bs_aio_info *info)
 	return 0;
 }
 
-static int bs_aio_submit_all_devs(void)
+static void bs_aio_req_add_step(struct bs_aio_req *req, int opcode,
+				int compare, void *buf, uint32_t len)
+{
+	struct bs_aio_step *step = &req->steps[req->nr_steps++];
+
+	step->opcode = opcode;
+	step->compare = compare;
+	step->buf = buf;
+	step->len = len;
+}
+
+/* FUA, or the write cache is off */
+static int bs_aio_write_needs_sync(struct scsi_cmd *cmd, struct mode_pg *pg)
+{
+	return ((cmd->scb[0] != WRITE_6) && (cmd->scb[1] & 0x8)) ||
+		!(pg->mode_data[0] & 0x04);
+}
+
+/*
+ * Sets *reqp to the steps of a command that takes more than one
+ * request, NULL if the command is a request of its own. Returns 1 if
+ * the I/O threads should do the command instead, -ENOMEM if memory
+ * ran out.
+ */
+static int bs_aio_req_get(struct scsi_cmd *cmd, struct bs_aio_req **reqp)
 {
-	struct bs_aio_info *dev_info, *next_dev;
-	int err;
-
-	/* pass over all devices having some queued cmds and submit */
-	list_for_each_entry_safe(dev_info, next_dev, &bs_aio_dev_list, dev_list_entry) {
-		err = bs_aio_submit_dev_batch(dev_info);
-		if (unlikely(err))
-			return err;
+	struct bs_aio_req *req;
+	struct mode_pg *pg = NULL;
+	uint32_t length = scsi_get_out_length(cmd);
+	char *out = scsi_get_out_buffer(cmd);
+	int write = 0, sync = 0, verify = 0;
+
+	*reqp = NULL;
+
+	switch (cmd->scb[0]) {
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_12:
+	case WRITE_VERIFY_16:
+	case COMPARE_AND_WRITE:
+		/* the I/O threads know how to fail it */
+		pg = find_mode_page(cmd->dev, 0x08, 0);
+		if (!pg)
+			return 1;
+		sync = bs_aio_write_needs_sync(cmd, pg);
+		break;
+	}
+
+	switch (cmd->scb[0]) {
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+		/* a plain write is just the command */
+		if (!sync)
+			return 0;
+		write = 1;
+		break;
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_12:
+	case WRITE_VERIFY_16:
+		write = verify = 1;
+		break;
+	case VERIFY_10:
+	case VERIFY_12:
+	case VERIFY_16:
+		verify = 1;
+		break;
+	case COMPARE_AND_WRITE:
+		/*
+		 * The blocks to compare come first, then the ones to
+		 * write if they matched.
+		 */
+		length /= 2;
+		if (length != cmd->tl)
+			return 1;
+		write = 1;
+		break;
+	default:
+		return 1;
+	}
+
+	if (!length)
+		return 1;
+
+	req = zalloc(sizeof(*req));
+	if (!req)
+		return -ENOMEM;
+	req->cmd = cmd;
+
+	if (verify || cmd->scb[0] == COMPARE_AND_WRITE) {
+		/* aligned for O_DIRECT */
+		if (posix_memalign(&req->buf, 4096, length)) {
+			free(req);
+			return -ENOMEM;
+		}
 	}
+
+	if (cmd->scb[0] == COMPARE_AND_WRITE) {
+		bs_aio_req_add_step(req, IO_CMD_PREAD, 1, req->buf, length);
+		out += length;
+	}
+	if (write)
+		bs_aio_req_add_step(req, IO_CMD_PWRITE, 0, out, length);
+	if (write && sync)
+		bs_aio_req_add_step(req, IO_CMD_FDSYNC, 0, NULL, 0);
+	if (verify)
+		bs_aio_req_add_step(req, IO_CMD_PREAD, 1, req->buf, length);
+
+	*reqp = req;
 	return 0;
 }
 
+static void bs_aio_req_free(struct bs_aio_req *req)
+{
+	free(req->buf);
+	free(req);
+}
+
 static int bs_aio_cmd_submit(struct scsi_cmd *cmd)
 {
 	struct scsi_lu *lu = cmd->dev;
 	struct bs_aio_info *info = BS_AIO_I(lu);
 	unsigned int scsi_op = (unsigned int)cmd->scb[0];
+	struct bs_aio_req *req = NULL;
+	int ret;
 
 	switch (scsi_op) {
-	case WRITE_6:
-	case WRITE_10:
-	case WRITE_12:
-	case WRITE_16:
 	case READ_6:
 	case READ_10:
 	case READ_12:
 	case READ_16:
 		break;
 
-	case WRITE_SAME:
-	case WRITE_SAME_16:
-		eprintf("WRITE_SAME not yet supported for AIO backend.\n");
-		return -1;
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_12:
+	case WRITE_VERIFY_16:
+	case VERIFY_10:
+	case VERIFY_12:
+	case VERIFY_16:
+	case COMPARE_AND_WRITE:
+		ret = bs_aio_req_get(cmd, &req);
+		if (ret < 0)
+			return ret;
+		if (ret)
+			return bs_thread_cmd_submit(cmd);
+		break;
 
 	case SYNCHRONIZE_CACHE:
 	case SYNCHRONIZE_CACHE_16:
+		/* IMMED isn't supported, the I/O threads say so */
+		if (cmd->scb[1] & 0x2)
+			return bs_thread_cmd_submit(cmd);
+		break;
+
 	default:
-		dprintf("skipped cmd:%p op:%x\n", cmd, scsi_op);
-		return 0;
+		/*
+		 * WRITE SAME, UNMAP and the like have no AIO
+		 * counterpart; they are done the rdwr way.
+		 */
+		dprintf("cmd:%p op:%x to the I/O threads\n", cmd, scsi_op);
+		return bs_thread_cmd_submit(cmd);
 	}
 
-	list_add_tail(&cmd->bs_list, &info->cmd_wait_list);
-	if (!info->nwaiting)
-		list_add_tail(&info->dev_list_entry, &bs_aio_dev_list);
-	info->nwaiting++;
+	if (req)
+		list_add_tail(&req->list, &info->req_wait_list);
+	else
+		list_add_tail(&cmd->bs_list, &info->cmd_wait_list);
+	bs_aio_wait(info);
 	set_cmd_async(cmd);
 
-	if (!cmd_not_last(cmd)) /* last cmd in batch */
-		return bs_aio_submit_all_devs();
+	if (!cmd_not_last(cmd)) { /* last cmd in batch */
+		tgt_remove_sched_event(bs_aio_flush_event(info));
+		return bs_aio_submit_dev_batch(info);
+	}
 
-	if (info->nwaiting == info->iodepth - info->npending)
+	if (info->nwaiting + info->npending >= bs_aio_depth(info))
 		return bs_aio_submit_dev_batch(info);
 
+	/* in case no last cmd follows before the event loop sleeps */
+	tgt_add_sched_event(bs_aio_flush_event(info));
 	return 0;
 }
 
-static void bs_aio_complete_one(struct io_event *ep)
+static void bs_aio_flush(struct event_data *tev)
+{
+	struct bs_aio_info *info = tev->data;
+
+	pthread_mutex_lock(&info->lu->lu_lock);
+	bs_aio_submit_dev_batch(info);
+	pthread_mutex_unlock(&info->lu->lu_lock);
+}
+
+/*
+ * Finished commands are put on @done with their result set, to be
+ * completed once the LU lock is dropped.
+ */
+static void bs_aio_cmd_done(struct scsi_cmd *cmd, int result,
+			    struct list_head *done)
+{
+	scsi_set_result(cmd, result);
+	list_add_tail(&cmd->bs_list, done);
+}
+
+/* on to the next step, or done */
+static void bs_aio_req_complete(struct bs_aio_info *info,
+				struct bs_aio_req *req, struct io_event *ep,
+				struct list_head *done)
+{
+	struct bs_aio_step *step = &req->steps[req->step];
+	struct scsi_cmd *cmd = req->cmd;
+	int result = SAM_STAT_GOOD;
+
+	if (unlikely(ep->res != step->len)) {
+		sense_data_build(cmd, MEDIUM_ERROR, 0);
+		result = SAM_STAT_CHECK_CONDITION;
+	} else if (step->compare &&
+		   memcmp(step->buf, scsi_get_out_buffer(cmd), step->len)) {
+		sense_data_build(cmd, MISCOMPARE,
+				 ASC_MISCOMPARE_DURING_VERIFY_OPERATION);
+		result = SAM_STAT_CHECK_CONDITION;
+	} else if (++req->step < req->nr_steps) {
+		list_add_tail(&req->list, &info->req_wait_list);
+		bs_aio_wait(info);
+		return;
+	}
+
+	dprintf("cmd: %p steps: %d/%d\n", cmd, req->step, req->nr_steps);
+	bs_aio_req_free(req);
+	bs_aio_cmd_done(cmd, result, done);
+}
+
+static void bs_aio_complete_one(struct bs_aio_info *info, struct io_event *ep,
+				struct list_head *done)
 {
 	struct scsi_cmd *cmd = (void *)(unsigned long)ep->data;
 	uint32_t length;
 	int result;
 
+	if ((unsigned long)ep->data & AIO_REQ_TAG) {
+		bs_aio_req_complete(info, (void *)((unsigned long)ep->data &
+						   ~AIO_REQ_TAG), ep, done);
+		return;
+	}
+
 	switch (cmd->scb[0]) {
 	case WRITE_6:
 	case WRITE_10:
@@ -258,13 +558,15 @@ static void bs_aio_complete_one(struct io_event *ep)
 		result = SAM_STAT_CHECK_CONDITION;
 	}
 	dprintf("cmd: %p\n", cmd);
-	target_cmd_io_done(cmd, result);
+	bs_aio_cmd_done(cmd, result, done);
 }
 
 static void bs_aio_get_completions(int fd, int events, void *data)
 {
 	struct bs_aio_info *info = data;
+	struct scsi_cmd *cmd, *next;
 	int i, ret;
+	LIST_HEAD(done);
 	/* read from eventfd returns 8-byte int, fails with the error EINVAL
 	   if the size of the supplied buffer is less than 8 bytes */
 	uint64_t evts_complete;
@@ -281,8 +583,9 @@ retry_read:
 	}
 	ncomplete = (unsigned int) evts_complete;
 
+	pthread_mutex_lock(&info->lu->lu_lock);
 	while (ncomplete) {
-		nevents = min_t(unsigned int, ncomplete, ARRAY_SIZE(info->io_evts));
+		nevents = min_t(unsigned int, ncomplete, info->iodepth);
 retry_getevts:
 		ret = io_getevents(info->ctx, 1, nevents, info->io_evts, NULL);
 		if (likely(ret > 0)) {
@@ -292,13 +595,13 @@ retry_getevts:
 			if (ret == -EINTR)
 				goto retry_getevts;
 			eprintf("io_getevents failed, err:%d\n", -ret);
-			return;
+			break;
 		}
 		dprintf("got %d ioevents out of %d, pending %d\n",
 			nevents, ncomplete, info->npending);
 
 		for (i = 0; i < nevents; i++)
-			bs_aio_complete_one(&info->io_evts[i]);
+			bs_aio_complete_one(info, &info->io_evts[i], &done);
 		ncomplete -= nevents;
 	}
 
@@ -307,6 +610,12 @@ retry_getevts:
 			info->lu->tgt->tid, info->lu->lun);
 		bs_aio_submit_dev_batch(info);
 	}
+	pthread_mutex_unlock(&info->lu->lu_lock);
+
+	list_for_each_entry_safe(cmd, next, &done, bs_list) {
+		list_del(&cmd->bs_list);
+		target_cmd_io_done(cmd, scsi_get_result(cmd));
+	}
 }
 
 static int bs_aio_open(struct scsi_lu *lu, char *path, int *fd, uint64_t *size)
@@ -315,7 +624,6 @@ static int bs_aio_open(struct scsi_lu *lu, char *path, int *fd, uint64_t *size)
 	int ret, afd;
 	uint32_t blksize = 0;
 
-	info->iodepth = AIO_MAX_IODEPTH;
 	eprintf("create aio context for tgt:%d lun:%"PRId64 ", max iodepth:%d\n",
 		info->lu->tgt->tid, info->lu->lun, info->iodepth);
 	ret = io_setup(info->iodepth, &info->ctx);
@@ -380,28 +688,112 @@ static void bs_aio_close(struct scsi_lu *lu)
 	close(lu->fd);
 }
 
+static int bs_aio_parse_opts(struct bs_aio_info *info, char *opts)
+{
+	enum {
+		Opt_depth, Opt_err,
+	};
+	match_table_t tokens = {
+		{Opt_depth, "depth=%d"},
+		{Opt_err, NULL},
+	};
+	substring_t args[MAX_OPT_ARGS];
+	char *buf, *s, *p;
+	int ret = 0, val;
+
+	info->iodepth = AIO_DEF_IODEPTH;
+
+	if (!opts)
+		return 0;
+
+	buf = s = strdup(opts);
+	if (!buf)
+		return -ENOMEM;
+
+	while (!ret && (p = strsep(&s, ";")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, tokens, args)) {
+		case Opt_depth:
+			if (match_int(&args[0], &val) || val < 1 ||
+			    val > AIO_MAX_IODEPTH)
+				ret = -EINVAL;
+			else
+				info->iodepth = val;
+			break;
+		default:
+			ret = -EINVAL;
+			break;
+		}
+		if (ret)
+			eprintf("invalid backing store option %s\n", p);
+	}
+
+	free(buf);
+	return ret;
+}
+
+static void bs_aio_free_arrays(struct bs_aio_info *info)
+{
+	free(info->iocb_arr);
+	free(info->piocb_arr);
+	free(info->io_evts);
+	free(info->flush_events);
+}
+
 static tgtadm_err bs_aio_init(struct scsi_lu *lu)
 {
 	struct bs_aio_info *info = BS_AIO_I(lu);
-	int i;
+	tgtadm_err adm_err;
+	int i, ret;
 
 	memset(info, 0, sizeof(*info));
-	INIT_LIST_HEAD(&info->dev_list_entry);
 	INIT_LIST_HEAD(&info->cmd_wait_list);
+	INIT_LIST_HEAD(&info->req_wait_list);
 	info->lu = lu;
 
-	for (i=0; i < ARRAY_SIZE(info->iocb_arr); i++)
+	ret = bs_aio_parse_opts(info, lu->bsopts);
+	if (ret)
+		return ret == -ENOMEM ? TGTADM_NOMEM : TGTADM_INVALID_REQUEST;
+
+	info->iocb_arr = calloc(info->iodepth, sizeof(*info->iocb_arr));
+	info->piocb_arr = calloc(info->iodepth, sizeof(*info->piocb_arr));
+	info->io_evts = calloc(info->iodepth, sizeof(*info->io_evts));
+	info->flush_events = calloc(nr_reactors, sizeof(*info->flush_events));
+	if (!info->iocb_arr || !info->piocb_arr || !info->io_evts ||
+	    !info->flush_events) {
+		bs_aio_free_arrays(info);
+		return TGTADM_NOMEM;
+	}
+
+	for (i=0; i < info->iodepth; i++)
 		info->piocb_arr[i] = &info->iocb_arr[i];
+	for (i = 0; i < nr_reactors; i++)
+		tgt_init_sched_event(&info->flush_events[i], bs_aio_flush,
+				     info);
+
+	adm_err = bs_thread_open(&info->th, bs_rdwr_request, 0);
+	if (adm_err)
+		bs_aio_free_arrays(info);
 
-	return TGTADM_SUCCESS;
+	return adm_err;
 }
 
 static void bs_aio_exit(struct scsi_lu *lu)
 {
 	struct bs_aio_info *info = BS_AIO_I(lu);
+	int i;
+
+	/* the other event loops are held off while a LU goes away */
+	for (i = 0; i < nr_reactors; i++)
+		tgt_remove_sched_event(&info->flush_events[i]);
 
+	tgt_event_del(info->evt_fd);
 	close(info->evt_fd);
 	io_destroy(info->ctx);
+	bs_thread_close(&info->th);
+	bs_aio_free_arrays(info);
 }
 
 static struct backingstore_template aio_bst = {
@@ -503,7 +503,7 @@ static tgtadm_err bs_rbd_init(struct scsi_lu *lu)
 		eprintf("bs_rbd_init: rados_connect: %d\n", rados_ret);
 		goto fail;
 	}
-	ret = bs_thread_open(info, bs_rbd_request, nr_iothreads);
+	ret = bs_thread_open(info, bs_rbd_request, 0);
 	if (ret == TGTADM_SUCCESS)
 		return ret;
 fail:
@@ -66,7 +66,7 @@ static void bs_sync_sync_range(struct scsi_cmd *cmd, uint32_t length,
 		set_medium_error(result, key, asc);
 }
 
-static void bs_rdwr_request(struct scsi_cmd *cmd)
+void bs_rdwr_request(struct scsi_cmd *cmd)
 {
 	int ret, fd = cmd->dev->fd;
 	uint32_t length;
@@ -412,7 +412,7 @@ static tgtadm_err bs_rdwr_init(struct scsi_lu *lu)
 {
 	struct bs_thread_info *info = BS_THREAD_I(lu);
 
-	return bs_thread_open(info, bs_rdwr_request, nr_iothreads);
+	return bs_thread_open(info, bs_rdwr_request, 0);
 }
 
 static void bs_rdwr_exit(struct scsi_lu *lu)
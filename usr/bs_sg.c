@@ -34,6 +34,7 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/epoll.h>
 #include <scsi/sg.h>
 
@@ -145,9 +146,11 @@ static int bs_bsg_cmd_submit(struct scsi_cmd *cmd)
 	io_hdr.din_xfer_len = scsi_get_in_length(cmd);
 	io_hdr.din_xferp = (unsigned long)scsi_get_in_buffer(cmd);
 
-	io_hdr.max_response_len = sizeof(cmd->sense_buffer);
 	/* SCSI: (auto)sense data */
-	io_hdr.response = (unsigned long)cmd->sense_buffer;
+	if (sense_buffer_alloc(cmd)) {
+		io_hdr.max_response_len = SCSI_SENSE_BUFFERSIZE;
+		io_hdr.response = (unsigned long)cmd->sense_buffer;
+	}
 	/* Using the same 2000 millisecond timeout.. */
 	io_hdr.timeout = sg_timeout;
 	/* [i->o] unused internally */
@@ -212,8 +215,10 @@ static int bs_sg_cmd_submit(struct scsi_cmd *cmd)
 		io_hdr.dxfer_len = scsi_get_in_length(cmd);
 		io_hdr.dxferp = (void *)scsi_get_in_buffer(cmd);
 	}
-	io_hdr.mx_sb_len = sizeof(cmd->sense_buffer);
-	io_hdr.sbp = cmd->sense_buffer;
+	if (sense_buffer_alloc(cmd)) {
+		io_hdr.mx_sb_len = SCSI_SENSE_BUFFERSIZE;
+		io_hdr.sbp = cmd->sense_buffer;
+	}
 	io_hdr.timeout = sg_timeout;
 	io_hdr.pack_id = -1;
 	io_hdr.usr_ptr = cmd;
@@ -265,7 +270,8 @@ static void bs_bsg_cmd_complete(int fd, int events, void *data)
 		 * NAB: Used by linux/block/bsg.c:bsg_ioctl(), is this
 		 * right..?
 		 */
-		cmd->sense_len = SCSI_SENSE_BUFFERSIZE;
+		if (cmd->sense_buffer)
+			cmd->sense_len = SCSI_SENSE_BUFFERSIZE;
 		scsi_set_out_resid_by_actual(cmd, 0);
 		scsi_set_in_resid_by_actual(cmd, 0);
 	}
@@ -50,7 +50,7 @@ static void ssc_sense_data_build(struct scsi_cmd *cmd, uint8_t key,
 	/* TODO: support descriptor format */
 
 	sense_data_build(cmd, key, asc);
-	if (info_len) {
+	if (info_len && cmd->sense_len) {
 		memcpy(cmd->sense_buffer + 3, info, 4);
 		cmd->sense_buffer[0] |= 0x80;
 	}
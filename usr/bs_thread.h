@@ -1,20 +1,15 @@
 typedef void (request_func_t) (struct scsi_cmd *);
 
 struct bs_thread_info {
-	pthread_t *worker_thread;
-	int nr_worker_threads;
+	/* commands of the LU run at once, 0 for no limit */
+	int max_inflight;
 
-	/* wokers sleep on this and signaled by tgtd */
-	pthread_cond_t pending_cond;
-	/* locked by tgtd and workers */
 	pthread_mutex_t pending_lock;
 	/* protected by pending_lock */
+	int inflight;
+	/* held back by the limit, protected by pending_lock */
 	struct list_head pending_list;
 
-	pthread_mutex_t startup_lock;
-
-	int stop;
-
 	request_func_t *request_fn;
 };
 
@@ -24,7 +19,10 @@ static inline struct bs_thread_info *BS_THREAD_I(struct scsi_lu *lu)
 }
 
 extern tgtadm_err bs_thread_open(struct bs_thread_info *info, request_func_t *rfn,
-				 int nr_threads);
+				 int max_inflight);
 extern void bs_thread_close(struct bs_thread_info *info);
 extern int bs_thread_cmd_submit(struct scsi_cmd *cmd);
 extern int nr_iothreads;
+
+/* the synchronous file I/O of the rdwr backing store */
+extern void bs_rdwr_request(struct scsi_cmd *cmd);
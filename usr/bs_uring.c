@@ -0,0 +1,961 @@
+/*
+ * io_uring backing store routine
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
+#include <linux/io_uring.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+#include "target.h"
+#include "scsi.h"
+#include "spc.h"
+#include "parser.h"
+#include "bs_thread.h"
+
+/*
+ * Each LU has a ring of its own, with the backing file registered as
+ * its only fixed file and the buffer regions of the transports (see
+ * bs_buf_region_add()) registered as fixed buffers. Reads, writes,
+ * cache syncs, PRE-FETCH, WRITE SAME and UNMAP go through the ring;
+ * everything else, and anything too big for the ring, is done by the
+ * I/O threads the way the rdwr backing store does it.
+ *
+ * Commands the transport marks as not the last of a burst only fill
+ * the ring; it is entered once for the whole burst.
+ */
+#define URING_DEF_DEPTH		128
+#define URING_MAX_DEPTH		4096
+
+/* blocks a single WRITE SAME sqe writes */
+#define URING_WS_BLOCKS		1024
+
+/* in sqe user_data, a struct bs_uring_req rather than the command */
+#define URING_REQ_TAG		1UL
+
+/* a command that takes more than one sqe */
+struct bs_uring_req {
+	struct scsi_cmd *cmd;
+	/* sqes not completed yet */
+	int nr;
+	int failed;
+	uint64_t done;
+	uint64_t want;
+	struct iovec iov[0];
+};
+
+struct bs_uring_info {
+	/* first, for the commands the I/O threads do */
+	struct bs_thread_info th;
+
+	struct scsi_lu *lu;
+	int ring_fd;
+	int evt_fd;
+	/* idle time of the kernel polling thread in ms, 0 for none */
+	int sqpoll;
+
+	void *sq_ring;
+	size_t sq_ring_sz;
+	unsigned int *sq_tail;
+	unsigned int *sq_flags;
+	unsigned int sq_mask;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+
+	void *cq_ring;
+	size_t cq_ring_sz;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* at most this many sqes are in flight */
+	unsigned int depth;
+	/* sqes filled and not completed yet */
+	unsigned int nr_sqes;
+	/* commands they belong to */
+	unsigned int nr_cmds;
+	/* sqes the kernel hasn't been told about */
+	unsigned int to_submit;
+	unsigned int sqe_tail;
+
+	/* commands waiting for room in the ring */
+	struct list_head cmd_wait_list;
+	/*
+	 * one per event loop, submits what a batch left behind, see
+	 * bs_uring_cmd_submit()
+	 */
+	struct event_data *flush_events;
+
+	int fixed_file;
+	/* buffer regions registered with the ring, -1 if we can't */
+	int nr_bufs;
+};
+
+static inline struct bs_uring_info *BS_URING_I(struct scsi_lu *lu)
+{
+	return (struct bs_uring_info *) ((char *)lu + sizeof(*lu));
+}
+
+static inline struct event_data *
+bs_uring_flush_event(struct bs_uring_info *info)
+{
+	struct tgt_reactor *r = tgt_current_reactor();
+
+	if (!r)
+		r = tgt_main_reactor();
+	return &info->flush_events[tgt_reactor_id(r)];
+}
+
+static inline int sys_io_uring_setup(unsigned int entries,
+				     struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned int to_submit,
+				     unsigned int min_complete,
+				     unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned int opcode,
+					void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* FUA, or the write cache is off */
+static int bs_uring_write_needs_sync(struct scsi_cmd *cmd,
+				     struct mode_pg *pg)
+{
+	return ((cmd->scb[0] != WRITE_6) && (cmd->scb[1] & 0x8)) ||
+		!(pg->mode_data[0] & 0x04);
+}
+
+/*
+ * The number of sqes the command takes, 0 if it is one for the I/O
+ * threads.
+ */
+static int bs_uring_cmd_sqes(struct scsi_cmd *cmd)
+{
+	struct scsi_lu *lu = cmd->dev;
+	struct mode_pg *pg;
+	uint64_t offset, tl;
+	uint32_t length, blocks;
+	char *buf;
+	int nr;
+
+	switch (cmd->scb[0]) {
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		return 1;
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+		/* the I/O threads know how to fail it */
+		pg = find_mode_page(lu, 0x08, 0);
+		if (!pg)
+			return 0;
+		return bs_uring_write_needs_sync(cmd, pg) ? 2 : 1;
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+		/* IMMED isn't supported */
+		return (cmd->scb[1] & 0x2) ? 0 : 1;
+	case PRE_FETCH_10:
+	case PRE_FETCH_16:
+		return 1;
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+		if (cmd->scb[1] & 0x08)
+			return 1;
+		/* PBDATA and LBDATA change every block */
+		if (cmd->scb[1] & 0x06)
+			return 0;
+		blocks = cmd->tl >> lu->blk_shift;
+		return (blocks + URING_WS_BLOCKS - 1) / URING_WS_BLOCKS;
+	case UNMAP:
+		if (!lu->attrs.thinprovisioning)
+			return 0;
+
+		length = scsi_get_out_length(cmd);
+		buf = scsi_get_out_buffer(cmd);
+		if (length < 8)
+			return 0;
+
+		nr = 0;
+		for (length -= 8, buf += 8; length >= 16;
+		     length -= 16, buf += 16) {
+			offset = get_unaligned_be64(&buf[0]) << lu->blk_shift;
+			tl = (uint64_t)get_unaligned_be32(&buf[8]) <<
+				lu->blk_shift;
+			/* the I/O threads report it */
+			if (offset + tl > lu->size)
+				return 0;
+			if (tl)
+				nr++;
+		}
+		return nr;
+	default:
+		return 0;
+	}
+}
+
+/* the index of the fixed buffer holding the data, -1 if there is none */
+static int bs_uring_buf_index(struct bs_uring_info *info, void *buf,
+			      uint32_t len)
+{
+	struct io_uring_rsrc_update2 up;
+	const struct iovec *regions;
+	int idx, nr, ret;
+
+	if (info->nr_bufs < 0)
+		return -1;
+
+	idx = bs_buf_region_find(buf, len);
+	if (idx < 0)
+		return -1;
+
+	if (idx >= info->nr_bufs) {
+		regions = bs_buf_region_table(&nr);
+
+		memset(&up, 0, sizeof(up));
+		up.offset = info->nr_bufs;
+		up.data = (unsigned long)(regions + info->nr_bufs);
+		up.nr = nr - info->nr_bufs;
+
+		ret = sys_io_uring_register(info->ring_fd,
+					    IORING_REGISTER_BUFFERS_UPDATE,
+					    &up, sizeof(up));
+		if (ret < 0) {
+			eprintf("can't register buffers for tgt:%d lun:%"
+				PRIu64 ", %m; not using them\n",
+				info->lu->tgt->tid, info->lu->lun);
+			info->nr_bufs = -1;
+			return -1;
+		}
+		info->nr_bufs = nr;
+	}
+
+	return idx;
+}
+
+static struct io_uring_sqe *bs_uring_get_sqe(struct bs_uring_info *info,
+					     unsigned long data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = &info->sqes[info->sqe_tail++ & info->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = data;
+	if (info->fixed_file) {
+		sqe->fd = 0;
+		sqe->flags = IOSQE_FIXED_FILE;
+	} else
+		sqe->fd = info->lu->fd;
+
+	info->nr_sqes++;
+	info->to_submit++;
+	return sqe;
+}
+
+static void bs_uring_prep_rw(struct bs_uring_info *info,
+			     struct io_uring_sqe *sqe, int write,
+			     void *buf, uint32_t len, uint64_t offset)
+{
+	int idx = bs_uring_buf_index(info, buf, len);
+
+	if (idx < 0)
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	else {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED :
+			IORING_OP_READ_FIXED;
+		sqe->buf_index = idx;
+	}
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = offset;
+}
+
+static struct bs_uring_req *bs_uring_req_alloc(struct scsi_cmd *cmd,
+					       int nr, int nr_iov)
+{
+	struct bs_uring_req *req;
+
+	req = malloc(sizeof(*req) + nr_iov * sizeof(struct iovec));
+	if (!req)
+		return NULL;
+
+	req->cmd = cmd;
+	req->nr = nr;
+	req->failed = 0;
+	req->done = 0;
+	req->want = 0;
+	return req;
+}
+
+/* fills the command's sqes, -EAGAIN if there is no room for them */
+static int bs_uring_cmd_queue(struct bs_uring_info *info,
+			      struct scsi_cmd *cmd)
+{
+	struct scsi_lu *lu = cmd->dev;
+	struct io_uring_sqe *sqe;
+	struct bs_uring_req *req;
+	unsigned long data;
+	uint64_t offset = cmd->offset, tl;
+	uint32_t length, blocks, blksize;
+	char *buf;
+	int i, nr;
+
+	nr = bs_uring_cmd_sqes(cmd);
+	if (!nr)
+		return -EINVAL;
+
+	if (info->nr_sqes + nr > info->depth ||
+	    (lu->iodepth && info->nr_cmds >= lu->iodepth))
+		return -EAGAIN;
+
+	switch (cmd->scb[0]) {
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		sqe = bs_uring_get_sqe(info, (unsigned long)cmd);
+		bs_uring_prep_rw(info, sqe, 0, scsi_get_in_buffer(cmd),
+				 scsi_get_in_length(cmd), offset);
+		break;
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+		length = scsi_get_out_length(cmd);
+		if (nr == 1) {
+			sqe = bs_uring_get_sqe(info, (unsigned long)cmd);
+			bs_uring_prep_rw(info, sqe, 1, scsi_get_out_buffer(cmd),
+					 length, offset);
+			break;
+		}
+
+		/* the sync only runs if the write went fine */
+		req = bs_uring_req_alloc(cmd, 2, 0);
+		if (!req)
+			return -ENOMEM;
+		req->want = length;
+		data = (unsigned long)req | URING_REQ_TAG;
+
+		sqe = bs_uring_get_sqe(info, data);
+		bs_uring_prep_rw(info, sqe, 1, scsi_get_out_buffer(cmd),
+				 length, offset);
+		sqe->flags |= IOSQE_IO_LINK;
+
+		sqe = bs_uring_get_sqe(info, data);
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		break;
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+		sqe = bs_uring_get_sqe(info, (unsigned long)cmd);
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		break;
+	case PRE_FETCH_10:
+	case PRE_FETCH_16:
+		sqe = bs_uring_get_sqe(info, (unsigned long)cmd);
+		sqe->opcode = IORING_OP_FADVISE;
+		sqe->off = offset;
+		sqe->len = cmd->tl;
+		sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+		break;
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+		if (cmd->scb[1] & 0x08) {
+			/* used to punch a hole in the file */
+			sqe = bs_uring_get_sqe(info, (unsigned long)cmd);
+			sqe->opcode = IORING_OP_FALLOCATE;
+			sqe->off = offset;
+			sqe->addr = cmd->tl;
+			sqe->len = FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE;
+			break;
+		}
+
+		/* the same block over and over */
+		blksize = 1 << lu->blk_shift;
+		blocks = cmd->tl >> lu->blk_shift;
+		req = bs_uring_req_alloc(cmd, nr,
+					 min_t(uint32_t, blocks,
+					       URING_WS_BLOCKS));
+		if (!req)
+			return -ENOMEM;
+		req->want = (uint64_t)blocks << lu->blk_shift;
+		data = (unsigned long)req | URING_REQ_TAG;
+
+		buf = scsi_get_out_buffer(cmd);
+		for (i = 0; i < min_t(uint32_t, blocks, URING_WS_BLOCKS); i++) {
+			req->iov[i].iov_base = buf;
+			req->iov[i].iov_len = blksize;
+		}
+
+		while (blocks) {
+			length = min_t(uint32_t, blocks, URING_WS_BLOCKS);
+
+			sqe = bs_uring_get_sqe(info, data);
+			sqe->opcode = IORING_OP_WRITEV;
+			sqe->addr = (unsigned long)req->iov;
+			sqe->len = length;
+			sqe->off = offset;
+
+			offset += (uint64_t)length << lu->blk_shift;
+			blocks -= length;
+		}
+		break;
+	case UNMAP:
+		req = bs_uring_req_alloc(cmd, nr, 0);
+		if (!req)
+			return -ENOMEM;
+		data = (unsigned long)req | URING_REQ_TAG;
+
+		length = scsi_get_out_length(cmd) - 8;
+		buf = scsi_get_out_buffer(cmd) + 8;
+		for (; length >= 16; length -= 16, buf += 16) {
+			offset = get_unaligned_be64(&buf[0]) << lu->blk_shift;
+			tl = (uint64_t)get_unaligned_be32(&buf[8]) <<
+				lu->blk_shift;
+			if (!tl)
+				continue;
+
+			sqe = bs_uring_get_sqe(info, data);
+			sqe->opcode = IORING_OP_FALLOCATE;
+			sqe->off = offset;
+			sqe->addr = tl;
+			sqe->len = FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE;
+		}
+		break;
+	}
+
+	info->nr_cmds++;
+	return 0;
+}
+
+static void bs_uring_enter(struct bs_uring_info *info)
+{
+	int ret;
+
+	__atomic_store_n(info->sq_tail, info->sqe_tail, __ATOMIC_RELEASE);
+
+	if (info->sqpoll) {
+		/* the tail must be visible before we look at the flags */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(info->sq_flags, __ATOMIC_RELAXED) &
+		    IORING_SQ_NEED_WAKEUP)
+			sys_io_uring_enter(info->ring_fd, 0, 0,
+					   IORING_ENTER_SQ_WAKEUP);
+		info->to_submit = 0;
+		return;
+	}
+
+	ret = sys_io_uring_enter(info->ring_fd, info->to_submit, 0, 0);
+	if (ret < 0) {
+		/* the sqes stay in the ring for the next try */
+		if (errno != EAGAIN && errno != EBUSY && errno != EINTR)
+			eprintf("failed to submit to tgt:%d lun:%" PRIu64
+				", %m\n", info->lu->tgt->tid, info->lu->lun);
+		tgt_add_sched_event(bs_uring_flush_event(info));
+		return;
+	}
+
+	info->to_submit -= ret;
+	if (info->to_submit)
+		tgt_add_sched_event(bs_uring_flush_event(info));
+}
+
+/* called with the LU lock held */
+static void bs_uring_submit_dev(struct bs_uring_info *info)
+{
+	struct scsi_cmd *cmd, *next;
+	int ret;
+
+	list_for_each_entry_safe(cmd, next, &info->cmd_wait_list, bs_list) {
+		ret = bs_uring_cmd_queue(info, cmd);
+		if (ret == -EAGAIN)
+			break;
+
+		list_del(&cmd->bs_list);
+		if (ret)
+			bs_thread_cmd_submit(cmd);
+	}
+
+	if (info->to_submit)
+		bs_uring_enter(info);
+}
+
+static void bs_uring_flush(struct event_data *tev)
+{
+	struct bs_uring_info *info = tev->data;
+
+	pthread_mutex_lock(&info->lu->lu_lock);
+	bs_uring_submit_dev(info);
+	pthread_mutex_unlock(&info->lu->lu_lock);
+}
+
+static int bs_uring_cmd_submit(struct scsi_cmd *cmd)
+{
+	struct bs_uring_info *info = BS_URING_I(cmd->dev);
+	int nr;
+
+	nr = bs_uring_cmd_sqes(cmd);
+	if (!nr || nr > info->depth)
+		return bs_thread_cmd_submit(cmd);
+
+	set_cmd_async(cmd);
+	list_add_tail(&cmd->bs_list, &info->cmd_wait_list);
+
+	if (!cmd_not_last(cmd)) {
+		tgt_remove_sched_event(bs_uring_flush_event(info));
+		bs_uring_submit_dev(info);
+	} else
+		/* in case no last command follows before the loop sleeps */
+		tgt_add_sched_event(bs_uring_flush_event(info));
+
+	return 0;
+}
+
+/* the command is finished by the caller once the LU lock is dropped */
+static void bs_uring_cmd_done(struct scsi_cmd *cmd, int ok, int res,
+			      struct list_head *done)
+{
+	int result = SAM_STAT_GOOD;
+
+	if (unlikely(!ok)) {
+		eprintf("io error %p %x %d %" PRIu64 "\n",
+			cmd, cmd->scb[0], res, cmd->offset);
+		result = SAM_STAT_CHECK_CONDITION;
+		if (cmd->scb[0] == UNMAP ||
+		    ((cmd->scb[0] == WRITE_SAME ||
+		      cmd->scb[0] == WRITE_SAME_16) && (cmd->scb[1] & 0x08)))
+			sense_data_build(cmd, HARDWARE_ERROR,
+					 ASC_INTERNAL_TGT_FAILURE);
+		else
+			sense_data_build(cmd, MEDIUM_ERROR, ASC_READ_ERROR);
+	}
+
+	scsi_set_result(cmd, result);
+	list_add_tail(&cmd->bs_list, done);
+}
+
+static void bs_uring_complete_one(struct bs_uring_info *info,
+				  unsigned long data, int res,
+				  struct list_head *done)
+{
+	struct bs_uring_req *req;
+	struct scsi_cmd *cmd;
+	int ok;
+
+	info->nr_sqes--;
+
+	if (data & URING_REQ_TAG) {
+		req = (struct bs_uring_req *)(data & ~URING_REQ_TAG);
+		if (res < 0)
+			req->failed = res;
+		else
+			req->done += res;
+		if (--req->nr)
+			return;
+
+		cmd = req->cmd;
+		ok = !req->failed && req->done == req->want;
+		res = req->failed ? : (int)req->done;
+		free(req);
+	} else {
+		cmd = (struct scsi_cmd *)data;
+		switch (cmd->scb[0]) {
+		case READ_6:
+		case READ_10:
+		case READ_12:
+		case READ_16:
+			ok = res == scsi_get_in_length(cmd);
+			break;
+		case WRITE_6:
+		case WRITE_10:
+		case WRITE_12:
+		case WRITE_16:
+			ok = res == scsi_get_out_length(cmd);
+			break;
+		default:
+			ok = !res;
+			break;
+		}
+	}
+
+	info->nr_cmds--;
+	bs_uring_cmd_done(cmd, ok, res, done);
+}
+
+static void bs_uring_get_completions(int fd, int events, void *data)
+{
+	struct bs_uring_info *info = data;
+	struct io_uring_cqe *cqe;
+	struct scsi_cmd *cmd, *next;
+	unsigned int head, tail;
+	unsigned long user_data;
+	uint64_t count;
+	int ret, res;
+	LIST_HEAD(done);
+
+	/* a completion after this will write again */
+	ret = read(info->evt_fd, &count, sizeof(count));
+	if (ret < 0 && errno != EAGAIN)
+		eprintf("failed to read the completion eventfd, %m\n");
+
+	pthread_mutex_lock(&info->lu->lu_lock);
+	head = *info->cq_head;
+	for (;;) {
+		tail = __atomic_load_n(info->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+
+		cqe = &info->cqes[head & info->cq_mask];
+		user_data = cqe->user_data;
+		res = cqe->res;
+		/* the slot is free before the command can bring new ones */
+		__atomic_store_n(info->cq_head, ++head, __ATOMIC_RELEASE);
+
+		bs_uring_complete_one(info, user_data, res, &done);
+	}
+
+	if (!list_empty(&info->cmd_wait_list) || info->to_submit)
+		bs_uring_submit_dev(info);
+	pthread_mutex_unlock(&info->lu->lu_lock);
+
+	list_for_each_entry_safe(cmd, next, &done, bs_list) {
+		list_del(&cmd->bs_list);
+		target_cmd_io_done(cmd, scsi_get_result(cmd));
+	}
+}
+
+static int bs_uring_parse_opts(struct bs_uring_info *info, char *opts)
+{
+	enum {
+		Opt_depth, Opt_sqpoll, Opt_err,
+	};
+	match_table_t tokens = {
+		{Opt_depth, "depth=%d"},
+		{Opt_sqpoll, "sqpoll=%d"},
+		{Opt_err, NULL},
+	};
+	substring_t args[MAX_OPT_ARGS];
+	char *buf, *s, *p;
+	int ret = 0, val;
+
+	info->depth = URING_DEF_DEPTH;
+	info->sqpoll = 0;
+
+	if (!opts)
+		return 0;
+
+	buf = s = strdup(opts);
+	if (!buf)
+		return -ENOMEM;
+
+	while (!ret && (p = strsep(&s, ";")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, tokens, args)) {
+		case Opt_depth:
+			if (match_int(&args[0], &val) || val < 1 ||
+			    val > URING_MAX_DEPTH)
+				ret = -EINVAL;
+			else
+				info->depth = val;
+			break;
+		case Opt_sqpoll:
+			if (match_int(&args[0], &val) || val < 0)
+				ret = -EINVAL;
+			else
+				info->sqpoll = val;
+			break;
+		default:
+			ret = -EINVAL;
+			break;
+		}
+		if (ret)
+			eprintf("invalid backing store option %s\n", p);
+	}
+
+	free(buf);
+	return ret;
+}
+
+static void bs_uring_unmap(struct bs_uring_info *info)
+{
+	if (info->sqes)
+		munmap(info->sqes, info->sqes_sz);
+	if (info->cq_ring && info->cq_ring != info->sq_ring)
+		munmap(info->cq_ring, info->cq_ring_sz);
+	if (info->sq_ring)
+		munmap(info->sq_ring, info->sq_ring_sz);
+	info->sqes = NULL;
+	info->cq_ring = info->sq_ring = NULL;
+}
+
+static int bs_uring_setup(struct bs_uring_info *info)
+{
+	struct io_uring_params p;
+	struct io_uring_rsrc_register rr;
+	unsigned int *sq_array;
+	char *sq, *cq;
+	int fd, i, ret;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CLAMP;
+	if (info->sqpoll) {
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = info->sqpoll;
+	}
+
+	fd = sys_io_uring_setup(info->depth, &p);
+	if (fd < 0) {
+		eprintf("failed to create a ring, %m\n");
+		return -1;
+	}
+	info->ring_fd = fd;
+	info->depth = p.sq_entries;
+
+	info->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	info->cq_ring_sz = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		info->sq_ring_sz = info->cq_ring_sz =
+			max(info->sq_ring_sz, info->cq_ring_sz);
+
+	sq = mmap(NULL, info->sq_ring_sz, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	info->sq_ring = sq;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else {
+		cq = mmap(NULL, info->cq_ring_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail;
+	}
+	info->cq_ring = cq;
+
+	info->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	info->sqes = mmap(NULL, info->sqes_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (info->sqes == MAP_FAILED) {
+		info->sqes = NULL;
+		goto fail;
+	}
+
+	info->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	info->sq_flags = (unsigned int *)(sq + p.sq_off.flags);
+	info->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	info->sqe_tail = *info->sq_tail;
+	/* sqes are used in ring order */
+	sq_array = (unsigned int *)(sq + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+
+	info->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	info->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	info->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	info->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	ret = sys_io_uring_register(fd, IORING_REGISTER_EVENTFD,
+				    &info->evt_fd, 1);
+	if (ret < 0)
+		goto fail;
+
+	/* an empty table, filled as the regions show up */
+	memset(&rr, 0, sizeof(rr));
+	rr.nr = BS_BUF_REGIONS_MAX;
+	rr.flags = IORING_RSRC_REGISTER_SPARSE;
+	ret = sys_io_uring_register(fd, IORING_REGISTER_BUFFERS2, &rr,
+				    sizeof(rr));
+	if (ret < 0) {
+		dprintf("no fixed buffers, %m\n");
+		info->nr_bufs = -1;
+	}
+
+	return 0;
+fail:
+	eprintf("failed to set up a ring, %m\n");
+	bs_uring_unmap(info);
+	close(fd);
+	return -1;
+}
+
+static int bs_uring_open(struct scsi_lu *lu, char *path, int *fd,
+			 uint64_t *size)
+{
+	struct bs_uring_info *info = BS_URING_I(lu);
+	uint32_t blksize = 0;
+	int ret;
+
+	*fd = backed_file_open(path, O_RDWR|O_LARGEFILE|lu->bsoflags, size,
+				&blksize);
+	/* If we get access denied, try opening the file in readonly mode */
+	if (*fd == -1 && (errno == EACCES || errno == EROFS)) {
+		*fd = backed_file_open(path, O_RDONLY|O_LARGEFILE|lu->bsoflags,
+				       size, &blksize);
+		lu->attrs.readonly = 1;
+	}
+	if (*fd < 0)
+		return *fd;
+
+	ret = sys_io_uring_register(info->ring_fd, IORING_REGISTER_FILES,
+				    fd, 1);
+	info->fixed_file = ret >= 0;
+	if (!info->fixed_file)
+		dprintf("no fixed file for %s, %m\n", path);
+
+	if (!lu->attrs.no_auto_lbppbe)
+		update_lbppbe(lu, blksize);
+
+	return 0;
+}
+
+static void bs_uring_close(struct scsi_lu *lu)
+{
+	struct bs_uring_info *info = BS_URING_I(lu);
+
+	if (info->fixed_file) {
+		sys_io_uring_register(info->ring_fd, IORING_UNREGISTER_FILES,
+				      NULL, 0);
+		info->fixed_file = 0;
+	}
+	close(lu->fd);
+}
+
+static tgtadm_err bs_uring_init(struct scsi_lu *lu)
+{
+	struct bs_uring_info *info = BS_URING_I(lu);
+	tgtadm_err adm_err;
+	int i, ret;
+
+	memset(info, 0, sizeof(*info));
+	INIT_LIST_HEAD(&info->cmd_wait_list);
+	info->lu = lu;
+
+	ret = bs_uring_parse_opts(info, lu->bsopts);
+	if (ret)
+		return ret == -ENOMEM ? TGTADM_NOMEM : TGTADM_INVALID_REQUEST;
+
+	info->flush_events = calloc(nr_reactors, sizeof(*info->flush_events));
+	if (!info->flush_events)
+		return TGTADM_NOMEM;
+	for (i = 0; i < nr_reactors; i++)
+		tgt_init_sched_event(&info->flush_events[i], bs_uring_flush,
+				     info);
+
+	info->evt_fd = eventfd(0, EFD_NONBLOCK);
+	if (info->evt_fd < 0) {
+		eprintf("failed to create an eventfd, %m\n");
+		adm_err = TGTADM_UNKNOWN_ERR;
+		goto free_events;
+	}
+
+	if (bs_uring_setup(info)) {
+		adm_err = TGTADM_UNKNOWN_ERR;
+		goto close_eventfd;
+	}
+
+	ret = tgt_event_add(info->evt_fd, EPOLLIN, bs_uring_get_completions,
+			    info);
+	if (ret) {
+		adm_err = TGTADM_UNKNOWN_ERR;
+		goto close_ring;
+	}
+
+	adm_err = bs_thread_open(&info->th, bs_rdwr_request, 0);
+	if (adm_err)
+		goto remove_tgt_evt;
+
+	dprintf("ring of %u entries%s for tgt:%d lun:%" PRIu64 "\n",
+		info->depth, info->sqpoll ? " polled" : "",
+		lu->tgt->tid, lu->lun);
+	return TGTADM_SUCCESS;
+
+remove_tgt_evt:
+	tgt_event_del(info->evt_fd);
+close_ring:
+	bs_uring_unmap(info);
+	close(info->ring_fd);
+close_eventfd:
+	close(info->evt_fd);
+free_events:
+	free(info->flush_events);
+	return adm_err;
+}
+
+static void bs_uring_exit(struct scsi_lu *lu)
+{
+	struct bs_uring_info *info = BS_URING_I(lu);
+	int i;
+
+	/* the other event loops are held off while a LU goes away */
+	for (i = 0; i < nr_reactors; i++)
+		tgt_remove_sched_event(&info->flush_events[i]);
+	bs_thread_close(&info->th);
+
+	tgt_event_del(info->evt_fd);
+	bs_uring_unmap(info);
+	close(info->ring_fd);
+	close(info->evt_fd);
+	free(info->flush_events);
+}
+
+static struct backingstore_template uring_bst = {
+	.bs_name		= "uring",
+	.bs_datasize		= sizeof(struct bs_uring_info),
+	.bs_open		= bs_uring_open,
+	.bs_close		= bs_uring_close,
+	.bs_init		= bs_uring_init,
+	.bs_exit		= bs_uring_exit,
+	.bs_cmd_submit		= bs_uring_cmd_submit,
+	.bs_oflags_supported    = O_SYNC | O_DIRECT,
+};
+
+__attribute__((constructor)) static void bs_uring_constructor(void)
+{
+	register_backingstore_template(&uring_bst);
+}
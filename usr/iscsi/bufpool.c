@@ -0,0 +1,377 @@
+/*
+ * Pool of page aligned data buffers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "iscsid.h"
+#include "tgtd.h"
+#include "util.h"
+
+/*
+ * Buffers come in power of two sizes from 4K up to the largest burst
+ * iSCSI allows. Freed buffers are cached per event loop and handed out
+ * again for requests of the same size class. Every buffer is aligned to
+ * its own size, up to 2M, so O_DIRECT backends can use them as they are.
+ *
+ * A cache belongs to one event loop and is only touched from it. A
+ * buffer can be freed on another loop than the one it came from (a
+ * connection moves off the main loop after login), so the in-use hash
+ * is locked per bucket group and the byte counts are atomic.
+ */
+#define BUF_POOL_MIN_SHIFT	12
+#define BUF_POOL_MAX_SHIFT	24
+#define BUF_POOL_CLASSES	(BUF_POOL_MAX_SHIFT - BUF_POOL_MIN_SHIFT + 1)
+
+#define BUF_POOL_HUGE_SHIFT	21
+#define BUF_POOL_HUGE_SIZE	(1UL << BUF_POOL_HUGE_SHIFT)
+
+#define BUF_POOL_HASH_BITS	12
+#define BUF_POOL_HASH_SIZE	(1 << BUF_POOL_HASH_BITS)
+#define BUF_POOL_LOCK_BITS	6
+#define BUF_POOL_LOCK_SIZE	(1 << BUF_POOL_LOCK_BITS)
+
+struct iscsi_buf {
+	void *addr;
+	int class;
+	/* carved out of a hugepage, never given back */
+	int huge;
+	/* hashed by address while in use */
+	struct hlist_node hnode;
+	/* on a free list while cached */
+	struct list_head list;
+};
+
+struct iscsi_buf_cache {
+	struct list_head free[BUF_POOL_CLASSES];
+	unsigned long nr_free[BUF_POOL_CLASSES];
+};
+
+/* in bytes, 0 disables the pool */
+static unsigned long buf_pool_max = 256UL << 20;
+static int buf_pool_huge;
+
+static struct iscsi_buf_cache *buf_caches;
+static pthread_once_t buf_caches_once = PTHREAD_ONCE_INIT;
+static struct hlist_head buf_hash[BUF_POOL_HASH_SIZE];
+static pthread_mutex_t buf_hash_lock[BUF_POOL_LOCK_SIZE];
+
+/* memory the pool holds, cached or in use */
+static unsigned long buf_pool_bytes;
+static unsigned long buf_cached_bytes;
+
+static struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t bypass;
+	uint64_t huge_chunks;
+} buf_stats;
+
+void iscsi_buf_pool_set_max(unsigned long bytes)
+{
+	buf_pool_max = bytes;
+}
+
+void iscsi_buf_pool_set_hugepages(int on)
+{
+	buf_pool_huge = on;
+}
+
+static inline int buf_class(size_t sz)
+{
+	int shift = BUF_POOL_MIN_SHIFT;
+
+	while ((1UL << shift) < sz)
+		shift++;
+	return shift - BUF_POOL_MIN_SHIFT;
+}
+
+static inline size_t buf_class_size(int class)
+{
+	return 1UL << (class + BUF_POOL_MIN_SHIFT);
+}
+
+#define buf_stat_inc(x)		__atomic_add_fetch(&buf_stats.x, 1, __ATOMIC_RELAXED)
+#define buf_bytes_add(x, n)	__atomic_add_fetch(&(x), (n), __ATOMIC_RELAXED)
+#define buf_bytes_sub(x, n)	__atomic_sub_fetch(&(x), (n), __ATOMIC_RELAXED)
+#define buf_bytes_read(x)	__atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+static inline unsigned int buf_hash_idx(void *addr)
+{
+	unsigned long key = (unsigned long)addr >> BUF_POOL_MIN_SHIFT;
+
+	return hash_mem(HASH_INIT, &key, sizeof(key)) &
+		(BUF_POOL_HASH_SIZE - 1);
+}
+
+static inline pthread_mutex_t *buf_hash_mutex(unsigned int idx)
+{
+	return &buf_hash_lock[idx & (BUF_POOL_LOCK_SIZE - 1)];
+}
+
+static void buf_caches_init(void)
+{
+	int i, j;
+
+	for (i = 0; i < BUF_POOL_LOCK_SIZE; i++)
+		pthread_mutex_init(&buf_hash_lock[i], NULL);
+
+	buf_caches = calloc(nr_reactors, sizeof(*buf_caches));
+	if (!buf_caches)
+		return;
+	for (i = 0; i < nr_reactors; i++)
+		for (j = 0; j < BUF_POOL_CLASSES; j++)
+			INIT_LIST_HEAD(&buf_caches[i].free[j]);
+}
+
+/* only event loops cache; anything else goes straight to malloc */
+static struct iscsi_buf_cache *buf_cache_get(void)
+{
+	struct tgt_reactor *r = tgt_current_reactor();
+
+	pthread_once(&buf_caches_once, buf_caches_init);
+	if (!buf_caches || !r)
+		return NULL;
+	return &buf_caches[tgt_reactor_id(r)];
+}
+
+static void buf_cache_put(struct iscsi_buf_cache *c, struct iscsi_buf *b)
+{
+	list_add(&b->list, &c->free[b->class]);
+	c->nr_free[b->class]++;
+	buf_bytes_add(buf_cached_bytes, buf_class_size(b->class));
+}
+
+static struct iscsi_buf *buf_cache_take(struct iscsi_buf_cache *c, int class)
+{
+	struct iscsi_buf *b;
+
+	if (list_empty(&c->free[class]))
+		return NULL;
+
+	b = list_first_entry(&c->free[class], struct iscsi_buf, list);
+	list_del(&b->list);
+	c->nr_free[class]--;
+	buf_bytes_sub(buf_cached_bytes, buf_class_size(class));
+	return b;
+}
+
+/* give cached buffers back to make room for @need more bytes */
+static void buf_reclaim(struct iscsi_buf_cache *c, size_t need)
+{
+	struct iscsi_buf *b, *tmp;
+	int class;
+
+	for (class = BUF_POOL_CLASSES - 1; class >= 0; class--) {
+		list_for_each_entry_safe(b, tmp, &c->free[class], list) {
+			if (buf_bytes_read(buf_pool_bytes) + need <= buf_pool_max)
+				return;
+			if (b->huge)
+				continue;
+			list_del(&b->list);
+			c->nr_free[class]--;
+			buf_bytes_sub(buf_cached_bytes, buf_class_size(class));
+			buf_bytes_sub(buf_pool_bytes, buf_class_size(class));
+			free(b->addr);
+			free(b);
+		}
+	}
+}
+
+/* split a hugepage into free buffers of @class */
+static int buf_huge_carve(struct iscsi_buf_cache *c, int class)
+{
+	size_t size = buf_class_size(class);
+	struct iscsi_buf *b;
+	char *chunk;
+	int i, nr;
+
+	if (buf_bytes_read(buf_pool_bytes) + BUF_POOL_HUGE_SIZE > buf_pool_max)
+		return -ENOMEM;
+
+	chunk = mmap(NULL, BUF_POOL_HUGE_SIZE, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (chunk == MAP_FAILED) {
+		eprintf("can't map a hugepage, %m; not using them\n");
+		buf_pool_huge = 0;
+		return -ENOMEM;
+	}
+
+	/* backing stores may pin it; if the table is full they just won't */
+	bs_buf_region_add(chunk, BUF_POOL_HUGE_SIZE);
+
+	nr = BUF_POOL_HUGE_SIZE / size;
+	for (i = 0; i < nr; i++) {
+		b = zalloc(sizeof(*b));
+		if (!b)
+			break;
+		b->addr = chunk + i * size;
+		b->class = class;
+		b->huge = 1;
+		buf_cache_put(c, b);
+	}
+
+	/* the buffers we couldn't describe are lost until exit */
+	buf_bytes_add(buf_pool_bytes, BUF_POOL_HUGE_SIZE);
+	buf_stat_inc(huge_chunks);
+	return i ? 0 : -ENOMEM;
+}
+
+static struct iscsi_buf *buf_new(struct iscsi_buf_cache *c, int class)
+{
+	size_t size = buf_class_size(class);
+	struct iscsi_buf *b;
+	void *addr;
+
+	if (buf_pool_huge && size <= BUF_POOL_HUGE_SIZE &&
+	    !buf_huge_carve(c, class))
+		return buf_cache_take(c, class);
+
+	if (buf_bytes_read(buf_pool_bytes) + size > buf_pool_max) {
+		buf_reclaim(c, size);
+		if (buf_bytes_read(buf_pool_bytes) + size > buf_pool_max)
+			return NULL;
+	}
+
+	b = zalloc(sizeof(*b));
+	if (!b)
+		return NULL;
+
+	if (posix_memalign(&addr, min_t(size_t, size, BUF_POOL_HUGE_SIZE),
+			   size)) {
+		free(b);
+		return NULL;
+	}
+
+	b->addr = addr;
+	b->class = class;
+	buf_bytes_add(buf_pool_bytes, size);
+	return b;
+}
+
+void *iscsi_buf_alloc(size_t sz)
+{
+	struct iscsi_buf_cache *c;
+	struct iscsi_buf *b;
+	unsigned int idx;
+	int class;
+
+	if (!buf_pool_max || sz > buf_class_size(BUF_POOL_CLASSES - 1))
+		goto bypass;
+
+	c = buf_cache_get();
+	if (!c)
+		goto bypass;
+
+	class = buf_class(sz);
+	b = buf_cache_take(c, class);
+	if (b)
+		buf_stat_inc(hits);
+	else {
+		b = buf_new(c, class);
+		if (!b)
+			goto bypass;
+		buf_stat_inc(misses);
+	}
+
+	idx = buf_hash_idx(b->addr);
+	pthread_mutex_lock(buf_hash_mutex(idx));
+	hlist_add_head(&b->hnode, &buf_hash[idx]);
+	pthread_mutex_unlock(buf_hash_mutex(idx));
+	return b->addr;
+bypass:
+	buf_stat_inc(bypass);
+	return valloc(sz);
+}
+
+void iscsi_buf_free(void *addr)
+{
+	struct iscsi_buf_cache *c;
+	struct iscsi_buf *b;
+	unsigned int idx;
+
+	if (!addr)
+		return;
+
+	idx = buf_hash_idx(addr);
+	pthread_mutex_lock(buf_hash_mutex(idx));
+	hlist_for_each_entry(b, &buf_hash[idx], hnode) {
+		if (b->addr == addr) {
+			hlist_del(&b->hnode);
+			pthread_mutex_unlock(buf_hash_mutex(idx));
+			goto found;
+		}
+	}
+	pthread_mutex_unlock(buf_hash_mutex(idx));
+
+	/* not from the pool */
+	free(addr);
+	return;
+found:
+	c = buf_cache_get();
+	if (c) {
+		buf_cache_put(c, b);
+		return;
+	}
+
+	/* freed off the event loops; a hugepage piece is lost until exit */
+	if (b->huge)
+		return;
+	buf_bytes_sub(buf_pool_bytes, buf_class_size(b->class));
+	free(b->addr);
+	free(b);
+}
+
+void iscsi_buf_pool_show(struct concat_buf *b)
+{
+	struct iscsi_buf_cache *c;
+	int i, class;
+
+	concat_printf(b, "Buffer pool:\n");
+	concat_printf(b, _TAB1 "Max: %lu MB%s\n", buf_pool_max >> 20,
+		      buf_pool_huge ? " (hugepages)" : "");
+	concat_printf(b, _TAB1 "Allocated: %lu bytes, cached: %lu bytes\n",
+		      buf_bytes_read(buf_pool_bytes),
+		      buf_bytes_read(buf_cached_bytes));
+	concat_printf(b, _TAB1 "Hits: %" PRIu64 " misses: %" PRIu64
+		      " bypass: %" PRIu64 " hugepages: %" PRIu64 "\n",
+		      buf_bytes_read(buf_stats.hits),
+		      buf_bytes_read(buf_stats.misses),
+		      buf_bytes_read(buf_stats.bypass),
+		      buf_bytes_read(buf_stats.huge_chunks));
+
+	if (!buf_caches)
+		return;
+
+	for (class = 0; class < BUF_POOL_CLASSES; class++) {
+		unsigned long nr = 0;
+
+		for (i = 0; i < nr_reactors; i++) {
+			c = &buf_caches[i];
+			nr += c->nr_free[class];
+		}
+		if (nr)
+			concat_printf(b, _TAB1 "%zuK: %lu cached\n",
+				      buf_class_size(class) >> 10, nr);
+	}
+}
@@ -68,9 +68,27 @@ int conn_init(struct iscsi_connection *conn)
 	return 0;
 }
 
+/*
+ * A connection joining a session logs in on the main reactor while
+ * the session is served by the reactor its other connections were
+ * handed to. Until the connection moves there too, anything touching
+ * the session has to stop that reactor.
+ */
+static int conn_session_foreign(struct iscsi_connection *conn)
+{
+	struct iscsi_session *session = conn->session;
+
+	return session && session->reactor &&
+		session->reactor != tgt_current_reactor();
+}
+
 void conn_exit(struct iscsi_connection *conn)
 {
 	struct iscsi_session *session = conn->session;
+	int foreign = conn_session_foreign(conn);
+
+	if (foreign)
+		tgt_lock_exclusive();
 
 	list_del(&conn->clist);
 	free(conn->req_buffer);
@@ -81,17 +99,15 @@ void conn_exit(struct iscsi_connection *conn)
 
 	if (session)
 		session_put(session);
+
+	if (foreign)
+		tgt_unlock_exclusive();
 }
 
-void conn_close(struct iscsi_connection *conn)
+static void __conn_close(struct iscsi_connection *conn)
 {
 	struct iscsi_task *task, *tmp;
-	int ret;
-
-	if (conn->closed) {
-		eprintf("already closed %p %u\n", conn, conn->refcount);
-		return;
-	}
+	int i, ret;
 
 	conn->closed = 1;
 
@@ -102,6 +118,11 @@ void conn_close(struct iscsi_connection *conn)
 	else
 		eprintf("connection closed, %p %u\n", conn, conn->refcount);
 
+	/* the digest threads may still be reading task buffers */
+	iscsi_digest_cancel(&conn->rx_dg_job);
+	iscsi_digest_cancel(&conn->tx_dg_job);
+	conn->rx_paused = 0;
+
 	/* may not have been in FFP yet */
 	if (!conn->session)
 		goto done;
@@ -112,18 +133,31 @@ void conn_close(struct iscsi_connection *conn)
 	 * We just closed the ep so we are not going to send/recv anything.
 	 * Just free these up since they are not going to complete.
 	 */
-	list_for_each_entry_safe(task, tmp, &conn->session->pending_cmd_list,
-				 c_list) {
-		if (task->conn != conn)
+	for (i = 0; i < conn->session->cmd_ring_size; i++) {
+		task = conn->session->cmd_ring[i];
+		if (!task || task->conn != conn)
 			continue;
 
 		eprintf("Forcing release of pending task %p %" PRIx64 "\n",
 			task, task->tag);
-		list_del(&task->c_list);
+		conn->session->cmd_ring[i] = NULL;
+		conn->session->nr_cmd_ring--;
 		iscsi_free_task(task);
 	}
 
-	if (conn->tx_task) {
+	/*
+	 * The session lives on in its other connections. Commands sent
+	 * on this one that we haven't received are lost, so don't keep
+	 * the ones queued behind them waiting.
+	 */
+	if (conn->full_feature) {
+		conn->full_feature = 0;
+		if (--conn->session->conn_cnt)
+			iscsi_cmd_ring_skip(conn->session);
+	}
+
+	/* a task waiting to send more R2Ts is on the tx list already */
+	if (conn->tx_task && !task_r2t_queued(conn->tx_task)) {
 		dprintf("Add current tx task to the tx list for removal "
 			"%p %" PRIx64 "\n",
 			conn->tx_task, conn->tx_task->tag);
@@ -131,6 +165,14 @@ void conn_close(struct iscsi_connection *conn)
 		conn->tx_task = NULL;
 	}
 
+	/* responses gathered for a vectored send that didn't go out */
+	for (i = 0; i < conn->tx_nr_pdus; i++) {
+		task = conn->tx_pdus[i].task;
+		if (task)
+			list_add(&task->c_list, &conn->tx_clist);
+	}
+	conn->tx_nr_pdus = conn->tx_iovcnt = conn->tx_iov_idx = 0;
+
 	list_for_each_entry_safe(task, tmp, &conn->tx_clist, c_list) {
 		uint8_t op;
 
@@ -183,6 +225,21 @@ done:
 	conn_put(conn);
 }
 
+void conn_close(struct iscsi_connection *conn)
+{
+	if (conn->closed) {
+		eprintf("already closed %p %u\n", conn, conn->refcount);
+		return;
+	}
+
+	if (conn_session_foreign(conn)) {
+		tgt_lock_exclusive();
+		__conn_close(conn);
+		tgt_unlock_exclusive();
+	} else
+		__conn_close(conn);
+}
+
 void conn_put(struct iscsi_connection *conn)
 {
 	conn->refcount--;
@@ -211,12 +268,33 @@ struct iscsi_connection *conn_find(struct iscsi_session *session, uint32_t cid)
 
 int conn_take_fd(struct iscsi_connection *conn)
 {
+	int foreign = conn_session_foreign(conn);
+
 	dprintf("%u %u %u %" PRIx64 "\n", conn->cid, conn->stat_sn,
 		conn->exp_stat_sn, sid64(conn->isid, conn->tsih));
+	if (foreign)
+		tgt_lock_exclusive();
 	conn->session->conn_cnt++;
+	if (foreign)
+		tgt_unlock_exclusive();
+	conn->full_feature = 1;
 	return 0;
 }
 
+/* connections of the session that aren't being closed */
+int conn_count(struct iscsi_session *session)
+{
+	struct iscsi_connection *conn;
+	int count = 0;
+
+	list_for_each_entry(conn, &session->conn_list, clist) {
+		if (!conn->closed)
+			count++;
+	}
+
+	return count;
+}
+
 /* called by tgtadm */
 tgtadm_err conn_close_admin(uint32_t tid, uint64_t sid, uint32_t cid)
 {
@@ -0,0 +1,267 @@
+/*
+ * Data digests computed by worker threads
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "iscsid.h"
+#include "tgtd.h"
+#include "util.h"
+#include "crc32c.h"
+
+#define ISCSI_DIGEST_THREADS	4
+
+/*
+ * Finished jobs go back to the event loop that submitted them, so the
+ * connection is resumed on the reactor that serves it.
+ */
+struct iscsi_digest_queue {
+	int efd;
+	struct list_head done_list;
+};
+
+/* digests of data segments of at least this size are offloaded */
+static int digest_threshold;
+
+static int digest_started;
+static pthread_t digest_threads[ISCSI_DIGEST_THREADS];
+static struct iscsi_digest_queue *digest_queues;
+
+/* protects the job lists and job states */
+static pthread_mutex_t digest_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t digest_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t digest_done_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(digest_pending_list);
+
+static const uint8_t digest_pad[PAD_WORD_LEN];
+
+void iscsi_digest_set_threshold(int threshold)
+{
+	digest_threshold = threshold;
+}
+
+int iscsi_digest_offload(size_t len)
+{
+	return digest_threshold && len >= digest_threshold;
+}
+
+/* also used directly when a job couldn't be queued */
+void iscsi_digest_run(struct iscsi_digest_job *job)
+{
+	struct iscsi_digest_seg *seg;
+	uint32_t crc;
+	int i;
+
+	for (i = 0; i < job->nr; i++) {
+		seg = &job->seg[i];
+		crc = crc32c(~0, seg->data, seg->len);
+		if (seg->pad)
+			crc = crc32c(crc, digest_pad, seg->pad);
+		*seg->digest = ~crc;
+	}
+}
+
+static void *iscsi_digest_worker_fn(void *arg)
+{
+	struct iscsi_digest_job *job;
+	sigset_t set;
+	uint64_t one = 1;
+	int ret;
+
+	sigfillset(&set);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&digest_lock);
+	for (;;) {
+		while (list_empty(&digest_pending_list))
+			pthread_cond_wait(&digest_cond, &digest_lock);
+
+		job = list_first_entry(&digest_pending_list,
+				       struct iscsi_digest_job, list);
+		list_del(&job->list);
+		job->state = ISCSI_DIGEST_RUNNING;
+		pthread_mutex_unlock(&digest_lock);
+
+		iscsi_digest_run(job);
+
+		pthread_mutex_lock(&digest_lock);
+		job->state = ISCSI_DIGEST_DONE;
+		list_add_tail(&job->list, &job->queue->done_list);
+		pthread_cond_broadcast(&digest_done_cond);
+
+		ret = write(job->queue->efd, &one, sizeof(one));
+		if (ret < 0)
+			eprintf("can't notify digest completion, %m\n");
+	}
+
+	return NULL;
+}
+
+static void iscsi_digest_complete(int fd, int events, void *data)
+{
+	struct iscsi_digest_queue *q = data;
+	struct iscsi_digest_job *job;
+	struct iscsi_connection *conn;
+	uint64_t count;
+	int ret;
+
+	ret = read(fd, &count, sizeof(count));
+	if (ret < 0)
+		return;
+
+	/*
+	 * Take the jobs off one by one: a done handler may close
+	 * another connection, which cancels its job.
+	 */
+	for (;;) {
+		pthread_mutex_lock(&digest_lock);
+		if (list_empty(&q->done_list)) {
+			pthread_mutex_unlock(&digest_lock);
+			break;
+		}
+		job = list_first_entry(&q->done_list,
+				       struct iscsi_digest_job, list);
+		list_del(&job->list);
+		job->state = ISCSI_DIGEST_IDLE;
+		pthread_mutex_unlock(&digest_lock);
+
+		conn = job->conn;
+		job->done(job);
+		conn_put(conn);
+	}
+}
+
+static int iscsi_digest_start(void)
+{
+	int i, ret;
+
+	digest_queues = calloc(nr_reactors, sizeof(*digest_queues));
+	if (!digest_queues)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_reactors; i++) {
+		digest_queues[i].efd = -1;
+		INIT_LIST_HEAD(&digest_queues[i].done_list);
+	}
+
+	for (i = 0; i < ISCSI_DIGEST_THREADS; i++) {
+		ret = pthread_create(&digest_threads[i], NULL,
+				     iscsi_digest_worker_fn, NULL);
+		if (ret) {
+			eprintf("can't create a digest thread, %s\n",
+				strerror(ret));
+			/* the ones that did start serve the queue */
+			if (!i)
+				return -ret;
+			break;
+		}
+	}
+
+	digest_started = 1;
+	return 0;
+}
+
+static struct iscsi_digest_queue *iscsi_digest_queue_get(void)
+{
+	struct tgt_reactor *r = tgt_current_reactor();
+	struct iscsi_digest_queue *q;
+	int ret;
+
+	if (!r)
+		r = tgt_main_reactor();
+	q = &digest_queues[tgt_reactor_id(r)];
+
+	if (q->efd >= 0)
+		return q;
+
+	q->efd = eventfd(0, EFD_NONBLOCK);
+	if (q->efd < 0) {
+		eprintf("can't create eventfd, %m\n");
+		return NULL;
+	}
+
+	ret = tgt_reactor_event_add(r, q->efd, EPOLLIN,
+				    iscsi_digest_complete, q);
+	if (ret) {
+		close(q->efd);
+		q->efd = -1;
+		return NULL;
+	}
+
+	return q;
+}
+
+/*
+ * Hand a job to the worker threads; job->done runs in the calling
+ * event loop once all its digests are computed. Returns non zero if
+ * the job couldn't be queued, then the caller computes the digests.
+ */
+int iscsi_digest_submit(struct iscsi_digest_job *job)
+{
+	struct iscsi_digest_queue *q;
+
+	if (!digest_started && iscsi_digest_start())
+		return -EIO;
+
+	q = iscsi_digest_queue_get();
+	if (!q)
+		return -EIO;
+
+	/* released when the job is done or cancelled */
+	conn_get(job->conn);
+	job->queue = q;
+
+	pthread_mutex_lock(&digest_lock);
+	job->state = ISCSI_DIGEST_PENDING;
+	list_add_tail(&job->list, &digest_pending_list);
+	pthread_cond_signal(&digest_cond);
+	pthread_mutex_unlock(&digest_lock);
+
+	return 0;
+}
+
+/*
+ * Make sure no worker touches the job's buffers anymore; done is not
+ * called. Used when the connection is closed.
+ */
+void iscsi_digest_cancel(struct iscsi_digest_job *job)
+{
+	struct iscsi_connection *conn = job->conn;
+
+	pthread_mutex_lock(&digest_lock);
+	if (job->state == ISCSI_DIGEST_IDLE) {
+		pthread_mutex_unlock(&digest_lock);
+		return;
+	}
+
+	while (job->state == ISCSI_DIGEST_RUNNING)
+		pthread_cond_wait(&digest_done_cond, &digest_lock);
+
+	list_del(&job->list);
+	job->state = ISCSI_DIGEST_IDLE;
+	pthread_mutex_unlock(&digest_lock);
+
+	conn_put(conn);
+}
@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,18 +32,96 @@
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef SO_ZEROCOPY
+#include <linux/errqueue.h>
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY	0x4000000
+#endif
+#endif
 
 #include "iscsid.h"
 #include "tgtd.h"
 #include "util.h"
 
 static void iscsi_tcp_event_handler(int fd, int events, void *data);
+static void iscsi_tcp_flush(struct event_data *tev);
+static void iscsi_tcp_rx_resume(struct event_data *tev);
+static void iscsi_tcp_adopt(struct event_data *tev);
+static void iscsi_tcp_close_posted(struct event_data *tev);
+
+/*
+ * max sendmsg calls (of up to ISCSI_TX_MAX_PDUS PDUs each) made in one
+ * go before going back to the event loop
+ */
+#define ISCSI_TCP_TX_BUDGET	8
+
+/*
+ * Receive ring: small PDUs (and the BHS of every PDU) are parsed out of
+ * one large read. Reads of at least ISCSI_TCP_RX_DIRECT bytes, i.e.
+ * big Data-Out payloads, go straight into the task buffer.
+ */
+#define ISCSI_TCP_RX_RING	(64 * 1024)
+#define ISCSI_TCP_RX_DIRECT	(16 * 1024)
+
+/* max PDUs parsed per EPOLLIN wakeup, 0 disables the receive ring */
+static int iscsi_tcp_rx_budget = 16;
+
+/*
+ * Data-In payloads of at least this many bytes are sent with
+ * MSG_ZEROCOPY, 0 disables it. The buffer is then freed only when the
+ * kernel reports that it is done with the pages. At most
+ * ISCSI_TCP_ZC_WINDOW such sends are outstanding per connection; beyond
+ * that payloads are copied as usual.
+ */
+static int iscsi_tcp_zerocopy;
+#define ISCSI_TCP_ZC_WINDOW	1024
+
+/* a data buffer freed while zerocopy sends may still refer to it */
+struct iscsi_tcp_zc_buf {
+	struct list_head list;
+	void *buf;
+	/* freed when all the sends before this one are completed */
+	uint32_t id;
+};
+
+/*
+ * Freed tasks without extended data are kept on the connection for
+ * reuse, up to this many.
+ */
+#define ISCSI_TCP_TASK_CACHE	128
 
 static int listen_fds[8];
 static struct iscsi_transport iscsi_tcp;
 
 struct iscsi_tcp_connection {
 	int fd;
+	/*
+	 * The event loop this connection is served by. Only that reactor
+	 * touches the connection, see iscsi_tcp_handover().
+	 */
+	struct tgt_reactor *reactor;
+	/* pushes queued responses out at the end of a loop iteration */
+	struct event_data flush_event;
+	/* registers the connection with its new reactor */
+	struct event_data adopt_event;
+	/* a close requested by another reactor */
+	struct event_data close_event;
+
+	char *rx_ring;
+	unsigned int rx_ring_head;	/* first buffered byte */
+	unsigned int rx_ring_len;	/* number of buffered bytes */
+	/* resumes parsing when the budget ran out with data in the ring */
+	struct event_data rx_event;
+
+	int zc;				/* use MSG_ZEROCOPY for new sends */
+	uint32_t zc_next;		/* id of the next zerocopy send */
+	uint32_t zc_done;		/* sends below this id are completed */
+	unsigned char zc_map[ISCSI_TCP_ZC_WINDOW]; /* completed out of order */
+	struct list_head zc_bufs;
+
+	struct list_head task_cache;	/* linked by task->c_list */
+	int nr_task_cache;
 
 	struct iscsi_connection iscsi_conn;
 };
@@ -137,15 +216,46 @@ static void accept_connection(int afd, int events, void *data)
 		goto out;
 	}
 
+	if (iscsi_tcp_rx_budget) {
+		tcp_conn->rx_ring = malloc(ISCSI_TCP_RX_RING);
+		if (!tcp_conn->rx_ring) {
+			conn_exit(conn);
+			free(tcp_conn);
+			goto out;
+		}
+	}
+
+#ifdef SO_ZEROCOPY
+	if (iscsi_tcp_zerocopy) {
+		int opt = 1;
+
+		if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt)))
+			eprintf("can't enable zerocopy, %m\n");
+		else
+			tcp_conn->zc = 1;
+	}
+#endif
+	INIT_LIST_HEAD(&tcp_conn->zc_bufs);
+	INIT_LIST_HEAD(&tcp_conn->task_cache);
+
 	tcp_conn->fd = fd;
+	/* logins are handled by the main reactor */
+	tcp_conn->reactor = tgt_main_reactor();
+	tgt_init_sched_event(&tcp_conn->flush_event, iscsi_tcp_flush, conn);
+	tgt_init_sched_event(&tcp_conn->rx_event, iscsi_tcp_rx_resume, conn);
+	tgt_init_sched_event(&tcp_conn->adopt_event, iscsi_tcp_adopt, conn);
+	tgt_init_sched_event(&tcp_conn->close_event, iscsi_tcp_close_posted,
+			     conn);
 	conn->tp = &iscsi_tcp;
 
 	conn_read_pdu(conn);
 	set_non_blocking(fd);
 
-	ret = tgt_event_add(fd, EPOLLIN, iscsi_tcp_event_handler, conn);
+	ret = tgt_reactor_event_add(tcp_conn->reactor, fd, EPOLLIN,
+				    iscsi_tcp_event_handler, conn);
 	if (ret) {
 		conn_exit(conn);
+		free(tcp_conn->rx_ring);
 		free(tcp_conn);
 		goto out;
 	}
@@ -156,23 +266,250 @@ out:
 	return;
 }
 
+static int iscsi_tcp_tx_pending(struct iscsi_connection *conn)
+{
+	/* nothing to do until the digest threads are done with the batch */
+	if (conn->tx_dg_job.state != ISCSI_DIGEST_IDLE)
+		return 0;
+
+	return conn->tx_task || conn->tx_iovcnt ||
+		!list_empty(&conn->tx_clist);
+}
+
+static void iscsi_tcp_tx_push(struct iscsi_connection *conn)
+{
+	int i, ret;
+
+	if (conn->state != STATE_SCSI) {
+		iscsi_tx_handler(conn);
+		return;
+	}
+
+	for (i = 0; i < ISCSI_TCP_TX_BUDGET; i++) {
+		ret = iscsi_tx_handler(conn);
+		if (ret || conn->state != STATE_SCSI ||
+		    !iscsi_tcp_tx_pending(conn))
+			break;
+	}
+
+	/* the socket buffer is full or we ran out of budget */
+	if (conn->state == STATE_SCSI && iscsi_tcp_tx_pending(conn))
+		tgt_reactor_event_modify(TCP_CONN(conn)->reactor,
+					 TCP_CONN(conn)->fd,
+					 EPOLLIN | EPOLLOUT);
+}
+
+static void iscsi_tcp_zc_free(struct iscsi_tcp_connection *tcp_conn,
+			      int all)
+{
+	struct iscsi_tcp_zc_buf *zb, *tmp;
+
+	list_for_each_entry_safe(zb, tmp, &tcp_conn->zc_bufs, list) {
+		if (!all && (int32_t)(tcp_conn->zc_done - zb->id) < 0)
+			break;
+		list_del(&zb->list);
+		iscsi_buf_free(zb->buf);
+		free(zb);
+	}
+}
+
+/* collect MSG_ZEROCOPY completions from the socket error queue */
+static void iscsi_tcp_zc_reap(struct iscsi_tcp_connection *tcp_conn)
+{
+#ifdef SO_ZEROCOPY
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+	struct sock_extended_err *serr;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	uint32_t id;
+
+	if (tcp_conn->zc_done == tcp_conn->zc_next)
+		return;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(tcp_conn->fd, &msg, MSG_ERRQUEUE) < 0)
+			break;
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+			    serr->ee_errno)
+				continue;
+
+			/*
+			 * The kernel copied the data anyway (e.g. over
+			 * loopback), so pinning the pages only costs us.
+			 */
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				tcp_conn->zc = 0;
+
+			/* ee_info..ee_data is an inclusive range of ids */
+			id = serr->ee_info;
+			do {
+				tcp_conn->zc_map[id % ISCSI_TCP_ZC_WINDOW] = 1;
+			} while (id++ != serr->ee_data);
+		}
+	}
+
+	while (tcp_conn->zc_done != tcp_conn->zc_next &&
+	       tcp_conn->zc_map[tcp_conn->zc_done % ISCSI_TCP_ZC_WINDOW]) {
+		tcp_conn->zc_map[tcp_conn->zc_done % ISCSI_TCP_ZC_WINDOW] = 0;
+		tcp_conn->zc_done++;
+	}
+
+	iscsi_tcp_zc_free(tcp_conn, 0);
+#endif
+}
+
+/*
+ * Connections log in on the main reactor. Once in full feature phase
+ * a connection moves to the reactor of its session for good, so that
+ * all the connections of a session, and the commands on them, are
+ * served by one thread.
+ */
+static void iscsi_tcp_handover(struct iscsi_connection *conn)
+{
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
+	struct iscsi_session *session = conn->session;
+	int locked = 0;
+
+	if (!session->reactor)
+		session->reactor = tgt_reactor_pick();
+	else if (session->reactor != tcp_conn->reactor) {
+		/* the other connections of the session are live there */
+		tgt_lock_exclusive();
+		locked = 1;
+	}
+
+	if (session->reactor != tcp_conn->reactor) {
+		dprintf("%p moves to reactor %d\n", conn,
+			tgt_reactor_id(session->reactor));
+
+		tgt_remove_sched_event(&tcp_conn->flush_event);
+		tgt_remove_sched_event(&tcp_conn->rx_event);
+		tgt_reactor_event_del(tcp_conn->reactor, tcp_conn->fd);
+		tcp_conn->reactor = session->reactor;
+		tgt_reactor_post(tcp_conn->reactor, &tcp_conn->adopt_event);
+	}
+
+	if (locked)
+		tgt_unlock_exclusive();
+}
+
+static void iscsi_tcp_adopt(struct event_data *tev)
+{
+	struct iscsi_connection *conn = tev->data;
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
+	int ret;
+
+	ret = tgt_reactor_event_add(tcp_conn->reactor, tcp_conn->fd,
+				    iscsi_tcp_tx_pending(conn) ?
+				    EPOLLIN | EPOLLOUT : EPOLLIN,
+				    iscsi_tcp_event_handler, conn);
+	if (ret) {
+		conn->state = STATE_CLOSE;
+		conn_close(conn);
+		return;
+	}
+
+	/* the last read on the old reactor may have brought in commands */
+	if (tcp_conn->rx_ring_len)
+		tgt_add_sched_event(&tcp_conn->rx_event);
+}
+
 static void iscsi_tcp_event_handler(int fd, int events, void *data)
 {
 	struct iscsi_connection *conn = (struct iscsi_connection *) data;
 
-	if (events & EPOLLIN)
-		iscsi_rx_handler(conn);
+	/* conn_close() below may drop the last reference */
+	conn_get(conn);
+
+	if (events & EPOLLERR)
+		iscsi_tcp_zc_reap(TCP_CONN(conn));
+
+	if (events & EPOLLIN && conn->rx_paused) {
+		/* iscsi_tcp_rx_resume_paused() turns it back on */
+		tgt_reactor_event_modify(TCP_CONN(conn)->reactor, fd,
+					 iscsi_tcp_tx_pending(conn) ?
+					 EPOLLOUT : 0);
+	} else if (events & EPOLLIN) {
+		struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
+		int budget = iscsi_tcp_rx_budget;
+
+		/*
+		 * Keep parsing while the ring holds data; the last read
+		 * may have brought in several PDUs.
+		 */
+		do {
+			iscsi_rx_handler(conn);
+		} while (--budget > 0 && conn->state == STATE_SCSI &&
+			 !conn->rx_paused && tcp_conn->rx_ring_len);
+
+		/*
+		 * The socket may be drained already, so epoll won't
+		 * tell us about what is left in the ring.
+		 */
+		if (conn->state == STATE_SCSI && !conn->rx_paused &&
+		    tcp_conn->rx_ring_len)
+			tgt_add_sched_event(&tcp_conn->rx_event);
+	}
 
 	if (conn->state == STATE_CLOSE)
 		dprintf("connection closed\n");
 
 	if (conn->state != STATE_CLOSE && events & EPOLLOUT)
-		iscsi_tx_handler(conn);
+		iscsi_tcp_tx_push(conn);
 
 	if (conn->state == STATE_CLOSE) {
 		dprintf("connection closed %p\n", conn);
 		conn_close(conn);
-	}
+	} else if (conn->state == STATE_SCSI && nr_reactors > 1 &&
+		   TCP_CONN(conn)->reactor == tgt_main_reactor())
+		iscsi_tcp_handover(conn);
+
+	conn_put(conn);
+}
+
+static void iscsi_tcp_rx_resume(struct event_data *tev)
+{
+	struct iscsi_connection *conn = tev->data;
+
+	iscsi_tcp_event_handler(TCP_CONN(conn)->fd, EPOLLIN, conn);
+}
+
+/* the PDU that paused receiving was digested, carry on */
+static void iscsi_tcp_rx_resume_paused(struct iscsi_connection *conn)
+{
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
+
+	tgt_reactor_event_modify(tcp_conn->reactor, tcp_conn->fd,
+				 iscsi_tcp_tx_pending(conn) ?
+				 EPOLLIN | EPOLLOUT : EPOLLIN);
+	tgt_add_sched_event(&tcp_conn->rx_event);
+}
+
+/*
+ * Send the responses that completed during this loop iteration without
+ * waiting for an EPOLLOUT round trip; EPOLLOUT is armed only when the
+ * socket buffer fills up or the budget runs out.
+ */
+static void iscsi_tcp_flush(struct event_data *tev)
+{
+	struct iscsi_connection *conn = tev->data;
+
+	conn_get(conn);
+
+	if (conn->state == STATE_SCSI && iscsi_tcp_tx_pending(conn))
+		iscsi_tcp_tx_push(conn);
+
+	if (conn->state == STATE_CLOSE)
+		conn_close(conn);
+
+	conn_put(conn);
 }
 
 int iscsi_tcp_init_portal(char *addr, int port, int tpgt)
@@ -306,6 +643,21 @@ int iscsi_delete_portal(char *addr, int port)
 	return -1;
 }
 
+void iscsi_tcp_set_rx_budget(int budget)
+{
+	iscsi_tcp_rx_budget = budget;
+}
+
+void iscsi_tcp_set_zerocopy(int threshold)
+{
+#ifdef SO_ZEROCOPY
+	iscsi_tcp_zerocopy = threshold;
+#else
+	if (threshold)
+		eprintf("zerocopy is not supported, ignored\n");
+#endif
+}
+
 static int iscsi_tcp_init(void)
 {
 	/* If we were passed any portals on the command line */
@@ -337,53 +689,181 @@ static int iscsi_tcp_conn_login_complete(struct iscsi_connection *conn)
 	return 0;
 }
 
+static size_t iscsi_tcp_ring_copy(struct iscsi_tcp_connection *tcp_conn,
+				  char *buf, size_t nbytes)
+{
+	size_t len, first;
+
+	len = min_t(size_t, nbytes, tcp_conn->rx_ring_len);
+	first = min_t(size_t, len, ISCSI_TCP_RX_RING - tcp_conn->rx_ring_head);
+
+	memcpy(buf, tcp_conn->rx_ring + tcp_conn->rx_ring_head, first);
+	memcpy(buf + first, tcp_conn->rx_ring, len - first);
+
+	tcp_conn->rx_ring_head = (tcp_conn->rx_ring_head + len) %
+		ISCSI_TCP_RX_RING;
+	tcp_conn->rx_ring_len -= len;
+	if (!tcp_conn->rx_ring_len)
+		tcp_conn->rx_ring_head = 0;
+
+	return len;
+}
+
+static int iscsi_tcp_rx_pending(struct iscsi_connection *conn)
+{
+	return TCP_CONN(conn)->rx_ring_len != 0;
+}
+
+static ssize_t iscsi_tcp_ring_fill(struct iscsi_tcp_connection *tcp_conn)
+{
+	struct iovec iov[2];
+	unsigned int tail;
+	int iovcnt = 1;
+
+	tail = (tcp_conn->rx_ring_head + tcp_conn->rx_ring_len) %
+		ISCSI_TCP_RX_RING;
+
+	iov[0].iov_base = tcp_conn->rx_ring + tail;
+	if (tail >= tcp_conn->rx_ring_head) {
+		iov[0].iov_len = ISCSI_TCP_RX_RING - tail;
+		if (tcp_conn->rx_ring_head) {
+			iov[1].iov_base = tcp_conn->rx_ring;
+			iov[1].iov_len = tcp_conn->rx_ring_head;
+			iovcnt = 2;
+		}
+	} else
+		iov[0].iov_len = tcp_conn->rx_ring_head - tail;
+
+	return readv(tcp_conn->fd, iov, iovcnt);
+}
+
 static size_t iscsi_tcp_read(struct iscsi_connection *conn, void *buf,
 			     size_t nbytes)
 {
 	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
-	return read(tcp_conn->fd, buf, nbytes);
+	size_t done = 0;
+	ssize_t ret;
+
+	if (tcp_conn->rx_ring) {
+		done = iscsi_tcp_ring_copy(tcp_conn, buf, nbytes);
+		if (done == nbytes)
+			return done;
+	}
+
+	if (!tcp_conn->rx_ring || nbytes - done >= ISCSI_TCP_RX_DIRECT)
+		ret = read(tcp_conn->fd, buf + done, nbytes - done);
+	else
+		ret = iscsi_tcp_ring_fill(tcp_conn);
+
+	if (ret < 0 || (!ret && !done))
+		return done ? done : ret;
+
+	if (tcp_conn->rx_ring && nbytes - done < ISCSI_TCP_RX_DIRECT) {
+		tcp_conn->rx_ring_len += ret;
+		return done + iscsi_tcp_ring_copy(tcp_conn, buf + done,
+						  nbytes - done);
+	}
+
+	return done + ret;
 }
 
-static size_t iscsi_tcp_write_begin(struct iscsi_connection *conn, void *buf,
-				    size_t nbytes)
+/*
+ * Data-In out of a task's in-buffer, large enough to send with
+ * MSG_ZEROCOPY, and the window has room. Anything else, such as a
+ * Text response in conn->rsp_buffer that the next response rewrites,
+ * is copied.
+ */
+static int iscsi_tcp_zc_iov(struct iscsi_connection *conn,
+			   struct iovec *iov, unsigned char zc)
 {
 	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
-	int opt = 1;
 
-#ifdef TCP_CORK
-	setsockopt(tcp_conn->fd, SOL_TCP, TCP_CORK, &opt, sizeof(opt));
-#elif defined(TCP_NOPUSH)
-	setsockopt(tcp_conn->fd, IPPROTO_TCP, TCP_NOPUSH, &opt, sizeof(opt));
-#endif
-	return write(tcp_conn->fd, buf, nbytes);
+	return zc && tcp_conn->zc && conn->state == STATE_SCSI &&
+		iov->iov_len >= iscsi_tcp_zerocopy &&
+		tcp_conn->zc_next - tcp_conn->zc_done < ISCSI_TCP_ZC_WINDOW;
 }
 
-static void iscsi_tcp_write_end(struct iscsi_connection *conn)
+/*
+ * All the PDUs ready to go are handed over in one call; MSG_MORE tells
+ * the stack that more responses follow so it can hold back a partial
+ * segment, which is what TCP_CORK used to do with two extra syscalls.
+ * With zerocopy, large payloads take a sendmsg() of their own so that
+ * the headers around them are still copied.
+ */
+static ssize_t iscsi_tcp_writev(struct iscsi_connection *conn,
+				struct iovec *iov, unsigned char *zc_iov,
+				int iovcnt, int more)
 {
 	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
-	int opt = 0;
+	struct msghdr msg;
+	ssize_t ret, len, total = 0;
+	int i, j, zc, flags;
+
+	for (i = 0; i < iovcnt; i = j) {
+		zc = iscsi_tcp_zc_iov(conn, &iov[i], zc_iov[i]);
+		len = iov[i].iov_len;
+		for (j = i + 1; !zc && j < iovcnt; j++) {
+			if (iscsi_tcp_zc_iov(conn, &iov[j], zc_iov[j]))
+				break;
+			len += iov[j].iov_len;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov + i;
+		msg.msg_iovlen = j - i;
 
-#ifdef TCP_CORK
-	setsockopt(tcp_conn->fd, SOL_TCP, TCP_CORK, &opt, sizeof(opt));
-#elif defined(TCP_NOPUSH)
-	setsockopt(tcp_conn->fd, IPPROTO_TCP, TCP_NOPUSH, &opt, sizeof(opt));
+		flags = 0;
+#ifdef MSG_MORE
+		if (more || j < iovcnt)
+			flags |= MSG_MORE;
+#endif
+#ifdef SO_ZEROCOPY
+		if (zc)
+			flags |= MSG_ZEROCOPY;
 #endif
+		ret = sendmsg(tcp_conn->fd, &msg, flags);
+		if (ret < 0) {
+			if (!total)
+				total = ret;
+			break;
+		}
+		if (zc)
+			tcp_conn->zc_next++;
+
+		total += ret;
+		if (ret < len)
+			break;
+	}
+	return total;
 }
 
 static size_t iscsi_tcp_close(struct iscsi_connection *conn)
 {
 	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
 
-	tgt_event_del(tcp_conn->fd);
+	/* not registered yet if it is still on the way to its reactor */
+	if (!tgt_reactor_unpost(tcp_conn->reactor, &tcp_conn->adopt_event))
+		tgt_reactor_event_del(tcp_conn->reactor, tcp_conn->fd);
+	tgt_remove_sched_event(&tcp_conn->flush_event);
+	tgt_remove_sched_event(&tcp_conn->rx_event);
 	return 0;
 }
 
 static void iscsi_tcp_release(struct iscsi_connection *conn)
 {
 	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
+	struct iscsi_task *task, *tmp;
+
+	list_for_each_entry_safe(task, tmp, &tcp_conn->task_cache, c_list)
+		free(task);
 
 	conn_exit(conn);
+	/* nobody can reach the connection to post a close any more */
+	tgt_reactor_unpost(tcp_conn->reactor, &tcp_conn->close_event);
 	close(tcp_conn->fd);
+	/* the socket is gone, the kernel won't report completions now */
+	iscsi_tcp_zc_free(tcp_conn, 1);
+	free(tcp_conn->rx_ring);
 	free(tcp_conn);
 }
 
@@ -419,7 +899,26 @@ static void iscsi_event_modify(struct iscsi_connection *conn, int events)
 	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
 	int ret;
 
-	ret = tgt_event_modify(tcp_conn->fd, events);
+	/* its fd left the event loop when it was closed */
+	if (conn->closed)
+		return;
+
+	if (conn->rx_paused)
+		events &= ~EPOLLIN;
+
+	/*
+	 * A response queued on the connection's own reactor is flushed
+	 * before that reactor sleeps again, so leave the armed events
+	 * alone; iscsi_tcp_flush() arms EPOLLOUT if it can't finish.
+	 */
+	if (events & EPOLLOUT && conn->state == STATE_SCSI &&
+	    tgt_current_reactor() == tcp_conn->reactor) {
+		tgt_add_sched_event(&tcp_conn->flush_event);
+		return;
+	}
+
+	ret = tgt_reactor_event_modify(tcp_conn->reactor, tcp_conn->fd,
+				       events);
 	if (ret)
 		eprintf("tgt_event_modify failed\n");
 }
@@ -427,8 +926,21 @@ static void iscsi_event_modify(struct iscsi_connection *conn, int events)
 static struct iscsi_task *iscsi_tcp_alloc_task(struct iscsi_connection *conn,
 					size_t ext_len)
 {
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
 	struct iscsi_task *task;
 
+	if (!ext_len && !list_empty(&tcp_conn->task_cache)) {
+		task = list_first_entry(&tcp_conn->task_cache,
+					struct iscsi_task, c_list);
+		list_del(&task->c_list);
+		tcp_conn->nr_task_cache--;
+		conn->task_cache_hits++;
+
+		memset(task, 0, sizeof(*task));
+		return task;
+	}
+
+	conn->task_cache_misses++;
 	task = malloc(sizeof(*task) + ext_len);
 	if (task)
 		memset(task, 0, sizeof(*task) + ext_len);
@@ -437,18 +949,44 @@ static struct iscsi_task *iscsi_tcp_alloc_task(struct iscsi_connection *conn,
 
 static void iscsi_tcp_free_task(struct iscsi_task *task)
 {
-	free(task);
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(task->conn);
+
+	/* the extended data is only there for commands with AHS */
+	if (task->ahs || tcp_conn->nr_task_cache >= ISCSI_TCP_TASK_CACHE) {
+		free(task);
+		return;
+	}
+
+	list_add(&task->c_list, &tcp_conn->task_cache);
+	tcp_conn->nr_task_cache++;
 }
 
 static void *iscsi_tcp_alloc_data_buf(struct iscsi_connection *conn, size_t sz)
 {
-	return valloc(sz);
+	return iscsi_buf_alloc(sz);
 }
 
 static void iscsi_tcp_free_data_buf(struct iscsi_connection *conn, void *buf)
 {
-	if (buf)
-		free(buf);
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
+	struct iscsi_tcp_zc_buf *zb;
+
+	if (!buf)
+		return;
+
+	if (tcp_conn->zc_done != tcp_conn->zc_next) {
+		zb = malloc(sizeof(*zb));
+		if (!zb) {
+			eprintf("can't defer freeing a zerocopy buffer\n");
+			return;
+		}
+		zb->buf = buf;
+		zb->id = tcp_conn->zc_next;
+		list_add_tail(&zb->list, &tcp_conn->zc_bufs);
+		return;
+	}
+
+	iscsi_buf_free(buf);
 }
 
 static int iscsi_tcp_getsockname(struct iscsi_connection *conn,
@@ -467,8 +1005,28 @@ static int iscsi_tcp_getpeername(struct iscsi_connection *conn,
 	return getpeername(tcp_conn->fd, sa, len);
 }
 
+static void iscsi_tcp_close_posted(struct event_data *tev)
+{
+	struct iscsi_connection *conn = tev->data;
+
+	if (conn->closed)
+		return;
+
+	conn->state = STATE_CLOSE;
+	conn->tp->ep_event_modify(conn, EPOLLIN|EPOLLOUT|EPOLLERR);
+}
+
 static void iscsi_tcp_conn_force_close(struct iscsi_connection *conn)
 {
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
+
+	/* only the owner may touch the connection unless the rest wait */
+	if (tgt_current_reactor() != tcp_conn->reactor &&
+	    !tgt_is_exclusive()) {
+		tgt_reactor_post(tcp_conn->reactor, &tcp_conn->close_event);
+		return;
+	}
+
 	conn->state = STATE_CLOSE;
 	conn->tp->ep_event_modify(conn, EPOLLIN|EPOLLOUT|EPOLLERR);
 }
@@ -483,8 +1041,9 @@ static struct iscsi_transport iscsi_tcp = {
 	.alloc_task		= iscsi_tcp_alloc_task,
 	.free_task		= iscsi_tcp_free_task,
 	.ep_read		= iscsi_tcp_read,
-	.ep_write_begin		= iscsi_tcp_write_begin,
-	.ep_write_end		= iscsi_tcp_write_end,
+	.ep_writev		= iscsi_tcp_writev,
+	.ep_rx_resume		= iscsi_tcp_rx_resume_paused,
+	.ep_rx_pending		= iscsi_tcp_rx_pending,
 	.ep_close		= iscsi_tcp_close,
 	.ep_force_close		= iscsi_tcp_conn_force_close,
 	.ep_release		= iscsi_tcp_release,
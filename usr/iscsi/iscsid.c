@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
@@ -42,8 +43,6 @@
 #include "tgtadm.h"
 #include "crc32c.h"
 
-#define MAX_QUEUE_CMD	128
-
 LIST_HEAD(iscsi_portals_list);
 
 char *portal_arguments;
@@ -62,6 +61,7 @@ enum {
 	IOSTATE_RX_INIT_DDIGEST,
 	IOSTATE_RX_DDIGEST,
 	IOSTATE_RX_CHECK_DDIGEST,
+	IOSTATE_RX_WAIT_DDIGEST,
 	IOSTATE_RX_END,
 
 	IOSTATE_TX_BHS,
@@ -81,6 +81,7 @@ void conn_read_pdu(struct iscsi_connection *conn)
 	conn->rx_iostate = IOSTATE_RX_BHS;
 	conn->rx_buffer = (void *)&conn->req.bhs;
 	conn->rx_size = BHS_SIZE;
+	conn->rx_crc = ~0;
 }
 
 static void conn_write_pdu(struct iscsi_connection *conn)
@@ -251,15 +252,32 @@ static void text_scan_security(struct iscsi_connection *conn)
 	}
 }
 
-static void login_security_done(struct iscsi_connection *conn)
+/* keys negotiated on the leading connection, for the whole session */
+static int param_leading_only(int idx)
+{
+	switch (idx) {
+	case ISCSI_PARAM_INITIAL_R2T_EN:
+	case ISCSI_PARAM_MAX_R2T:
+	case ISCSI_PARAM_IMM_DATA_EN:
+	case ISCSI_PARAM_FIRST_BURST:
+	case ISCSI_PARAM_MAX_BURST:
+	case ISCSI_PARAM_PDU_INORDER_EN:
+	case ISCSI_PARAM_DATASEQ_INORDER_EN:
+	case ISCSI_PARAM_ERL:
+	case ISCSI_PARAM_DEFAULTTIME2WAIT:
+	case ISCSI_PARAM_DEFAULTTIME2RETAIN:
+	case ISCSI_PARAM_MAXCONNECTIONS:
+		return 1;
+	}
+	return 0;
+}
+
+static void __login_security_done(struct iscsi_connection *conn)
 {
 	struct iscsi_login *req = (struct iscsi_login *)&conn->req.bhs;
 	struct iscsi_login_rsp *rsp = (struct iscsi_login_rsp *) &conn->rsp.bhs;
 	struct iscsi_session *session;
 
-	if (!conn->tid)
-		return;
-
 	session = session_find_name(conn->tid, conn->initiator, req->isid);
 	if (session) {
 		if (!req->tsih) {
@@ -267,10 +285,13 @@ static void login_security_done(struct iscsi_connection *conn)
 
 			/* do session reinstatement */
 
+			/* the last connection to go would free the list head */
+			session_get(session);
 			list_for_each_entry_safe(ent, next, &session->conn_list,
 						 clist) {
 				conn_close(ent);
 			}
+			session_put(session);
 
 			session = NULL;
 		} else if (req->tsih != session->tsih) {
@@ -279,13 +300,39 @@ static void login_security_done(struct iscsi_connection *conn)
 			rsp->status_detail = ISCSI_LOGIN_STATUS_TGT_NOT_FOUND;
 			conn->state = STATE_EXIT;
 			return;
-		} else if (conn_find(session, conn->cid)) {
+		} else {
+			struct iscsi_connection *ent;
+			int max_conns;
+
 			/* do connection reinstatement */
+			ent = conn_find(session, conn->cid);
+			if (ent && !ent->closed)
+				conn_close(ent);
+
+			max_conns = session->session_param[ISCSI_PARAM_MAXCONNECTIONS].val;
+			if (conn_count(session) >= max_conns) {
+				rsp->status_class = ISCSI_STATUS_CLS_INITIATOR_ERR;
+				rsp->status_detail = ISCSI_LOGIN_STATUS_CONN_ADD_FAILED;
+				conn->state = STATE_EXIT;
+				return;
+			}
 		}
 
 		/* add a new connection to the session */
-		if (session)
+		if (session) {
+			int i;
+
 			conn_add_to_session(conn, session);
+
+			/* the session wide keys were negotiated already */
+			for (i = 0; i < ISCSI_PARAM_MAX; i++) {
+				if (!param_leading_only(i))
+					continue;
+				conn->session_param[i].val =
+					session->session_param[i].val;
+				conn->session_param[i].state = KEY_STATE_DONE;
+			}
+		}
 	} else {
 		if (req->tsih) {
 			/* fail the login */
@@ -301,6 +348,20 @@ static void login_security_done(struct iscsi_connection *conn)
 	}
 }
 
+static void login_security_done(struct iscsi_connection *conn)
+{
+	if (!conn->tid)
+		return;
+
+	/*
+	 * An existing session is served by the reactor it was handed
+	 * to, which must not run while we reinstate or join it.
+	 */
+	tgt_lock_exclusive();
+	__login_security_done(conn);
+	tgt_unlock_exclusive();
+}
+
 static void text_scan_login(struct iscsi_connection *conn)
 {
 	char *key, *value, *data;
@@ -320,6 +381,12 @@ static void text_scan_login(struct iscsi_connection *conn)
 			unsigned int val;
 			char buf[32];
 
+			/* can't be changed by a connection joining a session */
+			if (conn->session && param_leading_only(idx)) {
+				text_key_add_reject(conn, key);
+				continue;
+			}
+
 			if (idx == ISCSI_PARAM_MAX_RECV_DLENGTH)
 				idx = ISCSI_PARAM_MAX_XMIT_DLENGTH;
 
@@ -346,9 +413,15 @@ static void text_scan_login(struct iscsi_connection *conn)
 				text_key_add_reject(conn, key);
 				continue;
 			}
-			if (idx == ISCSI_PARAM_MAX_XMIT_DLENGTH)
+			if (idx == ISCSI_PARAM_MAX_XMIT_DLENGTH) {
+				/*
+				 * The initiator's MaxRecvDataSegmentLength,
+				 * limited by the target's cap.
+				 */
+				if (val > conn->session_param[idx].val)
+					val = conn->session_param[idx].val;
 				conn->session_param[idx].val = val;
-			else
+			} else
 				param_set_val(session_keys,
 					      conn->session_param,
 					      idx, &val);
@@ -604,6 +677,11 @@ static void login_finish(struct iscsi_connection *conn)
 				detail =ISCSI_LOGIN_STATUS_INVALID_REQUEST;
 				goto fail;
 			}
+			/* commands are numbered session wide */
+			tgt_lock_exclusive();
+			conn->exp_cmd_sn = conn->session->exp_cmd_sn;
+			conn->max_cmd_sn = conn->session->max_cmd_sn;
+			tgt_unlock_exclusive();
 		}
 		memcpy(conn->isid, conn->session->isid, sizeof(conn->isid));
 		conn->tsih = conn->session->tsih;
@@ -738,6 +816,10 @@ static void cmnd_exec_login(struct iscsi_connection *conn)
 			login_start(conn);
 			if (account_available(conn->tid, AUTH_DIR_INCOMING))
 				goto auth_err;
+			if (rsp->status_class)
+				return;
+			/* no security stage, find the session now */
+			login_security_done(conn);
 			if (rsp->status_class)
 				return;
 			text_scan_login(conn);
@@ -772,6 +854,8 @@ static void cmnd_exec_login(struct iscsi_connection *conn)
 			case STATE_SECURITY_DONE:
 				conn->state = STATE_SECURITY_LOGIN;
 				login_security_done(conn);
+				if (rsp->status_class)
+					return;
 				break;
 			default:
 				goto init_err;
@@ -788,6 +872,8 @@ static void cmnd_exec_login(struct iscsi_connection *conn)
 				}
 				conn->state = STATE_SECURITY_FULL;
 				login_security_done(conn);
+				if (rsp->status_class)
+					return;
 				break;
 			case STATE_LOGIN:
 				if (stay)
@@ -1041,6 +1127,26 @@ static inline void iscsi_rsp_set_bidir_resid(struct iscsi_cmd_rsp *rsp,
 	}
 }
 
+/*
+ * MaxCmdSN for a response. The window counts from the oldest command
+ * that hasn't completed, so it limits what the backend is given, not
+ * just what is on the way. Commands held in the ring are past
+ * ExpCmdSN already and don't move its start. Initiators ignore a
+ * smaller MaxCmdSN than they have seen, so the highest one sent is
+ * what they may use.
+ */
+static uint32_t iscsi_max_cmd_sn(struct iscsi_session *session)
+{
+	uint32_t max_cmd_sn = session->exp_cmd_sn -
+		(session->nr_cmds - session->nr_cmd_ring) +
+		session->cmd_window;
+
+	if (after(max_cmd_sn, session->max_cmd_sn))
+		session->max_cmd_sn = max_cmd_sn;
+
+	return session->max_cmd_sn;
+}
+
 void iscsi_rsp_set_residual(struct iscsi_cmd_rsp *rsp, struct scsi_cmd *scmd)
 {
 	rsp->bi_residual_count = 0;
@@ -1075,7 +1181,7 @@ static int iscsi_cmd_rsp_build(struct iscsi_task *task)
 	rsp->cmd_status = scsi_get_result(&task->scmd);
 	rsp->statsn = cpu_to_be32(conn->stat_sn++);
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn + MAX_QUEUE_CMD);
+	rsp->max_cmdsn = cpu_to_be32(iscsi_max_cmd_sn(conn->session));
 
 	iscsi_rsp_set_residual(rsp, &task->scmd);
 
@@ -1131,28 +1237,93 @@ static int iscsi_data_rsp_build(struct iscsi_task *task)
 			rsp->statsn = cpu_to_be32(conn->stat_sn++);
 			iscsi_rsp_set_residual((struct iscsi_cmd_rsp *) rsp,
 					       &task->scmd);
+			/* shares its place with bi_residual_count */
+			rsp->offset = cpu_to_be32(task->offset);
 		}
 	} else
 		datalen = maxdatalen;
 
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn + MAX_QUEUE_CMD);
+	rsp->max_cmdsn = cpu_to_be32(iscsi_max_cmd_sn(conn->session));
 
 	conn->rsp.datasize = datalen;
 	hton24(rsp->dlength, datalen);
 	conn->rsp.data = scsi_get_in_buffer(&task->scmd);
 	conn->rsp.data += task->offset;
+	conn->rsp.data_zc = 1;
 
 	task->offset += datalen;
 
 	return 0;
 }
 
+static int iscsi_max_r2t(struct iscsi_connection *conn)
+{
+	return min_t(int, conn->session_param[ISCSI_PARAM_MAX_R2T].val,
+		     ISCSI_MAX_R2T);
+}
+
+/* queue the task to send an R2T for more of its data */
+static void iscsi_r2t_queue(struct iscsi_task *task, int head)
+{
+	struct iscsi_connection *conn = task->conn;
+
+	if (task_r2t_queued(task))
+		return;
+
+	set_task_r2t_queued(task);
+	if (head)
+		list_add(&task->c_list, &conn->tx_clist);
+	else
+		list_add_tail(&task->c_list, &conn->tx_clist);
+}
+
+static struct iscsi_r2t *iscsi_r2t_find(struct iscsi_task *task,
+					uint32_t ttt)
+{
+	int i;
+
+	if (!task->r2t)
+		return NULL;
+
+	for (i = 0; i < iscsi_max_r2t(task->conn); i++) {
+		if (task->r2t[i].length && task->r2t[i].ttt == ttt)
+			return &task->r2t[i];
+	}
+
+	return NULL;
+}
+
 static int iscsi_r2t_build(struct iscsi_task *task)
 {
 	struct iscsi_connection *conn = task->conn;
+	struct iscsi_session *session = conn->session;
 	struct iscsi_r2t_rsp *rsp = (struct iscsi_r2t_rsp *) &conn->rsp.bhs;
-	uint32_t length;
+	struct iscsi_r2t *r2t;
+	uint32_t length, ttt;
+	int i, max_r2t = iscsi_max_r2t(conn);
+
+	/* reads and writes done with unsolicited data never get here */
+	if (!task->r2t) {
+		task->r2t = calloc(max_r2t, sizeof(*task->r2t));
+		if (!task->r2t)
+			return -ENOMEM;
+	}
+
+	for (i = 0; i < max_r2t; i++) {
+		if (!task->r2t[i].length)
+			break;
+	}
+	if (i == max_r2t)
+		return -EINVAL;
+	r2t = &task->r2t[i];
+
+	/* an opaque tag that finds the task in the session's ttt_hash */
+	ttt = session->next_ttt++;
+	if (ttt == ISCSI_RESERVED_TAG)
+		ttt = session->next_ttt++;
+	if (task_hash_add(&session->ttt_hash, ttt, task))
+		return -ENOMEM;
 
 	memset(rsp, 0, sizeof(*rsp));
 
@@ -1161,15 +1332,24 @@ static int iscsi_r2t_build(struct iscsi_task *task)
 	memcpy(rsp->lun, task->req.lun, sizeof(rsp->lun));
 
 	rsp->itt = task->req.itt;
+	rsp->ttt = ttt;
 	rsp->r2tsn = cpu_to_be32(task->exp_r2tsn++);
 	rsp->data_offset = cpu_to_be32(task->offset);
 	/* return next statsn for this conn w/o advancing it */
 	rsp->statsn = cpu_to_be32(conn->stat_sn);
-	rsp->ttt = (unsigned long) task;
 	length = min_t(uint32_t, task->r2t_count,
 		       conn->session_param[ISCSI_PARAM_MAX_BURST].val);
 	rsp->data_length = cpu_to_be32(length);
 
+	r2t->ttt = rsp->ttt;
+	r2t->offset = task->offset;
+	r2t->length = length;
+	task->nr_r2t++;
+
+	/* the next R2T asks for what follows this one */
+	task->offset += length;
+	task->r2t_count -= length;
+
 	return 0;
 }
 
@@ -1183,6 +1363,7 @@ static struct iscsi_task *iscsi_alloc_task(struct iscsi_connection *conn,
 	task = conn->tp->alloc_task(conn, ext_len);
 	if (!task)
 		return NULL;
+	task->conn = conn;
 
 	if (data_len) {
 		buf = conn->tp->alloc_data_buf(conn, data_len);
@@ -1194,22 +1375,42 @@ static struct iscsi_task *iscsi_alloc_task(struct iscsi_connection *conn,
 	}
 
 	memcpy(&task->req, req, sizeof(*req));
-	task->conn = conn;
-	INIT_LIST_HEAD(&task->c_hlist);
 	INIT_LIST_HEAD(&task->c_list);
 	list_add(&task->c_siblings, &conn->task_list);
 	conn_get(conn);
 	return task;
 }
 
+static void iscsi_task_unhash(struct iscsi_task *task)
+{
+	struct iscsi_session *session = task->conn->session;
+	int i;
+
+	for (i = 0; task->r2t && i < iscsi_max_r2t(task->conn); i++) {
+		if (task->r2t[i].length)
+			task_hash_del(&session->ttt_hash, task->r2t[i].ttt,
+				      task);
+	}
+	task_hash_del(&session->itt_hash, task->tag, task);
+	clear_task_hashed(task);
+}
+
 void iscsi_free_task(struct iscsi_task *task)
 {
 	struct iscsi_connection *conn = task->conn;
 
 	list_del(&task->c_siblings);
 
+	if (task_hashed(task))
+		iscsi_task_unhash(task);
+
+	if (task_in_window(task))
+		conn->session->nr_cmds--;
+
 	conn->tp->free_data_buf(conn, scsi_get_in_buffer(&task->scmd));
 	conn->tp->free_data_buf(conn, scsi_get_out_buffer(&task->scmd));
+	sense_buffer_free(&task->scmd);
+	free(task->r2t);
 
 	conn->tp->free_task(task);
 	conn_put(conn);
@@ -1224,13 +1425,73 @@ void iscsi_free_cmd_task(struct iscsi_task *task)
 {
 	target_cmd_done(&task->scmd);
 
-	list_del(&task->c_hlist);
 	iscsi_free_task(task);
 }
 
+/* in usecs */
+#define ISCSI_CMD_WINDOW_LAT_AGE	(10 * 1000000)
+
+static uint64_t iscsi_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Adapt the command window to the backend. Commands handed over in a
+ * burst complete with a spread of latencies, but if even the quickest
+ * of a window's worth took well over the lowest latency seen, they
+ * are standing in a queue: the backend is saturated and the window
+ * shrinks so that the initiator holds commands back instead. As long
+ * as they don't queue up, the window grows; a window only grants, so
+ * one larger than what the initiator uses costs nothing.
+ */
+static void iscsi_cmd_window_update(struct iscsi_session *session,
+				    uint64_t now, uint32_t lat)
+{
+	int window = session->cmd_window;
+	/* below this, the latency is too small to tell queueing apart */
+	const uint32_t slack = 50;
+
+	if (!session->lat_min || lat < session->lat_min) {
+		session->lat_min = lat;
+		session->lat_min_time = now;
+	}
+	if (!session->nr_done || lat < session->lat_cur)
+		session->lat_cur = lat;
+
+	if (++session->nr_done < window)
+		return;
+	session->nr_done = 0;
+
+	if (session->lat_cur > 2 * session->lat_min + slack)
+		window -= window / 4;
+	else
+		window += window / 4;
+
+	session->cmd_window = min_t(int, max_t(int, window,
+						 ISCSI_CMD_WINDOW_MIN),
+				    ISCSI_CMD_WINDOW_MAX);
+
+	/* forget an old lowest latency, the backend may have got slower */
+	if (now - session->lat_min_time > ISCSI_CMD_WINDOW_LAT_AGE) {
+		session->lat_min = session->lat_cur;
+		session->lat_min_time = now;
+	}
+}
+
 static int iscsi_scsi_cmd_done(uint64_t nid, int result, struct scsi_cmd *scmd)
 {
 	struct iscsi_task *task = ITASK(scmd);
+	struct iscsi_session *session = task->conn->session;
+
+	if (session->cmd_window_adaptive) {
+		uint64_t now = iscsi_time_us();
+
+		iscsi_cmd_window_update(session, now, now - task->start_time);
+	}
 
 	/*
 	 * Since the connection is closed we just free the task.
@@ -1238,7 +1499,7 @@ static int iscsi_scsi_cmd_done(uint64_t nid, int result, struct scsi_cmd *scmd)
 	 * the response with a little extra code or we can check if this
 	 * task got reassinged to another connection.
 	 */
-	if (task->conn->state == STATE_CLOSE) {
+	if (task->conn->state == STATE_CLOSE || task->conn->closed) {
 		iscsi_free_cmd_task(task);
 		return 0;
 	}
@@ -1281,6 +1542,7 @@ static int iscsi_target_cmd_queue(struct iscsi_task *task)
 	enum data_direction dir = scsi_get_data_dir(scmd);
 
 	scmd->cmd_itn_id = conn->session->tsih;
+	scmd->it_nexus = conn->session->it_nexus;
 	scmd->scb = req->cdb;
 	scmd->scb_len = sizeof(req->cdb);
 
@@ -1354,6 +1616,11 @@ static int iscsi_target_cmd_queue(struct iscsi_task *task)
 	scmd->tag = req->itt;
 	set_task_in_scsi(task);
 
+	/* the backing store may hold it back for the ones that follow */
+	if (conn->tp->ep_rx_pending && conn->tp->ep_rx_pending(conn))
+		set_cmd_not_last(scmd);
+
+	task->start_time = iscsi_time_us();
 	err = target_cmd_queue(conn->session->target->tid, scmd);
 	if (err)
 		clear_task_in_scsi(task);
@@ -1367,9 +1634,11 @@ int iscsi_scsi_cmd_execute(struct iscsi_task *task)
 	struct iscsi_cmd *req = (struct iscsi_cmd *) &task->req;
 	int ret = 0;
 
-	if ((req->flags & ISCSI_FLAG_CMD_WRITE) && task->r2t_count) {
-		if (!task->unsol_count)
-			list_add_tail(&task->c_list, &task->conn->tx_clist);
+	if ((req->flags & ISCSI_FLAG_CMD_WRITE) &&
+	    (task->r2t_count || task->nr_r2t)) {
+		if (!task->unsol_count && task->r2t_count &&
+		    task->nr_r2t < iscsi_max_r2t(conn))
+			iscsi_r2t_queue(task, 0);
 		goto no_queuing;
 	}
 
@@ -1465,6 +1734,58 @@ static int iscsi_tm_execute(struct iscsi_task *task)
 	return err;
 }
 
+/*
+ * A logout closes the session, the connection it came on or another
+ * connection of the session. The connections are closed once the
+ * response is sent, except for another one, closed right away.
+ */
+static void iscsi_logout_execute(struct iscsi_task *task)
+{
+	struct iscsi_logout *req = (struct iscsi_logout *) &task->req;
+	struct iscsi_connection *conn;
+
+	switch (req->flags & ISCSI_FLAG_LOGOUT_REASON_MASK) {
+	case ISCSI_LOGOUT_REASON_CLOSE_SESSION:
+		break;
+	case ISCSI_LOGOUT_REASON_CLOSE_CONNECTION:
+		if (be16_to_cpu(req->cid) == task->conn->cid)
+			break;
+
+		conn = conn_find(task->conn->session, be16_to_cpu(req->cid));
+		if (conn && !conn->closed)
+			conn->tp->ep_force_close(conn);
+		else
+			task->result = ISCSI_LOGOUT_CID_NOT_FOUND;
+		break;
+	default:
+		/* no connection recovery with ErrorRecoveryLevel 0 */
+		task->result = ISCSI_LOGOUT_RECOVERY_UNSUPPORTED;
+		break;
+	}
+}
+
+static void iscsi_logout_tx_done(struct iscsi_task *task)
+{
+	struct iscsi_logout *req = (struct iscsi_logout *) &task->req;
+	struct iscsi_connection *conn = task->conn, *ent;
+
+	switch (req->flags & ISCSI_FLAG_LOGOUT_REASON_MASK) {
+	case ISCSI_LOGOUT_REASON_CLOSE_SESSION:
+		list_for_each_entry(ent, &conn->session->conn_list, clist) {
+			if (ent != conn && !ent->closed)
+				ent->tp->ep_force_close(ent);
+		}
+		conn->state = STATE_CLOSE;
+		break;
+	case ISCSI_LOGOUT_REASON_CLOSE_CONNECTION:
+		if (be16_to_cpu(req->cid) == conn->cid)
+			conn->state = STATE_CLOSE;
+		break;
+	}
+
+	iscsi_free_task(task);
+}
+
 static int iscsi_task_execute(struct iscsi_task *task)
 {
 	struct iscsi_hdr *hdr = (struct iscsi_hdr *) &task->req;
@@ -1472,8 +1793,10 @@ static int iscsi_task_execute(struct iscsi_task *task)
 	int err;
 
 	switch (op) {
-	case ISCSI_OP_NOOP_OUT:
 	case ISCSI_OP_LOGOUT:
+		iscsi_logout_execute(task);
+		/* fall through */
+	case ISCSI_OP_NOOP_OUT:
 		list_add_tail(&task->c_list, &task->conn->tx_clist);
 		task->conn->tp->ep_event_modify(task->conn, EPOLLIN | EPOLLOUT);
 		break;
@@ -1512,6 +1835,7 @@ static int iscsi_task_execute(struct iscsi_task *task)
 static int iscsi_data_out_rx_done(struct iscsi_task *task)
 {
 	struct iscsi_hdr *hdr = &task->conn->req.bhs;
+	struct iscsi_r2t *r2t;
 	int err = 0;
 
 	if (hdr->ttt == cpu_to_be32(ISCSI_RESERVED_TAG)) {
@@ -1524,6 +1848,15 @@ static int iscsi_data_out_rx_done(struct iscsi_task *task)
 		if (!(hdr->flags & ISCSI_FLAG_CMD_FINAL))
 			return err;
 
+		/* the last Data-Out for this R2T, its slot is free again */
+		r2t = iscsi_r2t_find(task, hdr->ttt);
+		if (r2t) {
+			task_hash_del(&task->conn->session->ttt_hash,
+				      r2t->ttt, task);
+			r2t->length = 0;
+			task->nr_r2t--;
+		}
+
 		err = iscsi_scsi_cmd_execute(task);
 	}
 
@@ -1534,35 +1867,140 @@ static int iscsi_data_out_rx_start(struct iscsi_connection *conn)
 {
 	struct iscsi_task *task;
 	struct iscsi_data *req = (struct iscsi_data *) &conn->req.bhs;
+	struct iscsi_r2t *r2t;
+	uint32_t offset, length;
 
-	list_for_each_entry(task, &conn->session->cmd_list, c_hlist) {
-		if (task->tag == req->itt)
-			goto found;
+	if (req->ttt == cpu_to_be32(ISCSI_RESERVED_TAG))
+		task = task_hash_find(&conn->session->itt_hash, req->itt);
+	else {
+		task = task_hash_find(&conn->session->ttt_hash, req->ttt);
+		if (task && task->tag != req->itt)
+			task = NULL;
 	}
-	return -EINVAL;
-found:
+	/* Data-Out comes on the connection the command came on */
+	if (!task || task->conn != conn)
+		return -EINVAL;
+
+	offset = be32_to_cpu(req->offset);
+	length = ntoh24(req->dlength);
+
 	dprintf("found a task %" PRIx64 " %u %u %u %u %u\n", task->tag,
 		ntohl(((struct iscsi_cmd *) (&task->req))->data_length),
 		task->offset,
 		task->r2t_count,
-		ntoh24(req->dlength), be32_to_cpu(req->offset));
+		length, offset);
 
-	conn->req.data = task->data + be32_to_cpu(req->offset);
+	if (offset + length > ntohl(((struct iscsi_cmd *) &task->req)->data_length)) {
+		eprintf("Data-Out beyond the buffer %" PRIx64 " %u %u\n",
+			task->tag, offset, length);
+		return -EINVAL;
+	}
+
+	if (req->ttt == cpu_to_be32(ISCSI_RESERVED_TAG)) {
+		task->offset += length;
+		task->r2t_count -= length;
+	} else {
+		/*
+		 * Data-Out PDUs for different R2Ts may come interleaved,
+		 * each must stay within the R2T it answers.
+		 */
+		r2t = iscsi_r2t_find(task, req->ttt);
+		if (!r2t || offset < r2t->offset ||
+		    offset + length > r2t->offset + r2t->length) {
+			eprintf("bad Data-Out %" PRIx64 " %x %u %u\n",
+				task->tag, be32_to_cpu(req->ttt), offset,
+				length);
+			return -EINVAL;
+		}
+	}
 
-	task->offset += ntoh24(req->dlength);
-	task->r2t_count -= ntoh24(req->dlength);
+	conn->req.data = task->data + offset;
 
 	conn->rx_task = task;
 
 	return 0;
 }
 
+/*
+ * Make the ring cover every CmdSN up to MaxCmdSN, each with a slot of
+ * its own; it grows along with the command window.
+ */
+static int iscsi_cmd_ring_resize(struct iscsi_session *session)
+{
+	struct iscsi_task **ring, *task;
+	unsigned int i, size = session->cmd_ring_size ? : 1;
+	uint32_t cmd_sn;
+
+	while (size <= session->max_cmd_sn - session->exp_cmd_sn)
+		size <<= 1;
+	if (size == session->cmd_ring_size)
+		return 0;
+
+	ring = calloc(size, sizeof(*ring));
+	if (!ring)
+		return -ENOMEM;
+
+	for (i = 0; i < session->cmd_ring_size; i++) {
+		task = session->cmd_ring[i];
+		if (!task)
+			continue;
+		cmd_sn = be32_to_cpu(task->req.statsn);
+		ring[cmd_sn & (size - 1)] = task;
+	}
+
+	free(session->cmd_ring);
+	session->cmd_ring = ring;
+	session->cmd_ring_size = size;
+
+	return 0;
+}
+
+/* run the commands that were waiting for the ones before them */
+static void iscsi_cmd_ring_run(struct iscsi_session *session)
+{
+	struct iscsi_task **slot, *task;
+
+	while (session->nr_cmd_ring) {
+		slot = &session->cmd_ring[session->exp_cmd_sn &
+					  (session->cmd_ring_size - 1)];
+		task = *slot;
+		if (!task)
+			break;
+
+		*slot = NULL;
+		session->nr_cmd_ring--;
+		clear_task_pending(task);
+		session->exp_cmd_sn++;
+
+		iscsi_task_execute(task);
+	}
+}
+
+/*
+ * Called when a connection of a session with others left drops: the
+ * commands up to the first one we have are given up on.
+ */
+void iscsi_cmd_ring_skip(struct iscsi_session *session)
+{
+	uint32_t cmd_sn = session->exp_cmd_sn;
+
+	if (!session->nr_cmd_ring)
+		return;
+
+	while (!session->cmd_ring[cmd_sn & (session->cmd_ring_size - 1)])
+		cmd_sn++;
+
+	eprintf("skipping cmd_sn (%u,%u)\n", session->exp_cmd_sn, cmd_sn);
+	session->exp_cmd_sn = cmd_sn;
+	iscsi_cmd_ring_run(session);
+}
+
 static int iscsi_task_queue(struct iscsi_task *task)
 {
 	struct iscsi_session *session = task->conn->session;
 	struct iscsi_hdr *req = (struct iscsi_hdr *) &task->req;
+	struct iscsi_task **slot;
 	uint32_t cmd_sn;
-	struct iscsi_task *ent;
 	int err;
 
 	dprintf("%x %x %x\n", be32_to_cpu(req->statsn), session->exp_cmd_sn,
@@ -1571,39 +2009,56 @@ static int iscsi_task_queue(struct iscsi_task *task)
 	if (req->opcode & ISCSI_OP_IMMEDIATE)
 		return iscsi_task_execute(task);
 
+	/* takes a place in the command window until it's freed */
+	set_task_in_window(task);
+	session->nr_cmds++;
+
 	cmd_sn = be32_to_cpu(req->statsn);
 	if (cmd_sn == session->exp_cmd_sn) {
-	retry:
 		session->exp_cmd_sn = ++cmd_sn;
 
 		/* Should we close the connection... */
 		err = iscsi_task_execute(task);
 
-		if (list_empty(&session->pending_cmd_list))
-			return 0;
-		task = list_first_entry(&session->pending_cmd_list,
-					struct iscsi_task, c_list);
-		if (be32_to_cpu(task->req.statsn) != cmd_sn)
-			return 0;
-
-		list_del(&task->c_list);
-		clear_task_pending(task);
-		goto retry;
+		iscsi_cmd_ring_run(session);
 	} else {
+		/*
+		 * Already seen, or skipped when the connection it was
+		 * sent on dropped: to be ignored as well.
+		 */
 		if (before(cmd_sn, session->exp_cmd_sn)) {
 			eprintf("unexpected cmd_sn (%u,%u)\n",
 				cmd_sn, session->exp_cmd_sn);
-			return -EINVAL;
+			iscsi_free_task(task);
+			return 0;
+		}
+
+		/* outside the command window, to be ignored (RFC 3720 3.2.2.1) */
+		if (after(cmd_sn, session->max_cmd_sn)) {
+			eprintf("cmd_sn beyond the window (%u,%u,%u)\n",
+				cmd_sn, session->exp_cmd_sn,
+				session->max_cmd_sn);
+			iscsi_free_task(task);
+			return 0;
 		}
 
-		/* TODO: check max cmd_sn */
+		if (session->max_cmd_sn - session->exp_cmd_sn >=
+		    session->cmd_ring_size && iscsi_cmd_ring_resize(session))
+			return -ENOMEM;
 
-		list_for_each_entry(ent, &session->pending_cmd_list, c_list) {
-			if (before(cmd_sn, be32_to_cpu(ent->req.statsn)))
-				break;
+		/*
+		 * Already held, a retransmit after a connection of the
+		 * session dropped: ignored like the ones above.
+		 */
+		slot = &session->cmd_ring[cmd_sn & (session->cmd_ring_size - 1)];
+		if (*slot) {
+			eprintf("duplicate cmd_sn %u\n", cmd_sn);
+			iscsi_free_task(task);
+			return 0;
 		}
 
-		list_add_tail(&task->c_list, &ent->c_list);
+		*slot = task;
+		session->nr_cmd_ring++;
 		set_task_pending(task);
 	}
 	return 0;
@@ -1649,7 +2104,10 @@ static int iscsi_scsi_cmd_rx_start(struct iscsi_connection *conn)
 			task->unsol_count, task->offset);
 	}
 
-	list_add(&task->c_hlist, &conn->session->cmd_list);
+	if (task_hash_add(&conn->session->itt_hash, task->tag, task))
+		return -ENOMEM;
+	set_task_hashed(task);
+
 	return 0;
 }
 
@@ -1774,6 +2232,8 @@ static int iscsi_scsi_cmd_tx_start(struct iscsi_task *task)
 {
 	int err = 0;
 
+	clear_task_r2t_queued(task);
+
 	if (task->r2t_count)
 		err = iscsi_r2t_build(task);
 	else if (task->offset < scsi_get_in_transfer_len(&task->scmd))
@@ -1792,10 +2252,11 @@ static int iscsi_logout_tx_start(struct iscsi_task *task)
 
 	rsp->opcode = ISCSI_OP_LOGOUT_RSP;
 	rsp->flags = ISCSI_FLAG_CMD_FINAL;
+	rsp->response = task->result;
 	rsp->itt = task->req.itt;
 	rsp->statsn = cpu_to_be32(conn->stat_sn++);
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn + MAX_QUEUE_CMD);
+	rsp->max_cmdsn = cpu_to_be32(iscsi_max_cmd_sn(conn->session));
 
 	return 0;
 }
@@ -1818,7 +2279,7 @@ static int iscsi_noop_out_tx_start(struct iscsi_task *task, int *is_rsp)
 		rsp->ttt = cpu_to_be32(ISCSI_RESERVED_TAG);
 		rsp->statsn = cpu_to_be32(conn->stat_sn++);
 		rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-		rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn + MAX_QUEUE_CMD);
+		rsp->max_cmdsn = cpu_to_be32(iscsi_max_cmd_sn(conn->session));
 
 		/* TODO: honor max_burst */
 		conn->rsp.datasize = task->len;
@@ -1842,24 +2303,32 @@ static int iscsi_tm_tx_start(struct iscsi_task *task)
 
 	rsp->statsn = cpu_to_be32(conn->stat_sn++);
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn + MAX_QUEUE_CMD);
+	rsp->max_cmdsn = cpu_to_be32(iscsi_max_cmd_sn(conn->session));
 
 	return 0;
 }
 
-static int iscsi_scsi_cmd_tx_done(struct iscsi_connection *conn)
+/* a Data-In PDU that is followed by more Data-In or a SCSI response */
+static int iscsi_data_in_more(struct iscsi_task *task)
 {
-	struct iscsi_hdr *hdr = &conn->rsp.bhs;
-	struct iscsi_task *task = conn->tx_task;
+	return task->offset < scsi_get_in_transfer_len(&task->scmd) ||
+		scsi_get_result(&task->scmd) != SAM_STAT_GOOD ||
+		scsi_get_data_dir(&task->scmd) == DATA_BIDIRECTIONAL;
+}
 
-	switch (hdr->opcode & ISCSI_OPCODE_MASK) {
+static int iscsi_scsi_cmd_tx_done(struct iscsi_task *task, uint8_t opcode)
+{
+	switch (opcode) {
 	case ISCSI_OP_R2T:
+		/* keep the R2Ts coming while the window allows */
+		if (task->r2t_count &&
+		    task->nr_r2t < iscsi_max_r2t(task->conn))
+			iscsi_r2t_queue(task, 1);
 		break;
 	case ISCSI_OP_SCSI_DATA_IN:
-		if (task->offset < scsi_get_in_transfer_len(&task->scmd) ||
-		    scsi_get_result(&task->scmd) != SAM_STAT_GOOD ||
-		    scsi_get_data_dir(&task->scmd) == DATA_BIDIRECTIONAL) {
-			dprintf("more data or sense or bidir %x\n", hdr->itt);
+		if (iscsi_data_in_more(task)) {
+			dprintf("more data or sense or bidir %" PRIx64 "\n",
+				task->tag);
 			list_add(&task->c_list, &task->conn->tx_clist);
 			return 0;
 		}
@@ -1867,30 +2336,29 @@ static int iscsi_scsi_cmd_tx_done(struct iscsi_connection *conn)
 		iscsi_free_cmd_task(task);
 		break;
 	default:
-		eprintf("target bug %x\n", hdr->opcode & ISCSI_OPCODE_MASK);
+		eprintf("target bug %x\n", opcode);
 	}
 
 	return 0;
 }
 
-static int iscsi_task_tx_done(struct iscsi_connection *conn)
+static int iscsi_task_tx_done(struct iscsi_connection *conn,
+			      struct iscsi_task *task, uint8_t opcode)
 {
-	struct iscsi_task *task = conn->tx_task;
 	int err;
 	uint8_t op;
 
 	op = task->req.opcode & ISCSI_OPCODE_MASK;
 	switch (op) {
 	case ISCSI_OP_SCSI_CMD:
-		err = iscsi_scsi_cmd_tx_done(conn);
+		err = iscsi_scsi_cmd_tx_done(task, opcode);
 		break;
-	case ISCSI_OP_NOOP_OUT:
 	case ISCSI_OP_LOGOUT:
+		iscsi_logout_tx_done(task);
+		break;
+	case ISCSI_OP_NOOP_OUT:
 	case ISCSI_OP_SCSI_TMFUNC:
 		iscsi_free_task(task);
-
-		if (op == ISCSI_OP_LOGOUT)
-			conn->state = STATE_CLOSE;
 	}
 
 	conn->tx_task = NULL;
@@ -1941,7 +2409,45 @@ nodata:
 	return -EAGAIN;
 }
 
-static int do_recv(struct iscsi_connection *conn, int next_state)
+static void iscsi_rx_digest_done(struct iscsi_digest_job *job)
+{
+	struct iscsi_connection *conn = job->conn;
+
+	/* the worker left the final digest, CHECK_DDIGEST wants the crc */
+	conn->rx_crc = ~conn->rx_crc;
+	conn->rx_dg_offload = 0;
+	conn->rx_iostate = IOSTATE_RX_CHECK_DDIGEST;
+	conn->rx_paused = 0;
+
+	if (conn->state != STATE_CLOSE)
+		conn->tp->ep_rx_resume(conn);
+}
+
+static int iscsi_rx_digest_offload(struct iscsi_connection *conn)
+{
+	struct iscsi_digest_job *job = &conn->rx_dg_job;
+
+	job->conn = conn;
+	job->done = iscsi_rx_digest_done;
+	job->nr = 1;
+	job->seg[0].data = conn->req.data;
+	job->seg[0].len = roundup(conn->req.datasize, conn->tp->data_padding);
+	job->seg[0].pad = 0;
+	job->seg[0].digest = &conn->rx_crc;
+
+	if (iscsi_digest_submit(job))
+		return -EIO;
+
+	conn->rx_iostate = IOSTATE_RX_WAIT_DDIGEST;
+	conn->rx_paused = 1;
+	return 0;
+}
+
+/*
+ * With digest set, the received bytes are added to conn->rx_crc while
+ * they are still in the cache.
+ */
+static int do_recv(struct iscsi_connection *conn, int next_state, int digest)
 {
 	int ret, opcode;
 
@@ -1956,6 +2462,9 @@ static int do_recv(struct iscsi_connection *conn, int next_state)
 			return -EIO;
 	}
 
+	if (digest)
+		conn->rx_crc = crc32c(conn->rx_crc, conn->rx_buffer, ret);
+
 	conn->rx_size -= ret;
 	conn->rx_buffer += ret;
 
@@ -1984,7 +2493,7 @@ void iscsi_rx_handler(struct iscsi_connection *conn)
 again:
 	switch (conn->rx_iostate) {
 	case IOSTATE_RX_BHS:
-		ret = do_recv(conn, IOSTATE_RX_INIT_AHS);
+		ret = do_recv(conn, IOSTATE_RX_INIT_AHS, hdigest);
 		if (ret <= 0 || conn->rx_iostate != IOSTATE_RX_INIT_AHS)
 			break;
 	case IOSTATE_RX_INIT_AHS:
@@ -2029,7 +2538,8 @@ again:
 			break;
 	case IOSTATE_RX_AHS:
 		ret = do_recv(conn, hdigest ?
-			      IOSTATE_RX_INIT_HDIGEST : IOSTATE_RX_INIT_DATA);
+			      IOSTATE_RX_INIT_HDIGEST : IOSTATE_RX_INIT_DATA,
+			      hdigest);
 		if (ret <= 0)
 			break;
 		if (conn->rx_iostate == IOSTATE_RX_INIT_DATA)
@@ -2041,15 +2551,11 @@ again:
 		conn->rx_size = sizeof(conn->rx_digest);
 		conn->rx_iostate = IOSTATE_RX_HDIGEST;
 	case IOSTATE_RX_HDIGEST:
-		ret = do_recv(conn, IOSTATE_RX_CHECK_HDIGEST);
+		ret = do_recv(conn, IOSTATE_RX_CHECK_HDIGEST, 0);
 		if (ret <= 0 || conn->rx_iostate != IOSTATE_RX_CHECK_HDIGEST)
 			break;
 	case IOSTATE_RX_CHECK_HDIGEST:
-		crc = ~0;
-		crc = crc32c(crc, &conn->req.bhs, BHS_SIZE);
-		if (conn->req.ahssize)
-			crc = crc32c(crc, conn->req.ahs, conn->req.ahssize);
-		crc = ~crc;
+		crc = ~conn->rx_crc;
 		if (*((uint32_t *)conn->rx_digest) != crc) {
 			eprintf("rx hdr digest error 0x%x calc 0x%x\n",
 				*((uint32_t *)conn->rx_digest), crc);
@@ -2059,6 +2565,9 @@ again:
 	case IOSTATE_RX_INIT_DATA:
 		conn->rx_size = roundup(conn->req.datasize,
 					conn->tp->data_padding);
+		conn->rx_crc = ~0;
+		conn->rx_dg_offload = ddigest && conn->tp->ep_rx_resume &&
+			iscsi_digest_offload(conn->rx_size);
 		if (conn->rx_size) {
 			conn->rx_iostate = IOSTATE_RX_DATA;
 			conn->rx_buffer = conn->req.data;
@@ -2076,7 +2585,8 @@ again:
 		}
 	case IOSTATE_RX_DATA:
 		ret = do_recv(conn, ddigest ?
-			      IOSTATE_RX_INIT_DDIGEST : IOSTATE_RX_END);
+			      IOSTATE_RX_INIT_DDIGEST : IOSTATE_RX_END,
+			      ddigest && !conn->rx_dg_offload);
 		if (ret <= 0 || conn->rx_iostate != IOSTATE_RX_INIT_DDIGEST)
 			break;
 	case IOSTATE_RX_INIT_DDIGEST:
@@ -2084,15 +2594,19 @@ again:
 		conn->rx_size = sizeof(conn->rx_digest);
 		conn->rx_iostate = IOSTATE_RX_DDIGEST;
 	case IOSTATE_RX_DDIGEST:
-		ret = do_recv(conn, IOSTATE_RX_CHECK_DDIGEST);
+		ret = do_recv(conn, IOSTATE_RX_CHECK_DDIGEST, 0);
 		if (ret <= 0 || conn->rx_iostate != IOSTATE_RX_CHECK_DDIGEST)
 			break;
 	case IOSTATE_RX_CHECK_DDIGEST:
-		crc = ~0;
-		crc = crc32c(crc, conn->req.data,
-			     roundup(conn->req.datasize,
-				     conn->tp->data_padding));
-		crc = ~crc;
+		if (conn->rx_dg_offload) {
+			/* paused until iscsi_rx_digest_done() */
+			if (!iscsi_rx_digest_offload(conn))
+				return;
+			conn->rx_dg_offload = 0;
+			iscsi_digest_run(&conn->rx_dg_job);
+			conn->rx_crc = ~conn->rx_crc;
+		}
+		crc = ~conn->rx_crc;
 		conn->rx_iostate = IOSTATE_RX_END;
 		if (*((uint32_t *)conn->rx_digest) != crc) {
 			eprintf("rx hdr digest error 0x%x calc 0x%x\n",
@@ -2100,6 +2614,8 @@ again:
 			conn->state = STATE_CLOSE;
 		}
 		break;
+	case IOSTATE_RX_WAIT_DDIGEST:
+		return;
 	default:
 		eprintf("error %d %d\n", conn->state, conn->rx_iostate);
 		exit(1);
@@ -2137,11 +2653,13 @@ static int do_send(struct iscsi_connection *conn, int next_state)
 again:
 	ret = conn->tp->ep_write_begin(conn, conn->tx_buffer, conn->tx_size);
 	if (ret < 0) {
-		if (errno != EINTR && errno != EAGAIN)
-			conn->state = STATE_CLOSE;
-		else if (errno == EINTR || errno == EAGAIN)
+		if (errno == EINTR)
 			goto again;
+		/* socket buffer is full, resume from here on EPOLLOUT */
+		if (errno == EAGAIN)
+			return -EAGAIN;
 
+		conn->state = STATE_CLOSE;
 		return -EIO;
 	}
 
@@ -2159,6 +2677,245 @@ again:
 	return 0;
 }
 
+static int iscsi_tx_finish(struct iscsi_connection *conn)
+{
+	int ret = 0;
+
+	cmnd_finish(conn);
+
+	switch (conn->state) {
+	case STATE_KERNEL:
+		ret = conn_take_fd(conn);
+		if (ret)
+			conn->state = STATE_CLOSE;
+		else {
+			conn->state = STATE_SCSI;
+			conn_read_pdu(conn);
+			conn->tp->ep_event_modify(conn, EPOLLIN);
+		}
+		break;
+	case STATE_EXIT:
+	case STATE_CLOSE:
+		break;
+	case STATE_SCSI:
+		iscsi_task_tx_done(conn, conn->tx_task,
+				   conn->rsp.bhs.opcode & ISCSI_OPCODE_MASK);
+		break;
+	default:
+		conn_read_pdu(conn);
+		conn->tp->ep_event_modify(conn, EPOLLIN);
+		break;
+	}
+
+	return ret;
+}
+
+static const uint8_t iscsi_tx_pad[PAD_WORD_LEN];
+
+static void iscsi_tx_iov_add(struct iscsi_connection *conn, void *base,
+			     size_t len)
+{
+	struct iovec *iov = &conn->tx_iov[conn->tx_iovcnt];
+
+	iov->iov_base = base;
+	iov->iov_len = len;
+	conn->tx_iov_zc[conn->tx_iovcnt++] = 0;
+}
+
+/*
+ * Append the PDU built in conn->rsp to the pending vectored send. The
+ * BHS and digests are copied into a tx_pdus slot; AHS and data are
+ * sent from where they are.
+ */
+static void iscsi_tx_gather(struct iscsi_connection *conn,
+			    struct iscsi_task *task, int hdigest, int ddigest)
+{
+	struct iscsi_tx_pdu *pdu = &conn->tx_pdus[conn->tx_nr_pdus++];
+	int size, pad;
+	uint32_t crc;
+
+	memcpy(&pdu->bhs, &conn->rsp.bhs, BHS_SIZE);
+	pdu->opcode = pdu->bhs.opcode & ISCSI_OPCODE_MASK;
+	pdu->task = task;
+
+	iscsi_tx_iov_add(conn, &pdu->bhs, BHS_SIZE);
+	size = BHS_SIZE;
+
+	if (conn->rsp.ahssize) {
+		iscsi_tx_iov_add(conn, conn->rsp.ahs, conn->rsp.ahssize);
+		size += conn->rsp.ahssize;
+	}
+
+	if (hdigest) {
+		crc = crc32c(~0, &pdu->bhs, BHS_SIZE);
+		if (conn->rsp.ahssize)
+			crc = crc32c(crc, conn->rsp.ahs, conn->rsp.ahssize);
+		pdu->hdigest = ~crc;
+		iscsi_tx_iov_add(conn, &pdu->hdigest, sizeof(pdu->hdigest));
+		size += sizeof(pdu->hdigest);
+	}
+
+	if (conn->rsp.datasize) {
+		iscsi_tx_iov_add(conn, conn->rsp.data, conn->rsp.datasize);
+		conn->tx_iov_zc[conn->tx_iovcnt - 1] = conn->rsp.data_zc;
+		conn->rsp.data_zc = 0;
+		size += conn->rsp.datasize;
+
+		pad = conn->rsp.datasize & (conn->tp->data_padding - 1);
+		if (pad) {
+			pad = PAD_WORD_LEN - pad;
+			iscsi_tx_iov_add(conn, (void *)iscsi_tx_pad, pad);
+			size += pad;
+		}
+
+		if (ddigest && iscsi_digest_offload(conn->rsp.datasize)) {
+			struct iscsi_digest_job *job = &conn->tx_dg_job;
+
+			job->seg[job->nr].data = conn->rsp.data;
+			job->seg[job->nr].len = conn->rsp.datasize;
+			job->seg[job->nr].pad = pad;
+			job->seg[job->nr].digest = &pdu->ddigest;
+			job->nr++;
+		} else if (ddigest) {
+			crc = crc32c(~0, conn->rsp.data, conn->rsp.datasize);
+			if (pad)
+				crc = crc32c(crc, iscsi_tx_pad, pad);
+			pdu->ddigest = ~crc;
+		}
+
+		if (ddigest) {
+			iscsi_tx_iov_add(conn, &pdu->ddigest,
+					 sizeof(pdu->ddigest));
+			size += sizeof(pdu->ddigest);
+		}
+	}
+
+	iscsi_update_conn_stats_tx(conn, size, pdu->opcode);
+}
+
+/* all the gathered PDUs are on the wire, complete their tasks */
+static int iscsi_tx_complete(struct iscsi_connection *conn)
+{
+	struct iscsi_tx_pdu *pdu;
+	int i, ret = 0;
+
+	/* a login phase response, sent on its own */
+	if (conn->state != STATE_SCSI && !conn->tx_pdus[0].task)
+		ret = iscsi_tx_finish(conn);
+
+	for (i = 0; i < conn->tx_nr_pdus; i++) {
+		pdu = &conn->tx_pdus[i];
+		if (pdu->task)
+			iscsi_task_tx_done(conn, pdu->task, pdu->opcode);
+	}
+
+	conn->tx_nr_pdus = 0;
+	conn->tx_iovcnt = 0;
+	conn->tx_iov_idx = 0;
+
+	return ret;
+}
+
+static void iscsi_tx_digest_done(struct iscsi_digest_job *job)
+{
+	struct iscsi_connection *conn = job->conn;
+
+	job->nr = 0;
+	if (conn->state != STATE_CLOSE)
+		conn->tp->ep_event_modify(conn, EPOLLIN | EPOLLOUT);
+}
+
+/*
+ * Transmit for transports with ep_writev: queued responses are built
+ * up to ISCSI_TX_MAX_PDUS at a time and sent with a single call.
+ */
+static int iscsi_tx_vec_handler(struct iscsi_connection *conn, int hdigest,
+				int ddigest)
+{
+	struct iscsi_task *task;
+	struct iovec *iov;
+	uint8_t opcode;
+	int ret, more;
+
+	/* the batch waits for its data digests */
+	if (conn->tx_dg_job.state != ISCSI_DIGEST_IDLE)
+		return -EAGAIN;
+
+	if (!conn->tx_iovcnt) {
+		if (conn->state != STATE_SCSI)
+			iscsi_tx_gather(conn, NULL, 0, 0);
+
+		while (conn->state == STATE_SCSI &&
+		       conn->tx_nr_pdus < ISCSI_TX_MAX_PDUS) {
+			if (iscsi_task_tx_start(conn))
+				break;
+
+			task = conn->tx_task;
+			opcode = conn->rsp.bhs.opcode & ISCSI_OPCODE_MASK;
+
+			/*
+			 * R2T and non-final Data-In leave the task alive,
+			 * so their bookkeeping can be done right away;
+			 * anything that frees the task waits for the send.
+			 */
+			if (opcode == ISCSI_OP_R2T ||
+			    (opcode == ISCSI_OP_SCSI_DATA_IN &&
+			     iscsi_data_in_more(task))) {
+				iscsi_task_tx_done(conn, task, opcode);
+				task = NULL;
+			}
+			conn->tx_task = NULL;
+
+			iscsi_tx_gather(conn, task, hdigest, ddigest);
+		}
+
+		if (!conn->tx_iovcnt)
+			return -EAGAIN;
+
+		if (conn->tx_dg_job.nr) {
+			conn->tx_dg_job.conn = conn;
+			conn->tx_dg_job.done = iscsi_tx_digest_done;
+			if (!iscsi_digest_submit(&conn->tx_dg_job))
+				return -EAGAIN;
+
+			iscsi_digest_run(&conn->tx_dg_job);
+			conn->tx_dg_job.nr = 0;
+		}
+	}
+
+	more = conn->state == STATE_SCSI && !list_empty(&conn->tx_clist);
+again:
+	ret = conn->tp->ep_writev(conn, conn->tx_iov + conn->tx_iov_idx,
+				  conn->tx_iov_zc + conn->tx_iov_idx,
+				  conn->tx_iovcnt - conn->tx_iov_idx, more);
+	if (ret < 0) {
+		if (errno == EINTR)
+			goto again;
+		/* socket buffer is full, resume from here on EPOLLOUT */
+		if (errno == EAGAIN)
+			return -EAGAIN;
+
+		conn->state = STATE_CLOSE;
+		return -EIO;
+	}
+
+	while (ret) {
+		iov = &conn->tx_iov[conn->tx_iov_idx];
+		if (ret < iov->iov_len) {
+			iov->iov_base += ret;
+			iov->iov_len -= ret;
+			break;
+		}
+		ret -= iov->iov_len;
+		conn->tx_iov_idx++;
+	}
+
+	if (conn->tx_iov_idx < conn->tx_iovcnt)
+		goto again;
+
+	return iscsi_tx_complete(conn);
+}
+
 int iscsi_tx_handler(struct iscsi_connection *conn)
 {
 	int ret = 0, hdigest, ddigest;
@@ -2171,6 +2928,9 @@ int iscsi_tx_handler(struct iscsi_connection *conn)
 	} else
 		hdigest = ddigest = 0;
 
+	if (conn->tp->ep_writev)
+		return iscsi_tx_vec_handler(conn, hdigest, ddigest);
+
 	if (conn->state == STATE_SCSI && !conn->tx_task) {
 		ret = iscsi_task_tx_start(conn);
 		if (ret)
@@ -2248,6 +3008,10 @@ again:
 				memset(conn->tx_buffer + conn->tx_size, 0, pad);
 				conn->tx_size += pad;
 			}
+			/* digest the data before it goes out, not after */
+			if (ddigest)
+				conn->tx_crc = crc32c(~0, conn->tx_buffer,
+						      conn->tx_size);
 		} else
 			conn->tx_iostate = IOSTATE_TX_END;
 		if (conn->tx_iostate != IOSTATE_TX_DATA)
@@ -2260,11 +3024,7 @@ again:
 		if (conn->tx_iostate != IOSTATE_TX_INIT_DDIGEST)
 			break;
 	case IOSTATE_TX_INIT_DDIGEST:
-		crc = ~0;
-		crc = crc32c(crc, conn->rsp.data,
-			     roundup(conn->rsp.datasize,
-				     conn->tp->data_padding));
-		*(uint32_t *)conn->tx_digest = ~crc;
+		*(uint32_t *)conn->tx_digest = ~conn->tx_crc;
 		conn->tx_iostate = IOSTATE_TX_DDIGEST;
 		conn->tx_buffer = conn->tx_digest;
 		conn->tx_size = sizeof(conn->tx_digest);
@@ -2294,30 +3054,7 @@ again:
 	conn->tp->ep_write_end(conn);
 
 finish:
-	cmnd_finish(conn);
-
-	switch (conn->state) {
-	case STATE_KERNEL:
-		ret = conn_take_fd(conn);
-		if (ret)
-			conn->state = STATE_CLOSE;
-		else {
-			conn->state = STATE_SCSI;
-			conn_read_pdu(conn);
-			conn->tp->ep_event_modify(conn, EPOLLIN);
-		}
-		break;
-	case STATE_EXIT:
-	case STATE_CLOSE:
-		break;
-	case STATE_SCSI:
-		iscsi_task_tx_done(conn);
-		break;
-	default:
-		conn_read_pdu(conn);
-		conn->tp->ep_event_modify(conn, EPOLLIN);
-		break;
-	}
+	ret = iscsi_tx_finish(conn);
 
 out:
 	return ret;
@@ -2329,9 +3066,13 @@ int iscsi_transportid(int tid, uint64_t itn_id, char *buf, int size)
 	char *p;
 	uint16_t len;
 
+	/* called for any I_T nexus, the session may be on another reactor */
+	session_table_lock();
 	session = session_lookup_by_tsih(itn_id);
-	if (!session)
+	if (!session) {
+		session_table_unlock();
 		return 0;
+	}
 
 	len = 4;
 	len += strlen(session->initiator) + 1;
@@ -2340,8 +3081,10 @@ int iscsi_transportid(int tid, uint64_t itn_id, char *buf, int size)
 
 	len = ALIGN(len, 4);
 
-	if (len > size)
+	if (len > size) {
+		session_table_unlock();
 		return len;
+	}
 
 	memset(buf, 0, size);
 
@@ -2357,6 +3100,7 @@ int iscsi_transportid(int tid, uint64_t itn_id, char *buf, int size)
 	p += sprintf(p, ",i,0x");
 
 	memcpy(p, session->isid, sizeof(session->isid));
+	session_table_unlock();
 
 	return len;
 }
@@ -2414,6 +3158,40 @@ int iscsi_param_parse_portals(char *p, int do_add,
 					return -1;
 				}
 			}
+		} else if (!strncmp(p, "rx_budget=", 10)) {
+			int budget = atoi(p + 10);
+
+			if (budget < 0 || budget > 1024) {
+				eprintf("invalid rx_budget (%s)\n", p);
+				return -1;
+			}
+			iscsi_tcp_set_rx_budget(budget);
+		} else if (!strncmp(p, "zerocopy=", 9)) {
+			int threshold = atoi(p + 9);
+
+			if (threshold && threshold < 4096) {
+				eprintf("invalid zerocopy (%s)\n", p);
+				return -1;
+			}
+			iscsi_tcp_set_zerocopy(threshold);
+		} else if (!strncmp(p, "digest_offload=", 15)) {
+			int threshold = atoi(p + 15);
+
+			if (threshold < 0) {
+				eprintf("invalid digest_offload (%s)\n", p);
+				return -1;
+			}
+			iscsi_digest_set_threshold(threshold);
+		} else if (!strncmp(p, "buf_pool=", 9)) {
+			long mb = atol(p + 9);
+
+			if (mb < 0) {
+				eprintf("invalid buf_pool (%s)\n", p);
+				return -1;
+			}
+			iscsi_buf_pool_set_max((unsigned long)mb << 20);
+		} else if (!strncmp(p, "buf_pool_hugepages=", 19)) {
+			iscsi_buf_pool_set_hugepages(atoi(p + 19));
 		}
 
 		p += strcspn(p, ",");
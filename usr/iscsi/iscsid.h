@@ -22,6 +22,7 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <netdb.h>
+#include <sys/uio.h>
 
 #include "transport.h"
 #include "list.h"
@@ -62,6 +63,25 @@ struct iscsi_pdu {
 	unsigned int ahssize;
 	void *data;
 	unsigned int datasize;
+	/* data is a task's SCSI in-buffer, freed only after the send */
+	int data_zc;
+};
+
+/* how far MaxCmdSN runs ahead of ExpCmdSN */
+#define ISCSI_CMD_WINDOW_DEF	128
+#define ISCSI_CMD_WINDOW_MIN	16
+#define ISCSI_CMD_WINDOW_MAX	2048
+
+struct iscsi_task_hash_ent {
+	uint32_t key;
+	struct iscsi_task *task;
+};
+
+/* open addressing with linear probing, a free slot has no task */
+struct iscsi_task_hash {
+	struct iscsi_task_hash_ent *ent;
+	unsigned int size;
+	unsigned int nr;
 };
 
 struct iscsi_session {
@@ -72,24 +92,53 @@ struct iscsi_session {
 
 	/* linked to sessions_list */
 	struct list_head hlist;
+	/* sessions_list indexed by TSIH and by initiator name and ISID */
+	struct hlist_node tsih_hnode;
+	struct hlist_node name_hnode;
 
 	char *initiator;
 	char *initiator_alias;
 	struct iscsi_target *target;
 	uint8_t isid[6];
 	uint16_t tsih;
+	/* handed to the core with each command */
+	struct it_nexus *it_nexus;
 
 	/* links all connections (conn->clist) */
 	struct list_head conn_list;
+	/* connections in full feature phase */
 	int conn_cnt;
 
-	/* links all tasks (task->c_hlist) */
+	/* links all tasks (iser) */
 	struct list_head cmd_list;
 
-	/* links pending tasks (task->c_list) */
+	/* SCSI command tasks by ITT, and by TTT of their R2Ts */
+	struct iscsi_task_hash itt_hash;
+	struct iscsi_task_hash ttt_hash;
+	uint32_t next_ttt;
+
+	/* links pending tasks (iser) */
 	struct list_head pending_cmd_list;
 
+	/* commands waiting for ExpCmdSN to reach them, at CmdSN % size */
+	struct iscsi_task **cmd_ring;
+	unsigned int cmd_ring_size;
+	unsigned int nr_cmd_ring;
+
 	uint32_t exp_cmd_sn;
+	/* the highest MaxCmdSN sent */
+	uint32_t max_cmd_sn;
+
+	/* see iscsi_cmd_window_update() */
+	int cmd_window;
+	int cmd_window_adaptive;
+	/* non-immediate commands not freed yet */
+	int nr_cmds;
+	int nr_done;
+	/* backend latency in usecs, lowest seen and lowest this round */
+	uint32_t lat_min;
+	uint32_t lat_cur;
+	uint64_t lat_min_time;
 
 	struct param session_param[ISCSI_PARAM_MAX];
 
@@ -97,6 +146,22 @@ struct iscsi_session {
 
 	/* if this session uses rdma connections */
 	int rdma;
+
+	/*
+	 * The reactor serving the connections in full feature phase,
+	 * NULL until the first one gets there.
+	 */
+	struct tgt_reactor *reactor;
+};
+
+/* R2Ts a task may have outstanding, whatever MaxOutstandingR2T says */
+#define ISCSI_MAX_R2T		16
+
+/* an R2T whose Data-Out PDUs haven't all arrived, free if length is 0 */
+struct iscsi_r2t {
+	uint32_t ttt;
+	uint32_t offset;
+	uint32_t length;
 };
 
 struct iscsi_task {
@@ -106,9 +171,6 @@ struct iscsi_task {
 	uint64_t tag;
 	struct iscsi_connection *conn;
 
-	/* linked to session->cmd_list */
-	struct list_head c_hlist;
-
 	/* linked to conn->tx_clist or session->cmd_pending_list */
 	struct list_head c_list;
 
@@ -126,6 +188,13 @@ struct iscsi_task {
 	int unsol_count;
 	int exp_r2tsn;
 
+	/* when it was handed to the backend, in usecs */
+	uint64_t start_time;
+
+	int nr_r2t;
+	/* iscsi_max_r2t() of them, allocated with the first R2T */
+	struct iscsi_r2t *r2t;
+
 	void *ahs;
 	void *data;
 
@@ -134,11 +203,53 @@ struct iscsi_task {
 	unsigned long extdata[0];
 };
 
+/* PDUs gathered into a single vectored send */
+#define ISCSI_TX_MAX_PDUS	16
+/* BHS, AHS, header digest, data, padding and data digest */
+#define ISCSI_TX_PDU_IOVS	6
+
+struct iscsi_tx_pdu {
+	struct iscsi_hdr bhs;
+	uint32_t hdigest;
+	uint32_t ddigest;
+	uint8_t opcode;
+	/* completed once the PDU is on the wire, NULL if still in flight */
+	struct iscsi_task *task;
+};
+
+enum {
+	ISCSI_DIGEST_IDLE,
+	ISCSI_DIGEST_PENDING,
+	ISCSI_DIGEST_RUNNING,
+	ISCSI_DIGEST_DONE,
+};
+
+struct iscsi_digest_seg {
+	void *data;
+	size_t len;
+	int pad;
+	uint32_t *digest;
+};
+
+/* data digests handed to the digest worker threads */
+struct iscsi_digest_job {
+	struct list_head list;
+	int state;
+	struct iscsi_connection *conn;
+	struct iscsi_digest_queue *queue;
+	void (*done)(struct iscsi_digest_job *job);
+
+	int nr;
+	struct iscsi_digest_seg seg[ISCSI_TX_MAX_PDUS];
+};
+
 struct iscsi_connection {
 	int state;
 
 	/* should be a new state */
 	int closed;
+	/* counted in session->conn_cnt */
+	int full_feature;
 
 	int rx_iostate;
 	int tx_iostate;
@@ -188,6 +299,24 @@ struct iscsi_connection {
 
 	unsigned char rx_digest[4];
 	unsigned char tx_digest[4];
+	/* running digests, updated as the PDU goes through */
+	uint32_t rx_crc;
+	uint32_t tx_crc;
+
+	/* large data digests go to the digest threads */
+	int rx_dg_offload;
+	int rx_paused;
+	struct iscsi_digest_job rx_dg_job;
+	struct iscsi_digest_job tx_dg_job;
+
+	/* for transports with ep_writev */
+	struct iscsi_tx_pdu tx_pdus[ISCSI_TX_MAX_PDUS];
+	int tx_nr_pdus;
+	struct iovec tx_iov[ISCSI_TX_MAX_PDUS * ISCSI_TX_PDU_IOVS];
+	/* which of tx_iov may be sent with MSG_ZEROCOPY */
+	unsigned char tx_iov_zc[ISCSI_TX_MAX_PDUS * ISCSI_TX_PDU_IOVS];
+	int tx_iovcnt;
+	int tx_iov_idx;
 
 	int auth_state;
 	union {
@@ -202,6 +331,9 @@ struct iscsi_connection {
 	struct iscsi_transport *tp;
 
 	struct iscsi_stats stats;
+	/* task allocations the transport served from its cache or not */
+	uint64_t task_cache_hits;
+	uint64_t task_cache_misses;
 };
 
 #define STATE_FREE		0
@@ -241,6 +373,8 @@ struct iscsi_connection {
 
 struct iscsi_target {
 	struct list_head tlist;
+	struct hlist_node tid_hnode;
+	struct hlist_node name_hnode;
 
 	struct list_head sessions_list;
 
@@ -252,6 +386,9 @@ struct iscsi_target {
 	int max_nr_sessions;
 	int nr_sessions;
 
+	/* command window of new sessions, 0 to adapt it to the backend */
+	int cmd_window;
+
 	struct redirect_info {
 		char addr[NI_MAXHOST + 1];
 		char port[NI_MAXSERV + 1];
@@ -267,6 +404,9 @@ struct iscsi_target {
 enum task_flags {
 	TASK_pending,
 	TASK_in_scsi,
+	TASK_r2t_queued,
+	TASK_hashed,
+	TASK_in_window,
 };
 
 struct iscsi_portal {
@@ -289,6 +429,17 @@ extern char *portal_arguments;
 #define clear_task_in_scsi(t)	((t)->flags &= ~(1 << TASK_in_scsi))
 #define task_in_scsi(t)		((t)->flags & (1 << TASK_in_scsi))
 
+#define set_task_r2t_queued(t)	((t)->flags |= (1 << TASK_r2t_queued))
+#define clear_task_r2t_queued(t) ((t)->flags &= ~(1 << TASK_r2t_queued))
+#define task_r2t_queued(t)	((t)->flags & (1 << TASK_r2t_queued))
+
+#define set_task_hashed(t)	((t)->flags |= (1 << TASK_hashed))
+#define clear_task_hashed(t)	((t)->flags &= ~(1 << TASK_hashed))
+#define task_hashed(t)		((t)->flags & (1 << TASK_hashed))
+
+#define set_task_in_window(t)	((t)->flags |= (1 << TASK_in_window))
+#define task_in_window(t)	((t)->flags & (1 << TASK_in_window))
+
 extern int lld_index;
 extern struct list_head iscsi_targets_list;
 
@@ -303,6 +454,7 @@ extern void conn_put(struct iscsi_connection *conn);
 extern int conn_get(struct iscsi_connection *conn);
 extern struct iscsi_connection * conn_find(struct iscsi_session *session, uint32_t cid);
 extern int conn_take_fd(struct iscsi_connection *conn);
+extern int conn_count(struct iscsi_session *session);
 extern void conn_add_to_session(struct iscsi_connection *conn, struct iscsi_session *session);
 extern tgtadm_err conn_close_admin(uint32_t tid, uint64_t sid, uint32_t cid);
 
@@ -317,20 +469,45 @@ extern int iscsi_transportid(int tid, uint64_t itn_id, char *buf, int size);
 extern int iscsi_add_portal(char *addr, int port, int tpgt);
 extern int iscsi_delete_portal(char *addr, int port);
 extern int iscsi_param_parse_portals(char *p, int do_add, int do_delete);
+extern void iscsi_tcp_set_rx_budget(int budget);
+extern void iscsi_tcp_set_zerocopy(int threshold);
+
+/* digest.c */
+extern void iscsi_digest_set_threshold(int threshold);
+extern int iscsi_digest_offload(size_t len);
+extern int iscsi_digest_submit(struct iscsi_digest_job *job);
+extern void iscsi_digest_run(struct iscsi_digest_job *job);
+extern void iscsi_digest_cancel(struct iscsi_digest_job *job);
+
+/* bufpool.c */
+extern void iscsi_buf_pool_set_max(unsigned long bytes);
+extern void iscsi_buf_pool_set_hugepages(int on);
+extern void *iscsi_buf_alloc(size_t sz);
+extern void iscsi_buf_free(void *addr);
+extern void iscsi_buf_pool_show(struct concat_buf *b);
 extern void iscsi_update_conn_stats_rx(struct iscsi_connection *conn, int size, int opcode);
 extern void iscsi_update_conn_stats_tx(struct iscsi_connection *conn, int size, int opcode);
 extern void iscsi_rsp_set_residual(struct iscsi_cmd_rsp *rsp, struct scsi_cmd *scmd);
 
 /* iscsid.c iscsi_task */
 extern void iscsi_free_task(struct iscsi_task *task);
+extern void iscsi_cmd_ring_skip(struct iscsi_session *session);
 extern void iscsi_free_cmd_task(struct iscsi_task *task);
 
 /* session.c */
 extern struct iscsi_session *session_find_name(int tid, const char *iname, uint8_t *isid);
 extern struct iscsi_session *session_lookup_by_tsih(uint16_t tsih);
+extern void session_table_lock(void);
+extern void session_table_unlock(void);
 extern int session_create(struct iscsi_connection *conn);
 extern void session_get(struct iscsi_session *session);
 extern void session_put(struct iscsi_session *session);
+extern int task_hash_add(struct iscsi_task_hash *h, uint32_t key,
+			 struct iscsi_task *task);
+extern void task_hash_del(struct iscsi_task_hash *h, uint32_t key,
+			  struct iscsi_task *task);
+extern struct iscsi_task *task_hash_find(struct iscsi_task_hash *h,
+					 uint32_t key);
 
 /* target.c */
 extern struct iscsi_target * target_find_by_name(const char *name);
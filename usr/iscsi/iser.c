@@ -845,6 +845,7 @@ static void iser_complete_task(struct iser_task *task)
 	/* we are completing scsi cmd task, returning from target */
 	if (likely(task_in_scsi(task))) {
 		target_cmd_done(&task->scmd);
+		sense_buffer_free(&task->scmd);
 		clear_task_in_scsi(task);
 		iser_conn_put(conn);
 	}
@@ -2031,6 +2032,7 @@ static void iser_scsi_cmd_iosubmit(struct iser_task *task, int not_last)
 	}
 
 	scmd->cmd_itn_id = session->tsih;
+	scmd->it_nexus = session->it_nexus;
 	scmd->scb = req_bhs->cdb;
 	scmd->scb_len = sizeof(req_bhs->cdb);
 	memcpy(scmd->lun, req_bhs->lun, sizeof(scmd->lun));
@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <sys/stat.h>
 #include <errno.h>
@@ -30,21 +31,58 @@
 #include "tgtd.h"
 #include "util.h"
 
+#define SESSION_HASH_SIZE	1024
+
 static LIST_HEAD(sessions_list);
 
+static struct hlist_head session_tsih_hash[SESSION_HASH_SIZE];
+static struct hlist_head session_name_hash[SESSION_HASH_SIZE];
+
+/*
+ * Sessions are created by the main reactor and destroyed by the one
+ * serving them. This protects sessions_list, the hashes and the
+ * per-target lists; looking up a session from another reactor is only
+ * safe with it held, or with the other reactors stopped.
+ */
+static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void session_table_lock(void)
+{
+	pthread_mutex_lock(&session_mutex);
+}
+
+void session_table_unlock(void)
+{
+	pthread_mutex_unlock(&session_mutex);
+}
+
+static struct hlist_head *session_tsih_head(uint16_t tsih)
+{
+	return &session_tsih_hash[tsih & (SESSION_HASH_SIZE - 1)];
+}
+
+static struct hlist_head *session_name_head(int tid, const char *iname,
+					    uint8_t *isid)
+{
+	uint32_t hash;
+
+	hash = hash_mem(HASH_INIT, &tid, sizeof(tid));
+	hash = hash_mem(hash, isid, 6);
+	hash = hash_str(hash, iname);
+
+	return &session_name_hash[hash & (SESSION_HASH_SIZE - 1)];
+}
+
 struct iscsi_session *session_find_name(int tid, const char *iname, uint8_t *isid)
 {
 	struct iscsi_session *session;
-	struct iscsi_target *target;
-
-	target = target_find_by_id(tid);
-	if (!target)
-		return NULL;
 
 	dprintf("session_find_name: %s %x %x %x %x %x %x\n", iname,
 		  isid[0], isid[1], isid[2], isid[3], isid[4], isid[5]);
-	list_for_each_entry(session, &target->sessions_list, slist) {
-		if (!memcmp(isid, session->isid, sizeof(session->isid)) &&
+	hlist_for_each_entry(session, session_name_head(tid, iname, isid),
+			     name_hnode) {
+		if (session->target->tid == tid &&
+		    !memcmp(isid, session->isid, sizeof(session->isid)) &&
 		    !strcmp(iname, session->initiator))
 			return session;
 	}
@@ -55,7 +93,7 @@ struct iscsi_session *session_find_name(int tid, const char *iname, uint8_t *isi
 struct iscsi_session *session_lookup_by_tsih(uint16_t tsih)
 {
 	struct iscsi_session *session;
-	list_for_each_entry(session, &sessions_list, hlist) {
+	hlist_for_each_entry(session, session_tsih_head(tsih), tsih_hnode) {
 		if (session->tsih == tsih)
 			return session;
 	}
@@ -75,6 +113,7 @@ int session_create(struct iscsi_connection *conn)
 	if (!target)
 		return -EINVAL;
 
+	session_table_lock();
 	for (tsih = last_tsih + 1; tsih != last_tsih; tsih++) {
 		if (!tsih)
 			continue;
@@ -82,6 +121,7 @@ int session_create(struct iscsi_connection *conn)
 		if (!session)
 			break;
 	}
+	session_table_unlock();
 	if (session)
 		return -EINVAL;
 
@@ -128,10 +168,10 @@ int session_create(struct iscsi_connection *conn)
 		free(session);
 		return err;
 	}
+	session->it_nexus = it_nexus_lookup(target->tid, tsih);
 
 	session->target = target;
 	INIT_LIST_HEAD(&session->slist);
-	list_add(&session->slist, &target->sessions_list);
 
 	INIT_LIST_HEAD(&session->conn_list);
 	INIT_LIST_HEAD(&session->cmd_list);
@@ -146,8 +186,25 @@ int session_create(struct iscsi_connection *conn)
 
 	dprintf("session_create: %#" PRIx64 "\n", sid64(conn->isid, session->tsih));
 
+	session_table_lock();
+	list_add(&session->slist, &target->sessions_list);
 	list_add(&session->hlist, &sessions_list);
+	hlist_add_head(&session->tsih_hnode, session_tsih_head(session->tsih));
+	hlist_add_head(&session->name_hnode,
+		       session_name_head(target->tid, session->initiator,
+					 session->isid));
+	session_table_unlock();
+
 	session->exp_cmd_sn = conn->exp_cmd_sn;
+	/* what the login response allowed */
+	session->max_cmd_sn = conn->max_cmd_sn;
+
+	if (target->cmd_window)
+		session->cmd_window = target->cmd_window;
+	else {
+		session->cmd_window = ISCSI_CMD_WINDOW_DEF;
+		session->cmd_window_adaptive = 1;
+	}
 
 	memcpy(session->session_param, conn->session_param,
 	       sizeof(session->session_param));
@@ -162,14 +219,22 @@ static void session_destroy(struct iscsi_session *session)
 		return;
 	}
 
-	if (session->target) {
-		list_del(&session->slist);
-/* 		session->target->nr_sessions--; */
+	/* takes the LU locks, under which the session table is read */
+	if (session->target)
 		it_nexus_destroy(session->target->tid, session->tsih);
-	}
 
+	session_table_lock();
+	if (session->target)
+		list_del(&session->slist);
+/* 		session->target->nr_sessions--; */
 	list_del(&session->hlist);
+	hlist_del(&session->tsih_hnode);
+	hlist_del(&session->name_hnode);
+	session_table_unlock();
 
+	free(session->cmd_ring);
+	free(session->itt_hash.ent);
+	free(session->ttt_hash.ent);
 	free(session->initiator);
 	free(session->info);
 	free(session);
@@ -185,3 +250,110 @@ void session_put(struct iscsi_session *session)
 	if (!--session->refcount)
 		session_destroy(session);
 }
+
+#define TASK_HASH_INIT_SIZE	64
+
+static unsigned int task_hash_slot(struct iscsi_task_hash *h, uint32_t key)
+{
+	/* tags are often sequential, spread them over the table */
+	return (key * 0x9e3779b1U) & (h->size - 1);
+}
+
+static int task_hash_grow(struct iscsi_task_hash *h)
+{
+	struct iscsi_task_hash_ent *old = h->ent;
+	unsigned int i, j, size = h->size;
+
+	h->size = size ? size * 2 : TASK_HASH_INIT_SIZE;
+	h->ent = calloc(h->size, sizeof(*h->ent));
+	if (!h->ent) {
+		h->ent = old;
+		h->size = size;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < size; i++) {
+		if (!old[i].task)
+			continue;
+		j = task_hash_slot(h, old[i].key);
+		while (h->ent[j].task)
+			j = (j + 1) & (h->size - 1);
+		h->ent[j] = old[i];
+	}
+	free(old);
+
+	return 0;
+}
+
+int task_hash_add(struct iscsi_task_hash *h, uint32_t key,
+		  struct iscsi_task *task)
+{
+	unsigned int i;
+
+	/* keep the load at most a half so that probes stay short */
+	if ((h->nr + 1) * 2 > h->size && task_hash_grow(h))
+		return -ENOMEM;
+
+	i = task_hash_slot(h, key);
+	while (h->ent[i].task)
+		i = (i + 1) & (h->size - 1);
+
+	h->ent[i].key = key;
+	h->ent[i].task = task;
+	h->nr++;
+
+	return 0;
+}
+
+struct iscsi_task *task_hash_find(struct iscsi_task_hash *h, uint32_t key)
+{
+	unsigned int i;
+
+	if (!h->nr)
+		return NULL;
+
+	for (i = task_hash_slot(h, key); h->ent[i].task;
+	     i = (i + 1) & (h->size - 1)) {
+		if (h->ent[i].key == key)
+			return h->ent[i].task;
+	}
+
+	return NULL;
+}
+
+void task_hash_del(struct iscsi_task_hash *h, uint32_t key,
+		   struct iscsi_task *task)
+{
+	unsigned int i, j, k, mask = h->size - 1;
+
+	if (!h->nr)
+		return;
+
+	for (i = task_hash_slot(h, key); h->ent[i].task; i = (i + 1) & mask) {
+		if (h->ent[i].key == key && h->ent[i].task == task)
+			break;
+	}
+	if (!h->ent[i].task)
+		return;
+
+	h->nr--;
+
+	/*
+	 * No tombstones: move back the entries after the hole that
+	 * can't be found past it anymore.
+	 */
+	for (;;) {
+		h->ent[i].task = NULL;
+		j = i;
+		for (;;) {
+			j = (j + 1) & mask;
+			if (!h->ent[j].task)
+				return;
+			k = task_hash_slot(h, h->ent[j].key);
+			if (((j - k) & mask) >= ((j - i) & mask))
+				break;
+		}
+		h->ent[i] = h->ent[j];
+		i = j;
+	}
+}
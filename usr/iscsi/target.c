@@ -38,8 +38,25 @@
 #include "target.h"
 #include "util.h"
 
+#define ISCSI_TARGET_HASH_SIZE	1024
+
 LIST_HEAD(iscsi_targets_list);
 
+/* iscsi_targets_list indexed by tid and by name */
+static struct hlist_head iscsi_target_tid_hash[ISCSI_TARGET_HASH_SIZE];
+static struct hlist_head iscsi_target_name_hash[ISCSI_TARGET_HASH_SIZE];
+
+static struct hlist_head *iscsi_target_tid_head(int tid)
+{
+	return &iscsi_target_tid_hash[tid & (ISCSI_TARGET_HASH_SIZE - 1)];
+}
+
+static struct hlist_head *iscsi_target_name_head(const char *name)
+{
+	return &iscsi_target_name_hash[hash_str(HASH_INIT, name) &
+				       (ISCSI_TARGET_HASH_SIZE - 1)];
+}
+
 static int netmask_match_v6(struct sockaddr *sa1, struct sockaddr *sa2, uint32_t mbit)
 {
 	uint16_t mask, a1[8], a2[8];
@@ -344,33 +361,42 @@ predefined:
 	return !ret;
 }
 
-void target_list_build(struct iscsi_connection *conn, char *addr, char *name)
+static void target_list_add(struct iscsi_connection *conn, char *addr,
+			    struct iscsi_target *target)
 {
-	struct iscsi_target *target;
+	if (ip_acl(target->tid, conn))
+		return;
 
-	list_for_each_entry(target, &iscsi_targets_list, tlist) {
-		if (name && strcmp(tgt_targetname(target->tid), name))
-			continue;
+	if (iqn_acl(target->tid, conn))
+		return;
 
-		if (ip_acl(target->tid, conn))
-			continue;
+	if (isns_scn_access(target->tid, conn->initiator))
+		return;
 
-		if (iqn_acl(target->tid, conn))
-			continue;
+	text_key_add(conn, "TargetName", tgt_targetname(target->tid));
+	text_key_add(conn, "TargetAddress", addr);
+}
 
-		if (isns_scn_access(target->tid, conn->initiator))
-			continue;
+void target_list_build(struct iscsi_connection *conn, char *addr, char *name)
+{
+	struct iscsi_target *target;
 
-		text_key_add(conn, "TargetName", tgt_targetname(target->tid));
-		text_key_add(conn, "TargetAddress", addr);
+	if (name) {
+		target = target_find_by_name(name);
+		if (target)
+			target_list_add(conn, addr, target);
+		return;
 	}
+
+	list_for_each_entry(target, &iscsi_targets_list, tlist)
+		target_list_add(conn, addr, target);
 }
 
 struct iscsi_target *target_find_by_name(const char *name)
 {
 	struct iscsi_target *target;
 
-	list_for_each_entry(target, &iscsi_targets_list, tlist) {
+	hlist_for_each_entry(target, iscsi_target_name_head(name), name_hnode) {
 		if (!strcmp(tgt_targetname(target->tid), name))
 			return target;
 	}
@@ -382,7 +408,7 @@ struct iscsi_target* target_find_by_id(int tid)
 {
 	struct iscsi_target *target;
 
-	list_for_each_entry(target, &iscsi_targets_list, tlist) {
+	hlist_for_each_entry(target, iscsi_target_tid_head(tid), tid_hnode) {
 		if (target->tid == tid)
 			return target;
 	}
@@ -419,6 +445,8 @@ void iscsi_target_destroy(int tid, int force)
 	}
 
 	list_del(&target->tlist);
+	hlist_del(&target->tid_hnode);
+	hlist_del(&target->name_hnode);
 	if (target->redirect_info.callback)
 		free(target->redirect_info.callback);
 	free(target);
@@ -433,11 +461,13 @@ int iscsi_target_create(struct target *t)
 	struct iscsi_target *target;
 	struct param default_tgt_session_param[] = {
 		[ISCSI_PARAM_MAX_RECV_DLENGTH] = {0, 8192},
-		[ISCSI_PARAM_MAX_XMIT_DLENGTH] = {0, 8192},  /* do not edit */
+		/* cap on the initiator's MaxRecvDataSegmentLength */
+		[ISCSI_PARAM_MAX_XMIT_DLENGTH] = {0, 262144},
 		[ISCSI_PARAM_HDRDGST_EN] = {0, DIGEST_NONE},
 		[ISCSI_PARAM_DATADGST_EN] = {0, DIGEST_NONE},
 		[ISCSI_PARAM_INITIAL_R2T_EN] = {0, 1},
-		[ISCSI_PARAM_MAX_R2T] = {0, 1},
+		/* R2Ts beyond ISCSI_MAX_R2T per task are never issued */
+		[ISCSI_PARAM_MAX_R2T] = {0, 8},
 		[ISCSI_PARAM_IMM_DATA_EN] = {0, 1},
 		[ISCSI_PARAM_FIRST_BURST] = {0, 65536},
 		[ISCSI_PARAM_MAX_BURST] = {0, 262144},
@@ -450,7 +480,7 @@ int iscsi_target_create(struct target *t)
 		[ISCSI_PARAM_DEFAULTTIME2RETAIN] = {0, 20},
 		[ISCSI_PARAM_OFMARKINT] = {0, 2048},
 		[ISCSI_PARAM_IFMARKINT] = {0, 2048},
-		[ISCSI_PARAM_MAXCONNECTIONS] = {0, 1},
+		[ISCSI_PARAM_MAXCONNECTIONS] = {0, 8},
 		[ISCSI_PARAM_RDMA_EXTENSIONS] = {0, 1},
 		[ISCSI_PARAM_TARGET_RDSL] = {0, 262144},
 		[ISCSI_PARAM_INITIATOR_RDSL] = {0, 262144},
@@ -471,6 +501,8 @@ int iscsi_target_create(struct target *t)
 	INIT_LIST_HEAD(&target->isns_list);
 	target->tid = tid;
 	list_add_tail(&target->tlist, &iscsi_targets_list);
+	hlist_add_head(&target->tid_hnode, iscsi_target_tid_head(tid));
+	hlist_add_head(&target->name_hnode, iscsi_target_name_head(t->name));
 
 	isns_target_register(tgt_targetname(tid));
 	return 0;
@@ -496,6 +528,32 @@ static int iscsi_session_param_update(struct iscsi_target* target, int idx, char
 	return 0;
 }
 
+/* "adaptive", or a fixed number of commands */
+static int iscsi_target_cmd_window_update(struct iscsi_target *target,
+					  char *str)
+{
+	struct iscsi_session *session;
+	char *end;
+	long window = 0;
+
+	if (strcmp(str, "adaptive")) {
+		window = strtol(str, &end, 0);
+		if (*end || window < ISCSI_CMD_WINDOW_MIN ||
+		    window > ISCSI_CMD_WINDOW_MAX)
+			return -EINVAL;
+	}
+
+	target->cmd_window = window;
+
+	list_for_each_entry(session, &target->sessions_list, slist) {
+		session->cmd_window_adaptive = !window;
+		if (window)
+			session->cmd_window = window;
+	}
+
+	return 0;
+}
+
 tgtadm_err iscsi_target_update(int mode, int op, int tid, uint64_t sid, uint64_t lun,
 			       uint32_t cid, char *name)
 {
@@ -545,6 +603,10 @@ tgtadm_err iscsi_target_update(int mode, int op, int tid, uint64_t sid, uint64_t
 				break;
 			}
 			adm_err = TGTADM_SUCCESS;
+		} else if (!strcmp(name, "CmdWindow")) {
+			err = iscsi_target_cmd_window_update(target, str);
+			adm_err = !err ? TGTADM_SUCCESS : TGTADM_INVALID_REQUEST;
+			break;
 		}
 
 		idx = param_index_by_name(name, session_keys);
@@ -622,11 +684,15 @@ static tgtadm_err iscsi_target_show_connections(struct iscsi_target *target,
 			concat_printf(b, "Session: %u\n"
 				_TAB1 "Connection: %u\n"
 				_TAB2 "Initiator: %s\n"
-				_TAB2 "%s\n",
+				_TAB2 "%s\n"
+				_TAB2 "CmdWindow: %d (%s)\n",
 				session->tsih,
 				conn->cid,
 				session->initiator,
-				addr);
+				addr,
+				session->cmd_window,
+				session->cmd_window_adaptive ?
+				"adaptive" : "static");
 		}
 	}
 	return adm_err;
@@ -692,14 +758,21 @@ tgtadm_err iscsi_target_show(int mode, int tid, uint64_t sid, uint32_t cid, uint
 	switch (mode) {
 	case MODE_SYSTEM:
 		adm_err = isns_show(b);
+		iscsi_buf_pool_show(b);
 		break;
 	case MODE_TARGET:
 		if (target->redirect_info.callback)
 			adm_err = show_redirect_callback(target, b);
 		else if (strlen(target->redirect_info.addr))
 			adm_err = show_redirect_info(target, b);
-		else
+		else {
 			adm_err = show_iscsi_param(target->session_param, b);
+			if (target->cmd_window)
+				concat_printf(b, "CmdWindow=%d\n",
+					      target->cmd_window);
+			else
+				concat_printf(b, "CmdWindow=adaptive\n");
+		}
 		break;
 	case MODE_SESSION:
 		adm_err = iscsi_target_show_session(target, sid, b);
@@ -720,7 +793,8 @@ tgtadm_err iscsi_target_show(int mode, int tid, uint64_t sid, uint32_t cid, uint
 static void _stat_iscsi_conn_hdr(struct concat_buf *b)
 {
 	concat_printf(b,
-		"sid cid rxdata_octets txdata_octets dataout_pdus datain_pdus cmd_pdus rsp_pdus\n");
+		"sid cid rxdata_octets txdata_octets dataout_pdus datain_pdus cmd_pdus rsp_pdus"
+		" task_hits task_misses\n");
 }
 
 static void _stat_iscsi_conn(struct iscsi_connection *conn, struct concat_buf *b)
@@ -731,7 +805,9 @@ static void _stat_iscsi_conn(struct iscsi_connection *conn, struct concat_buf *b
 		      " %12" PRIu32
 		      " %11" PRIu32
 		      " %8" PRIu32
-		      " %8" PRIu32 "\n",
+		      " %8" PRIu32
+		      " %9" PRIu64
+		      " %11" PRIu64 "\n",
 		      (unsigned int)conn->session->tsih,
 		      (unsigned int)conn->cid,
 		      conn->stats.rxdata_octets,
@@ -739,7 +815,9 @@ static void _stat_iscsi_conn(struct iscsi_connection *conn, struct concat_buf *b
 		      conn->stats.dataout_pdus,
 		      conn->stats.datain_pdus,
 		      conn->stats.scsicmd_pdus,
-		      conn->stats.scsirsp_pdus);
+		      conn->stats.scsirsp_pdus,
+		      conn->task_cache_hits,
+		      conn->task_cache_misses);
 }
 
 static tgtadm_err _stat_iscsi_session(struct iscsi_session *session,
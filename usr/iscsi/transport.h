@@ -2,6 +2,7 @@
 #define __TRANSPORT_H
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include "list.h"
 
 struct iscsi_connection;
@@ -25,6 +26,24 @@ struct iscsi_transport {
 	size_t (*ep_write_begin)(struct iscsi_connection *conn, void *buf,
 				 size_t nbytes);
 	void (*ep_write_end)(struct iscsi_connection *conn);
+	/*
+	 * Optional, sends a batch of whole PDUs in one call. 'more' is
+	 * set when further PDUs are queued behind them. Only the iovecs
+	 * with zc set may be sent without copying them.
+	 */
+	ssize_t (*ep_writev)(struct iscsi_connection *conn, struct iovec *iov,
+			     unsigned char *zc, int iovcnt, int more);
+	/*
+	 * Optional, restarts receiving after conn->rx_paused was
+	 * cleared. Needed to offload data digests.
+	 */
+	void (*ep_rx_resume)(struct iscsi_connection *conn);
+	/*
+	 * Optional, tells if more received data is waiting to be
+	 * parsed, so that a command can be marked as not the last of
+	 * a burst.
+	 */
+	int (*ep_rx_pending)(struct iscsi_connection *conn);
 	int (*ep_rdma_read)(struct iscsi_connection *conn);
 	int (*ep_rdma_write)(struct iscsi_connection *conn);
 	size_t (*ep_close)(struct iscsi_connection *conn);
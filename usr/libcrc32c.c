@@ -30,10 +30,18 @@
  * any later version.
  *
  */
+#include <string.h>
 #include "crc32c.h"
 #include <asm/byteorder.h>
 #include "util.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#define CRC32C_X86
+#endif
+
 /*
  * MODULE_AUTHOR("Clay Haapala <chaapala@cisco.com>");
  * MODULE_DESCRIPTION("CRC32c (Castagnoli) calculations");
@@ -158,8 +166,8 @@ static const uint32_t crc32c_table[256] = {
  * crc using table.
  */
 
-uint32_t __attribute__((pure))
-crc32c_le(uint32_t seed, unsigned char const *data, size_t length)
+static uint32_t __attribute__((pure))
+crc32c_le_byte(uint32_t seed, unsigned char const *data, size_t length)
 {
 	uint32_t crc = __cpu_to_le32(seed);
 
@@ -170,6 +178,181 @@ crc32c_le(uint32_t seed, unsigned char const *data, size_t length)
 	return __le32_to_cpu(crc);
 }
 
+/*
+ * Slicing-by-8: eight bytes per step with one lookup per byte in
+ * tables that each advance the crc by one more byte. crc32c_table is
+ * the first of them, the others are generated at startup.
+ */
+static uint32_t crc32c_sb8_table[8][256];
+
+static void crc32c_sb8_init(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++)
+		crc32c_sb8_table[0][i] = crc32c_table[i];
+
+	for (k = 1; k < 8; k++)
+		for (i = 0; i < 256; i++)
+			crc32c_sb8_table[k][i] =
+				(crc32c_sb8_table[k - 1][i] >> 8) ^
+				crc32c_table[crc32c_sb8_table[k - 1][i] & 0xFF];
+}
+
+static uint32_t __attribute__((pure))
+crc32c_le_sb8(uint32_t seed, unsigned char const *p, size_t length)
+{
+	const uint32_t (*t)[256] = crc32c_sb8_table;
+	uint32_t crc = __cpu_to_le32(seed);
+	uint32_t lo, hi;
+
+	while (length >= 8) {
+		lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+
+		crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^
+			t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+			t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+			t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+
+		p += 8;
+		length -= 8;
+	}
+
+	while (length--)
+		crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	return __le32_to_cpu(crc);
+}
+
+#ifdef CRC32C_X86
+/*
+ * SSE4.2 crc32 instruction. It has a latency of three cycles but can
+ * issue every cycle, so big buffers are cut into three blocks that are
+ * processed in parallel, and the three results are combined by
+ * shifting the first ones over the length of the blocks that follow.
+ * The shift is a carry-less multiplication by x^(8n - 33) mod P,
+ * reduced back to 32 bits with the crc32 instruction itself.
+ */
+#define CRC32C_LONG	8192
+#define CRC32C_SHORT	256
+
+static uint32_t crc32c_long_shift;
+static uint32_t crc32c_short_shift;
+
+/* x^n mod P, bit-reflected like the crc */
+static uint32_t crc32c_xpow(size_t n)
+{
+	uint32_t r = 0x80000000;
+
+	while (n--)
+		r = (r & 1) ? (r >> 1) ^ CRC32C_POLY_LE : r >> 1;
+
+	return r;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t crc32c_shift(uint32_t crc, uint32_t k)
+{
+	__m128i t;
+
+	t = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+				 _mm_cvtsi32_si128(k), 0);
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(t));
+}
+
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hw_tail(uint64_t crc, unsigned char const *p,
+				      size_t length)
+{
+	uint64_t v;
+
+	while (length >= 8) {
+		memcpy(&v, p, 8);
+		crc = _mm_crc32_u64(crc, v);
+		p += 8;
+		length -= 8;
+	}
+
+	while (length--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t __attribute__((pure))
+crc32c_le_sse42(uint32_t seed, unsigned char const *p, size_t length)
+{
+	return crc32c_hw_tail(seed, p, length);
+}
+
+#define CRC32C_3WAY(block, shift)					\
+	while (length >= 3 * (block)) {					\
+		uint64_t c0 = crc, c1 = 0, c2 = 0, v0, v1, v2;		\
+		unsigned char const *end = p + (block);			\
+									\
+		do {							\
+			memcpy(&v0, p, 8);				\
+			memcpy(&v1, p + (block), 8);			\
+			memcpy(&v2, p + 2 * (block), 8);		\
+			c0 = _mm_crc32_u64(c0, v0);			\
+			c1 = _mm_crc32_u64(c1, v1);			\
+			c2 = _mm_crc32_u64(c2, v2);			\
+			p += 8;						\
+		} while (p < end);					\
+									\
+		crc = crc32c_shift(crc32c_shift(c0, shift) ^ c1, shift) \
+			^ c2;						\
+		p += 2 * (block);					\
+		length -= 3 * (block);					\
+	}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t __attribute__((pure))
+crc32c_le_pclmul(uint32_t seed, unsigned char const *p, size_t length)
+{
+	uint32_t crc = seed;
+
+	CRC32C_3WAY(CRC32C_LONG, crc32c_long_shift);
+	CRC32C_3WAY(CRC32C_SHORT, crc32c_short_shift);
+
+	return crc32c_hw_tail(crc, p, length);
+}
+#endif
+
+static uint32_t (*crc32c_le_fn)(uint32_t, unsigned char const *, size_t) =
+	crc32c_le_byte;
+
+__attribute__((constructor)) static void crc32c_init(void)
+{
+#ifdef CRC32C_X86
+	unsigned int eax, ebx, ecx, edx;
+#endif
+
+	crc32c_sb8_init();
+	crc32c_le_fn = crc32c_le_sb8;
+
+#ifdef CRC32C_X86
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_2))
+		return;
+
+	crc32c_le_fn = crc32c_le_sse42;
+
+	if (ecx & bit_PCLMUL) {
+		crc32c_long_shift = crc32c_xpow(8 * CRC32C_LONG - 33);
+		crc32c_short_shift = crc32c_xpow(8 * CRC32C_SHORT - 33);
+		crc32c_le_fn = crc32c_le_pclmul;
+	}
+#endif
+}
+
+uint32_t __attribute__((pure))
+crc32c_le(uint32_t seed, unsigned char const *data, size_t length)
+{
+	return crc32c_le_fn(seed, data, length);
+}
+
 #endif	/* CRC_LE_BITS == 8 */
 
 #if CRC_BE_BITS == 1
@@ -632,7 +632,10 @@ static int mtask_received(struct mgmt_task *mtask, int fd)
 	tgtadm_err adm_err;
 	int err;
 
+	/* config changes must not race with the other event loops */
+	tgt_lock_exclusive();
 	adm_err = mtask_execute(mtask);
+	tgt_unlock_exclusive();
 	set_mtask_result(mtask, adm_err);
 
 	/* whatever the result of mtask execution, a response is sent */
@@ -56,11 +56,41 @@ int get_scsi_cdb_size(struct scsi_cmd *cmd)
 	return CDB_SIZE(cmd);
 }
 
+/*
+ * Most commands complete without sense data, so the buffer is only
+ * allocated when some is built. It is freed with sense_buffer_free()
+ * by the transport when it releases the command. The extra room lets
+ * a transport prefix the sense data with its length in place.
+ */
+unsigned char *sense_buffer_alloc(struct scsi_cmd *cmd)
+{
+	if (!cmd->sense_buffer) {
+		cmd->sense_buffer = malloc(SCSI_SENSE_BUFFERSIZE +
+					   sizeof(uint16_t));
+		if (!cmd->sense_buffer)
+			eprintf("can't allocate a sense buffer\n");
+	}
+	return cmd->sense_buffer;
+}
+
+void sense_buffer_free(struct scsi_cmd *cmd)
+{
+	free(cmd->sense_buffer);
+	cmd->sense_buffer = NULL;
+	cmd->sense_len = 0;
+}
+
 void sense_data_build(struct scsi_cmd *cmd, uint8_t key, uint16_t asc)
 {
+	if (!sense_buffer_alloc(cmd)) {
+		cmd->sense_len = 0;
+		return;
+	}
 
+	/* the buffer may hold the sense data of an earlier command */
 	if (cmd->dev->attrs.sense_format) {
 		/* descriptor format */
+		memset(cmd->sense_buffer, 0, 8);
 		cmd->sense_buffer[0] = 0x72;  /* current, not deferred */
 		cmd->sense_buffer[1] = key;
 		cmd->sense_buffer[2] = (asc >> 8) & 0xff;
@@ -69,6 +99,7 @@ void sense_data_build(struct scsi_cmd *cmd, uint8_t key, uint16_t asc)
 	} else {
 		/* fixed format */
 		int len = 0xa;
+		memset(cmd->sense_buffer, 0, len + 8);
 		cmd->sense_buffer[0] = 0x70;  /* current, not deferred */
 		cmd->sense_buffer[2] = key;
 		cmd->sense_buffer[7] = len;
@@ -1,3 +1,5 @@
+#include <stddef.h>
+
 struct target;
 struct mgmt_req;
 
@@ -18,41 +20,60 @@ struct scsi_data_buffer {
 	int32_t resid;
 };
 
+/*
+ * The first two cache lines hold what the data path touches for every
+ * command: sbc_rw(), the backing store and target_cmd_io_done(). What
+ * target_cmd_queue() looks up once and the rarely used fields follow.
+ */
 struct scsi_cmd {
 	struct target *c_target;
-	/* linked it_nexus->cmd_hash_list */
-	struct list_head c_hlist;
-	struct list_head qlist;
-
-	uint64_t dev_id;
-
 	struct scsi_lu *dev;
 	unsigned long state;
 
+	uint8_t *scb;
+	int scb_len;
 	enum data_direction data_dir;
-	struct scsi_data_buffer in_sdb;
-	struct scsi_data_buffer out_sdb;
 
-	uint64_t cmd_itn_id;
 	uint64_t offset;
 	uint32_t tl;
-	uint8_t *scb;
-	int scb_len;
-	uint8_t lun[8];
-	int attribute;
-	uint64_t tag;
 	int result;
-	struct mgmt_req *mreq;
 
-	unsigned char sense_buffer[SCSI_SENSE_BUFFERSIZE];
-	int sense_len;
+	struct scsi_data_buffer in_sdb;
+	struct scsi_data_buffer out_sdb;
 
-	struct list_head bs_list;
+	union {
+		/* on a backing store queue */
+		struct list_head bs_list;
+		/* on an event loop's completion queue */
+		struct scsi_cmd *bs_done_next;
+	};
 
 	struct it_nexus *it_nexus;
+	/* end of the hot part */
+
 	struct it_nexus_lu_info *itn_lu_info;
+	/* linked it_nexus->cmd_hash_list */
+	struct list_head c_hlist;
+	struct list_head qlist;
+
+	uint64_t dev_id;
+	uint64_t cmd_itn_id;
+	uint64_t tag;
+	uint8_t lun[8];
+	int attribute;
+	/* the event loop that queued the command and finishes it */
+	int bs_reactor;
+
+	int sense_len;
+	/* allocated when sense data is built, see sense_buffer_alloc() */
+	unsigned char *sense_buffer;
+
+	struct mgmt_req *mreq;
 };
 
+_Static_assert(offsetof(struct scsi_cmd, itn_lu_info) <= 128,
+	       "the hot fields of struct scsi_cmd don't fit in two cache lines");
+
 #define scsi_cmnd_accessor(field, type)						\
 static inline void scsi_set_##field(struct scsi_cmd *scmd, type val)		\
 {										\
@@ -1632,7 +1632,6 @@ int spc_request_sense(int host_no, struct scsi_cmd *cmd)
 	scsi_set_in_resid_by_actual(cmd, actual_len);
 
 	/* reset sense buffer in cmnd */
-	memset(cmd->sense_buffer, 0, sizeof(cmd->sense_buffer));
 	cmd->sense_len = 0;
 
 	return SAM_STAT_GOOD;
@@ -1780,6 +1779,7 @@ enum {
 	Opt_mode_page,
 	Opt_path,
 	Opt_bsoflags, Opt_thinprovisioning,
+	Opt_iodepth,
 	Opt_err,
 };
 
@@ -1801,6 +1801,7 @@ static match_table_t tokens = {
 	{Opt_path, "path=%s"},
 	{Opt_bsoflags, "bsoflags=%s"},
 	{Opt_thinprovisioning, "thin_provisioning=%s"},
+	{Opt_iodepth, "iodepth=%s"},
 	{Opt_err, NULL},
 };
 
@@ -1899,6 +1900,13 @@ tgtadm_err lu_config(struct scsi_lu *lu, char *params, match_fn_t *fn)
 			lu_vpd[PCODE_OFFSET(0xb0)]->vpd_update(lu, NULL);
 			lu_vpd[PCODE_OFFSET(0xb2)]->vpd_update(lu, NULL);
 			break;
+		case Opt_iodepth:
+			match_strncpy(buf, &args[0], sizeof(buf));
+			if (atoi(buf) < 0)
+				adm_err = TGTADM_INVALID_REQUEST;
+			else
+				lu->iodepth = atoi(buf);
+			break;
 		case Opt_online:
 			match_strncpy(buf, &args[0], sizeof(buf));
 			if (atoi(buf))
@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -61,12 +62,29 @@ static struct device_type_template *device_type_lookup(int type)
 	return NULL;
 }
 
+#define TARGET_HASH_SIZE	1024
+
 static LIST_HEAD(target_list);
 
+/* target_list indexed by tid and by name */
+static struct hlist_head target_tid_hash[TARGET_HASH_SIZE];
+static struct hlist_head target_name_hash[TARGET_HASH_SIZE];
+
+static struct hlist_head *target_tid_head(int tid)
+{
+	return &target_tid_hash[tid & (TARGET_HASH_SIZE - 1)];
+}
+
+static struct hlist_head *target_name_head(const char *name)
+{
+	return &target_name_hash[hash_str(HASH_INIT, name) &
+				 (TARGET_HASH_SIZE - 1)];
+}
+
 static struct target *target_lookup(int tid)
 {
 	struct target *target;
-	list_for_each_entry(target, &target_list, target_siblings)
+	hlist_for_each_entry(target, target_tid_head(tid), tid_hnode)
 		if (target->tid == tid)
 			return target;
 	return NULL;
@@ -75,12 +93,28 @@ static struct target *target_lookup(int tid)
 static int target_name_lookup(char *name)
 {
 	struct target *target;
-	list_for_each_entry(target, &target_list, target_siblings)
+	hlist_for_each_entry(target, target_name_head(name), name_hnode)
 		if (!strcmp(target->name, name))
 			return 1;
 	return 0;
 }
 
+static struct it_nexus *__it_nexus_lookup(struct target *target,
+					  uint64_t itn_id)
+{
+	struct it_nexus *itn;
+
+	list_for_each_entry(itn, &target->it_nexus_list, nexus_siblings) {
+		if (itn->itn_id == itn_id)
+			return itn;
+	}
+	return NULL;
+}
+
+/*
+ * The nexus found is only safe to use on the reactor serving it, or
+ * with the other reactors stopped.
+ */
 struct it_nexus *it_nexus_lookup(int tid, uint64_t itn_id)
 {
 	struct target *target;
@@ -90,11 +124,54 @@ struct it_nexus *it_nexus_lookup(int tid, uint64_t itn_id)
 	if (!target)
 		return NULL;
 
-	list_for_each_entry(itn, &target->it_nexus_list, nexus_siblings) {
-		if (itn->itn_id == itn_id)
-			return itn;
+	pthread_mutex_lock(&target->it_nexus_lock);
+	itn = __it_nexus_lookup(target, itn_id);
+	pthread_mutex_unlock(&target->it_nexus_lock);
+
+	return itn;
+}
+
+static struct it_nexus_lu_info *itn_lu_map_get(struct it_nexus *itn,
+					       uint64_t lun)
+{
+	struct it_nexus_lu_info **chunk;
+
+	if (lun >= ITN_LU_MAP_MAX)
+		return NULL;
+
+	chunk = itn->lu_map[lun >> ITN_LU_MAP_SHIFT];
+	return chunk ? chunk[lun & (ITN_LU_MAP_CHUNK - 1)] : NULL;
+}
+
+/* LUNs beyond the map are found by walking itn_itl_info_list */
+static int itn_lu_map_set(struct it_nexus *itn, uint64_t lun,
+			  struct it_nexus_lu_info *itn_lu)
+{
+	struct it_nexus_lu_info ***chunk;
+
+	if (lun >= ITN_LU_MAP_MAX)
+		return 0;
+
+	chunk = &itn->lu_map[lun >> ITN_LU_MAP_SHIFT];
+	if (!*chunk) {
+		if (!itn_lu)
+			return 0;
+		*chunk = zalloc(ITN_LU_MAP_CHUNK * sizeof(**chunk));
+		if (!*chunk)
+			return -ENOMEM;
+	}
+	(*chunk)[lun & (ITN_LU_MAP_CHUNK - 1)] = itn_lu;
+	return 0;
+}
+
+static void itn_lu_map_free(struct it_nexus *itn)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(itn->lu_map); i++) {
+		free(itn->lu_map[i]);
+		itn->lu_map[i] = NULL;
 	}
-	return NULL;
 }
 
 static int ua_sense_add(struct it_nexus_lu_info *itn_lu, uint16_t asc)
@@ -132,15 +209,17 @@ int ua_sense_del(struct scsi_cmd *cmd, int del)
 {
 	struct it_nexus_lu_info *itn_lu = cmd->itn_lu_info;
 	struct ua_sense *uas = NULL;
-	int len = sizeof(cmd->sense_buffer);
+	int len = SCSI_SENSE_BUFFERSIZE;
 
 	if (!list_empty(&itn_lu->pending_ua_sense_list)) {
 		uas = list_first_entry(&itn_lu->pending_ua_sense_list,
 				       struct ua_sense,
 				       ua_sense_siblings);
-		memcpy(cmd->sense_buffer, uas->ua_sense_buffer,
-		       min(uas->ua_sense_len, len));
-		cmd->sense_len = min(uas->ua_sense_len, len);
+		if (sense_buffer_alloc(cmd)) {
+			memcpy(cmd->sense_buffer, uas->ua_sense_buffer,
+			       min(uas->ua_sense_len, len));
+			cmd->sense_len = min(uas->ua_sense_len, len);
+		}
 
 		/*
 		 * FIXME: we should hook the uas to the command
@@ -195,20 +274,29 @@ static void ua_sense_pending_del(struct it_nexus_lu_info *itn_lu)
 static void it_nexus_del_lu_info(struct it_nexus *itn)
 {
 	struct it_nexus_lu_info *itn_lu;
+	struct scsi_lu *lu;
 
 	while (!list_empty(&itn->itn_itl_info_list)) {
 		itn_lu = list_first_entry(&itn->itn_itl_info_list,
 					  struct it_nexus_lu_info,
 					  itn_itl_info_siblings);
+		lu = itn_lu->lu;
 
+		pthread_mutex_lock(&lu->lu_lock);
 		ua_sense_pending_del(itn_lu);
 
 		list_del(&itn_lu->itn_itl_info_siblings);
 		list_del(&itn_lu->lu_itl_info_siblings);
+		pthread_mutex_unlock(&lu->lu_lock);
 		free(itn_lu);
 	}
+	itn_lu_map_free(itn);
 }
 
+/*
+ * The three below are called with the LU lock held, or with the other
+ * reactors stopped.
+ */
 void ua_sense_add_other_it_nexus(uint64_t itn_id, struct scsi_lu *lu,
 				 uint16_t asc)
 {
@@ -216,6 +304,7 @@ void ua_sense_add_other_it_nexus(uint64_t itn_id, struct scsi_lu *lu,
 	struct it_nexus_lu_info *itn_lu;
 	int ret;
 
+	pthread_mutex_lock(&lu->tgt->it_nexus_lock);
 	list_for_each_entry(itn, &lu->tgt->it_nexus_list, nexus_siblings) {
 
 		if (itn->itn_id == itn_id)
@@ -233,6 +322,7 @@ void ua_sense_add_other_it_nexus(uint64_t itn_id, struct scsi_lu *lu,
 					" %" PRIu64 "\n", lu->lun, itn_id);
 		}
 	}
+	pthread_mutex_unlock(&lu->tgt->it_nexus_lock);
 }
 
 void ua_sense_add_it_nexus(uint64_t itn_id, struct scsi_lu *lu,
@@ -242,6 +332,7 @@ void ua_sense_add_it_nexus(uint64_t itn_id, struct scsi_lu *lu,
 	struct it_nexus_lu_info *itn_lu;
 	int ret;
 
+	pthread_mutex_lock(&lu->tgt->it_nexus_lock);
 	list_for_each_entry(itn, &lu->tgt->it_nexus_list, nexus_siblings) {
 
 		if (itn->itn_id == itn_id) {
@@ -260,23 +351,27 @@ void ua_sense_add_it_nexus(uint64_t itn_id, struct scsi_lu *lu,
 			break;
 		}
 	}
+	pthread_mutex_unlock(&lu->tgt->it_nexus_lock);
 }
 
 int lu_prevent_removal(struct scsi_lu *lu)
 {
 	struct it_nexus *itn;
 	struct it_nexus_lu_info *itn_lu;
+	int prevent = 0;
 
+	pthread_mutex_lock(&lu->tgt->it_nexus_lock);
 	list_for_each_entry(itn, &lu->tgt->it_nexus_list, nexus_siblings) {
 		list_for_each_entry(itn_lu, &itn->itn_itl_info_list,
 				    itn_itl_info_siblings) {
 			if (itn_lu->lu == lu) {
 				if (itn_lu->prevent & PREVENT_REMOVAL)
-					return 1;
+					prevent = 1;
 			}
 		}
 	}
-	return 0;
+	pthread_mutex_unlock(&lu->tgt->it_nexus_lock);
+	return prevent;
 }
 
 int it_nexus_create(int tid, uint64_t itn_id, int host_no, char *info)
@@ -299,6 +394,10 @@ int it_nexus_create(int tid, uint64_t itn_id, int host_no, char *info)
 
 	target = target_lookup(tid);
 
+	/*
+	 * Nothing else can find the nexus until it is on the target's
+	 * list, but the LUs are shared.
+	 */
 	itn = zalloc(sizeof(*itn));
 	if (!itn)
 		return -ENOMEM;
@@ -320,11 +419,18 @@ int it_nexus_create(int tid, uint64_t itn_id, int host_no, char *info)
 		INIT_LIST_HEAD(&itn_lu->pending_ua_sense_list);
 
 		ret = ua_sense_add(itn_lu, ASC_POWERON_RESET);
-		if (ret)
+		if (!ret)
+			ret = itn_lu_map_set(itn, lu->lun, itn_lu);
+		if (ret) {
+			ua_sense_pending_del(itn_lu);
+			free(itn_lu);
 			goto out;
+		}
 
+		pthread_mutex_lock(&lu->lu_lock);
 		list_add_tail(&itn_lu->lu_itl_info_siblings,
 			      &lu->lu_itl_info_list);
+		pthread_mutex_unlock(&lu->lu_lock);
 
 		list_add(&itn_lu->itn_itl_info_siblings,
 			 &itn->itn_itl_info_list);
@@ -332,36 +438,48 @@ int it_nexus_create(int tid, uint64_t itn_id, int host_no, char *info)
 
 	INIT_LIST_HEAD(&itn->cmd_list);
 
+	pthread_mutex_lock(&target->it_nexus_lock);
 	list_add_tail(&itn->nexus_siblings, &target->it_nexus_list);
+	pthread_mutex_unlock(&target->it_nexus_lock);
 
 	return 0;
 out:
 	it_nexus_del_lu_info(itn);
+	free(itn);
 	return -ENOMEM;
 }
 
+/* called by the reactor serving the nexus */
 int it_nexus_destroy(int tid, uint64_t itn_id)
 {
+	struct target *target;
 	struct it_nexus *itn;
 	struct scsi_lu *lu;
 
 	dprintf("%d %" PRIu64 "\n", tid, itn_id);
 
-	itn = it_nexus_lookup(tid, itn_id);
-	if (!itn)
+	target = target_lookup(tid);
+	if (!target)
 		return -ENOENT;
 
-	if (!list_empty(&itn->cmd_list))
-		return -EBUSY;
+	pthread_mutex_lock(&target->it_nexus_lock);
+	itn = __it_nexus_lookup(target, itn_id);
+	if (!itn || !list_empty(&itn->cmd_list)) {
+		pthread_mutex_unlock(&target->it_nexus_lock);
+		return itn ? -EBUSY : -ENOENT;
+	}
+	/* the UA code of other nexuses can't reach it any more */
+	list_del(&itn->nexus_siblings);
+	pthread_mutex_unlock(&target->it_nexus_lock);
 
-	list_for_each_entry(lu, &itn->nexus_target->device_list,
-			    device_siblings) {
+	list_for_each_entry(lu, &target->device_list, device_siblings) {
+		pthread_mutex_lock(&lu->lu_lock);
 		device_release(tid, itn_id, lu->lun, 0);
+		pthread_mutex_unlock(&lu->lu_lock);
 	}
 
 	it_nexus_del_lu_info(itn);
 
-	list_del(&itn->nexus_siblings);
 	free(itn);
 	return 0;
 }
@@ -456,13 +574,14 @@ __device_lookup(int tid, uint64_t lun, struct target **t)
 }
 
 enum {
-	Opt_path, Opt_bstype, Opt_bsoflags, Opt_blocksize, Opt_err,
+	Opt_path, Opt_bstype, Opt_bsoflags, Opt_bsopts, Opt_blocksize, Opt_err,
 };
 
 static match_table_t device_tokens = {
 	{Opt_path, "path=%s"},
 	{Opt_bstype, "bstype=%s"},
 	{Opt_bsoflags, "bsoflags=%s"},
+	{Opt_bsopts, "bsopts=%s"},
 	{Opt_blocksize, "blocksize=%s"},
 	{Opt_err, NULL},
 };
@@ -473,7 +592,7 @@ tgtadm_err tgt_device_create(int tid, int dev_type, uint64_t lun, char *params,
 		      int backing)
 {
 	char *p, *path = NULL, *bstype = NULL;
-	char *bsoflags = NULL, *blocksize = NULL;
+	char *bsoflags = NULL, *bsopts = NULL, *blocksize = NULL;
 	int lu_bsoflags = 0;
 	tgtadm_err adm_err = TGTADM_SUCCESS;
 	struct target *target;
@@ -502,6 +621,9 @@ tgtadm_err tgt_device_create(int tid, int dev_type, uint64_t lun, char *params,
 		case Opt_bsoflags:
 			bsoflags = match_strdup(&args[0]);
 			break;
+		case Opt_bsopts:
+			bsopts = match_strdup(&args[0]);
+			break;
 		case Opt_blocksize:
 			blocksize = match_strdup(&args[0]);
 			break;
@@ -579,7 +701,10 @@ tgtadm_err tgt_device_create(int tid, int dev_type, uint64_t lun, char *params,
 	lu->tgt = target;
 	lu->lun = lun;
 	lu->bsoflags = lu_bsoflags;
+	lu->bsopts = bsopts;
+	bsopts = NULL;
 
+	pthread_mutex_init(&lu->lu_lock, NULL);
 	tgt_cmd_queue_init(&lu->cmd_queue);
 	INIT_LIST_HEAD(&lu->registration_list);
 	INIT_LIST_HEAD(&lu->lu_itl_info_list);
@@ -646,6 +771,10 @@ tgtadm_err tgt_device_create(int tid, int dev_type, uint64_t lun, char *params,
 		itn_lu = zalloc(sizeof(*itn_lu));
 		if (!itn_lu)
 			break;
+		if (itn_lu_map_set(itn, lu->lun, itn_lu)) {
+			free(itn_lu);
+			break;
+		}
 		itn_lu->lu = lu;
 		itn_lu->itn_id = itn->itn_id;
 		INIT_LIST_HEAD(&itn_lu->pending_ua_sense_list);
@@ -683,12 +812,16 @@ out:
 		free(path);
 	if (bsoflags)
 		free(bsoflags);
+	if (bsopts)
+		free(bsopts);
 	return adm_err;
 
 fail_bs_init:
 	if (lu->bst->bs_exit)
 		lu->bst->bs_exit(lu);
 fail_lu_init:
+	pthread_mutex_destroy(&lu->lu_lock);
+	free(lu->bsopts);
 	free(lu);
 	goto out;
 }
@@ -733,6 +866,10 @@ tgtadm_err tgt_device_destroy(int tid, uint64_t lun, int force)
 					 itn_itl_info_siblings) {
 			if (itn_lu->lu == lu) {
 				ua_sense_pending_del(itn_lu);
+				itn_lu_map_set(itn, lun, NULL);
+				list_del(&itn_lu->itn_itl_info_siblings);
+				list_del(&itn_lu->lu_itl_info_siblings);
+				free(itn_lu);
 				break;
 			}
 		}
@@ -745,6 +882,8 @@ tgtadm_err tgt_device_destroy(int tid, uint64_t lun, int force)
 		free(reg);
 	}
 
+	pthread_mutex_destroy(&lu->lu_lock);
+	free(lu->bsopts);
 	free(lu);
 
 	list_for_each_entry(itn, &target->it_nexus_list, nexus_siblings) {
@@ -852,14 +991,7 @@ tgtadm_err dtd_load_unload(int tid, uint64_t lun, int load, char *file)
 
 int device_reserve(struct scsi_cmd *cmd)
 {
-	struct scsi_lu *lu;
-
-	lu = device_lookup(cmd->c_target, cmd->dev->lun);
-	if (!lu) {
-		eprintf("invalid target and lun %d %" PRIu64 "\n",
-			cmd->c_target->tid, cmd->dev->lun);
-		return 0;
-	}
+	struct scsi_lu *lu = cmd->dev;
 
 	if (lu->reserve_id && lu->reserve_id != cmd->cmd_itn_id) {
 		dprintf("already reserved %" PRIu64 " %" PRIu64 "\n",
@@ -895,10 +1027,9 @@ int device_release(int tid, uint64_t itn_id, uint64_t lun, int force)
 
 int device_reserved(struct scsi_cmd *cmd)
 {
-	struct scsi_lu *lu;
+	struct scsi_lu *lu = cmd->dev;
 
-	lu = device_lookup(cmd->c_target, cmd->dev->lun);
-	if (!lu || !lu->reserve_id || lu->reserve_id == cmd->cmd_itn_id)
+	if (!lu->reserve_id || lu->reserve_id == cmd->cmd_itn_id)
 		return 0;
 	return -EBUSY;
 }
@@ -1073,6 +1204,9 @@ static struct it_nexus_lu_info *it_nexus_lu_info_lookup(struct it_nexus *itn,
 {
 	struct it_nexus_lu_info *itn_lu;
 
+	if (lun < ITN_LU_MAP_MAX)
+		return itn_lu_map_get(itn, lun);
+
 	list_for_each_entry(itn_lu, &itn->itn_itl_info_list,
 			    itn_itl_info_siblings) {
 		if (itn_lu->lu->lun == lun)
@@ -1081,32 +1215,49 @@ static struct it_nexus_lu_info *it_nexus_lu_info_lookup(struct it_nexus *itn,
 	return NULL;
 }
 
+/*
+ * The transport may set cmd->it_nexus to the nexus it got at login,
+ * otherwise it's looked up by cmd->cmd_itn_id.
+ */
 int target_cmd_queue(int tid, struct scsi_cmd *cmd)
 {
 	struct target *target;
-	struct it_nexus *itn;
+	struct it_nexus *itn = cmd->it_nexus;
+	struct it_nexus_lu_info *itn_lu;
 	uint64_t dev_id, itn_id = cmd->cmd_itn_id;
+	struct tgt_reactor *r = tgt_current_reactor();
+
+	/* the reactor serving the nexus, completions go back to it */
+	cmd->bs_reactor = r ? tgt_reactor_id(r) : 0;
 
-	itn = it_nexus_lookup(tid, itn_id);
 	if (!itn) {
-		eprintf("invalid nexus %d %" PRIx64 "\n", tid, itn_id);
-		return -ENOENT;
+		itn = it_nexus_lookup(tid, itn_id);
+		if (!itn) {
+			eprintf("invalid nexus %d %" PRIx64 "\n", tid, itn_id);
+			return -ENOENT;
+		}
+		cmd->it_nexus = itn;
 	}
 
 	cmd->c_target = target = itn->nexus_target;
-	cmd->it_nexus = itn;
 
 	dev_id = scsi_get_devid(target->lid, cmd->lun);
 	cmd->dev_id = dev_id;
 	dprintf("%p %x %" PRIx64 "\n", cmd, cmd->scb[0], dev_id);
-	cmd->dev = device_lookup(target, dev_id);
-	/* use LUN0 */
-	if (!cmd->dev)
-		cmd->dev = list_first_entry(&target->device_list,
-					    struct scsi_lu,
-					    device_siblings);
+	itn_lu = it_nexus_lu_info_lookup(itn, dev_id);
+	if (itn_lu) {
+		cmd->dev = itn_lu->lu;
+		cmd->itn_lu_info = itn_lu;
+	} else {
+		cmd->dev = device_lookup(target, dev_id);
+		/* use LUN0 */
+		if (!cmd->dev)
+			cmd->dev = list_first_entry(&target->device_list,
+						    struct scsi_lu,
+						    device_siblings);
 
-	cmd->itn_lu_info = it_nexus_lu_info_lookup(itn, cmd->dev->lun);
+		cmd->itn_lu_info = it_nexus_lu_info_lookup(itn, cmd->dev->lun);
+	}
 
 	/* service delivery or target failure */
 	if (target->target_state != SCSI_TARGET_READY)
@@ -1130,11 +1281,13 @@ int target_cmd_queue(int tid, struct scsi_cmd *cmd)
  */
 int target_cmd_perform(int tid, struct scsi_cmd *cmd)
 {
-	struct tgt_cmd_queue *q = &cmd->dev->cmd_queue;
-	int result, enabled = 0;
+	struct scsi_lu *lu = cmd->dev;
+	struct tgt_cmd_queue *q = &lu->cmd_queue;
+	int result = 0, enabled = 0, done = 0;
 
 	cmd_hlist_insert(cmd->it_nexus, cmd);
 
+	pthread_mutex_lock(&lu->lu_lock);
 	enabled = cmd_enabled(q, cmd);
 	dprintf("%p %x %" PRIx64 " %d\n", cmd, cmd->scb[0], cmd->dev_id,
 		enabled);
@@ -1151,8 +1304,7 @@ int target_cmd_perform(int tid, struct scsi_cmd *cmd)
 			result, cmd_async(cmd));
 
 		set_cmd_processed(cmd);
-		if (!cmd_async(cmd))
-			target_cmd_io_done(cmd, result);
+		done = !cmd_async(cmd);
 	} else {
 		set_cmd_queued(cmd);
 		dprintf("blocked %" PRIx64 " %x %" PRIu64 " %d\n",
@@ -1160,6 +1312,11 @@ int target_cmd_perform(int tid, struct scsi_cmd *cmd)
 
 		list_add_tail(&cmd->qlist, &q->queue);
 	}
+	pthread_mutex_unlock(&lu->lu_lock);
+
+	/* the transport may finish the command, and free it, right away */
+	if (done)
+		target_cmd_io_done(cmd, result);
 
 	return 0;
 }
@@ -1173,7 +1330,9 @@ int target_cmd_perform_passthrough(int tid, struct scsi_cmd *cmd)
 
 	dprintf("%p %x %" PRIx64 " PT\n", cmd, cmd->scb[0], cmd->dev_id);
 
+	pthread_mutex_lock(&cmd->dev->lu_lock);
 	result = cmd->dev->dev_type_template.cmd_passthrough(tid, cmd);
+	pthread_mutex_unlock(&cmd->dev->lu_lock);
 
 	dprintf("%" PRIx64 " %x %p %p %" PRIu64 " %u %u %d %d\n",
 		cmd->tag, cmd->scb[0], scsi_get_out_buffer(cmd),
@@ -1188,13 +1347,25 @@ int target_cmd_perform_passthrough(int tid, struct scsi_cmd *cmd)
 	return 0;
 }
 
+/*
+ * The transport finishes a command on the reactor it was queued on.
+ * Backing store threads, and reactors running commands queued behind
+ * others on the same LU, hand it over.
+ */
 void target_cmd_io_done(struct scsi_cmd *cmd, int result)
 {
 	enum data_direction cmd_dir = scsi_get_data_dir(cmd);
 	struct lu_stat *stat = &cmd->itn_lu_info->stat;
+	struct tgt_reactor *r = tgt_current_reactor();
 	int lid = cmd->c_target->lid;
 
 	scsi_set_result(cmd, result);
+	if (nr_reactors > 1 && !tgt_is_exclusive() &&
+	    (!r || tgt_reactor_id(r) != cmd->bs_reactor)) {
+		bs_cmd_done_post(cmd);
+		return;
+	}
+
 	if (cmd_dir == DATA_WRITE) {
 		stat->wr_done_bytes += scsi_get_out_length(cmd);
 		stat->wr_done_cmds++;
@@ -1213,7 +1384,11 @@ void target_cmd_io_done(struct scsi_cmd *cmd, int result)
 	return;
 }
 
-static void post_cmd_done(struct tgt_cmd_queue *q)
+/*
+ * Called with the LU lock held. The commands that finished right away
+ * are put on @done, to be completed once it is dropped.
+ */
+static void post_cmd_done(struct tgt_cmd_queue *q, struct list_head *done)
 {
 	struct scsi_cmd *cmd, *tmp;
 	int enabled, result;
@@ -1221,22 +1396,20 @@ static void post_cmd_done(struct tgt_cmd_queue *q)
 	list_for_each_entry_safe(cmd, tmp, &q->queue, qlist) {
 		enabled = cmd_enabled(q, cmd);
 		if (enabled) {
-			int tid = cmd->c_target->tid;
-			uint64_t itn_id = cmd->cmd_itn_id;
-			struct it_nexus *nexus;
-
-			nexus = it_nexus_lookup(tid, itn_id);
-			if (!nexus)
-				eprintf("BUG: %" PRIu64 "\n", itn_id);
-
 			list_del(&cmd->qlist);
 			dprintf("perform %" PRIx64 " %x\n", cmd->tag,
 				cmd->attribute);
-			result = scsi_cmd_perform(nexus->host_no, cmd);
-			cmd_post_perform(q, cmd);
+			/*
+			 * The command may be another reactor's, which can
+			 * see it completed as soon as it is submitted.
+			 */
 			set_cmd_processed(cmd);
-			if (!cmd_async(cmd))
-				target_cmd_io_done(cmd, result);
+			result = scsi_cmd_perform(cmd->it_nexus->host_no, cmd);
+			cmd_post_perform(q, cmd);
+			if (!cmd_async(cmd)) {
+				scsi_set_result(cmd, result);
+				list_add_tail(&cmd->qlist, done);
+			}
 		} else
 			break;
 	}
@@ -1248,7 +1421,10 @@ static void post_cmd_done(struct tgt_cmd_queue *q)
  */
 static void __cmd_done(struct target *target, struct scsi_cmd *cmd)
 {
+	struct scsi_lu *lu = cmd->dev;
 	struct tgt_cmd_queue *q;
+	struct scsi_cmd *next, *tmp;
+	LIST_HEAD(done);
 
 	cmd_hlist_remove(cmd);
 
@@ -1256,7 +1432,8 @@ static void __cmd_done(struct target *target, struct scsi_cmd *cmd)
 		scsi_get_in_buffer(cmd), scsi_get_out_length(cmd),
 		scsi_get_in_length(cmd));
 
-	q = &cmd->dev->cmd_queue;
+	q = &lu->cmd_queue;
+	pthread_mutex_lock(&lu->lu_lock);
 	q->active_cmd--;
 	switch (cmd->attribute) {
 	case MSG_ORDERED_TAG:
@@ -1265,7 +1442,13 @@ static void __cmd_done(struct target *target, struct scsi_cmd *cmd)
 		break;
 	}
 
-	post_cmd_done(q);
+	post_cmd_done(q, &done);
+	pthread_mutex_unlock(&lu->lu_lock);
+
+	list_for_each_entry_safe(next, tmp, &done, qlist) {
+		list_del(&next->qlist);
+		target_cmd_io_done(next, scsi_get_result(next));
+	}
 }
 
 /*
@@ -1278,15 +1461,37 @@ void __cmd_done_passthrough(struct target *target, struct scsi_cmd *cmd)
 		scsi_get_in_length(cmd));
 }
 
+static void mgmt_end_notify_posted(struct event_data *tev)
+{
+	struct mgmt_req *mreq = tev->data;
+
+	tgt_drivers[mreq->lid]->mgmt_end_notify(mreq);
+	free(mreq);
+}
+
+/* tell the transport on the reactor that made the request */
+static void mgmt_end_notify(struct mgmt_req *mreq)
+{
+	if (nr_reactors > 1 && mreq->reactor != tgt_current_reactor()) {
+		tgt_init_sched_event(&mreq->event, mgmt_end_notify_posted,
+				     mreq);
+		tgt_reactor_post(mreq->reactor, &mreq->event);
+		return;
+	}
+
+	tgt_drivers[mreq->lid]->mgmt_end_notify(mreq);
+	free(mreq);
+}
+
 void target_cmd_done(struct scsi_cmd *cmd)
 {
 	struct mgmt_req *mreq;
 
+	/* the aborted commands may be served by different reactors */
 	mreq = cmd->mreq;
-	if (mreq && !--mreq->busy) {
+	if (mreq && !__atomic_sub_fetch(&mreq->busy, 1, __ATOMIC_ACQ_REL)) {
 		mreq->result = mreq->function == ABORT_TASK ? -EEXIST : 0;
-		tgt_drivers[cmd->c_target->lid]->mgmt_end_notify(mreq);
-		free(mreq);
+		mgmt_end_notify(mreq);
 	}
 
 	cmd->dev->cmd_done(cmd->c_target, cmd);
@@ -1338,34 +1543,18 @@ static int abort_task_set(struct mgmt_req *mreq, struct target *target,
 	return count;
 }
 
-enum mgmt_req_result target_mgmt_request(int tid, uint64_t itn_id,
-					 uint64_t req_id, int function,
-					 uint8_t *lun_buf, uint64_t tag,
-					 int host_no)
+/* runs with the other reactors stopped */
+static enum mgmt_req_result __target_mgmt_request(struct target *target,
+						  struct mgmt_req *mreq)
 {
-	struct target *target;
-	struct mgmt_req *mreq;
 	int err = 0, count, send = 1;
 	struct it_nexus *itn;
 	struct it_nexus_lu_info *itn_lu;
-	uint64_t lun;
+	uint64_t lun, itn_id = mreq->itn_id, tag = mreq->tag;
+	uint8_t *lun_buf = mreq->lun;
+	int function = mreq->function;
 	uint16_t asc;
 
-	target = target_lookup(tid);
-	if (!target) {
-		eprintf("invalid tid %d\n", tid);
-		return MGMT_REQ_FAILED;
-	}
-
-	mreq = zalloc(sizeof(*mreq));
-	if (!mreq) {
-		eprintf("failed to allocate mgmt_req\n");
-		return MGMT_REQ_FAILED;
-	}
-
-	mreq->mid = req_id;
-	mreq->function = function;
-
 	switch (function) {
 	case ABORT_TASK:
 		count = abort_task_set(mreq, target, itn_id, tag, NULL, 0);
@@ -1435,8 +1624,7 @@ enum mgmt_req_result target_mgmt_request(int tid, uint64_t itn_id,
 
 	if (send) {
 		mreq->result = err;
-		tgt_drivers[target->lid]->mgmt_end_notify(mreq);
-		free(mreq);
+		mgmt_end_notify(mreq);
 	}
 
 	if (err)
@@ -1447,6 +1635,74 @@ enum mgmt_req_result target_mgmt_request(int tid, uint64_t itn_id,
 	return MGMT_REQ_QUEUED;
 }
 
+static void target_mgmt_request_posted(struct event_data *tev)
+{
+	struct mgmt_req *mreq = tev->data;
+	struct target *target;
+
+	tgt_lock_exclusive();
+	target = target_lookup(mreq->tid);
+	if (target)
+		__target_mgmt_request(target, mreq);
+	else {
+		mreq->result = -EINVAL;
+		mgmt_end_notify(mreq);
+	}
+	tgt_unlock_exclusive();
+}
+
+/*
+ * Task management walks the commands of every nexus, so it runs on
+ * the main reactor with the others stopped. A request made on another
+ * reactor is passed over and always reported as queued.
+ */
+enum mgmt_req_result target_mgmt_request(int tid, uint64_t itn_id,
+					 uint64_t req_id, int function,
+					 uint8_t *lun_buf, uint64_t tag,
+					 int host_no)
+{
+	struct target *target;
+	struct mgmt_req *mreq;
+	struct tgt_reactor *r = tgt_current_reactor();
+	enum mgmt_req_result ret;
+
+	target = target_lookup(tid);
+	if (!target) {
+		eprintf("invalid tid %d\n", tid);
+		return MGMT_REQ_FAILED;
+	}
+
+	mreq = zalloc(sizeof(*mreq));
+	if (!mreq) {
+		eprintf("failed to allocate mgmt_req\n");
+		return MGMT_REQ_FAILED;
+	}
+
+	mreq->mid = req_id;
+	mreq->function = function;
+	mreq->tid = tid;
+	mreq->lid = target->lid;
+	mreq->itn_id = itn_id;
+	if (lun_buf)
+		memcpy(mreq->lun, lun_buf, sizeof(mreq->lun));
+	mreq->tag = tag;
+	mreq->host_no = host_no;
+	mreq->reactor = r ? r : tgt_main_reactor();
+
+	if (nr_reactors > 1 && mreq->reactor != tgt_main_reactor()) {
+		tgt_init_sched_event(&mreq->event, target_mgmt_request_posted,
+				     mreq);
+		tgt_reactor_post(tgt_main_reactor(), &mreq->event);
+		return MGMT_REQ_QUEUED;
+	}
+
+	tgt_lock_exclusive();
+	ret = __target_mgmt_request(target, mreq);
+	tgt_unlock_exclusive();
+
+	return ret;
+}
+
 struct account_entry {
 	int aid;
 	char *user;
@@ -2026,7 +2282,8 @@ tgtadm_err tgt_target_show_all(struct concat_buf *b)
 				_TAB3 "Thin-provisioning: %s\n"
 				_TAB3 "Backing store type: %s\n"
 				_TAB3 "Backing store path: %s\n"
-				_TAB3 "Backing store flags: %s\n",
+				_TAB3 "Backing store flags: %s\n"
+				_TAB3 "Backing store options: %s\n",
 				lu->lun,
 				print_type(lu->attrs.device_type),
 				lu->attrs.scsi_id,
@@ -2043,7 +2300,8 @@ tgtadm_err tgt_target_show_all(struct concat_buf *b)
 					"None",
 				lu->path ? : "None",
 					open_flags_to_str(strflags,
-							  lu->bsoflags));
+							  lu->bsoflags),
+				lu->bsopts ? : "None");
 
 		if (!strcmp(tgt_drivers[target->lid]->name, "iscsi") ||
 		    !strcmp(tgt_drivers[target->lid]->name, "iser")) {
@@ -2159,9 +2417,12 @@ tgtadm_err tgt_target_create(int lld, int tid, char *args)
 			break;
 
 	list_add_tail(&target->target_siblings, &pos->target_siblings);
+	hlist_add_head(&target->tid_hnode, target_tid_head(tid));
+	hlist_add_head(&target->name_hnode, target_name_head(target->name));
 
 	INIT_LIST_HEAD(&target->acl_list);
 	INIT_LIST_HEAD(&target->iqn_acl_list);
+	pthread_mutex_init(&target->it_nexus_lock, NULL);
 	INIT_LIST_HEAD(&target->it_nexus_list);
 
 	tgt_device_create(tid, TYPE_RAID, 0, NULL, 0);
@@ -2206,6 +2467,8 @@ tgtadm_err tgt_target_destroy(int lld_no, int tid, int force)
 		tgt_drivers[lld_no]->target_destroy(tid, force);
 
 	list_del(&target->target_siblings);
+	hlist_del(&target->tid_hnode);
+	hlist_del(&target->name_hnode);
 
 	list_for_each_entry_safe(acl, tmp, &target->acl_list, aclent_list) {
 		list_del(&acl->aclent_list);
@@ -2222,6 +2485,7 @@ tgtadm_err tgt_target_destroy(int lld_no, int tid, int force)
 
 	list_del(&target->lld_siblings);
 
+	pthread_mutex_destroy(&target->it_nexus_lock);
 	free(target->account.in_aids);
 	free(target->name);
 	free(target);
@@ -29,9 +29,13 @@ struct target {
 	enum scsi_target_state target_state;
 
 	struct list_head target_siblings;
+	struct hlist_node tid_hnode;
+	struct hlist_node name_hnode;
 
 	struct list_head device_list;
 
+	/* taken after a LU lock, never before one */
+	pthread_mutex_t it_nexus_lock;
 	struct list_head it_nexus_list;
 
 	struct backingstore_template *bst;
@@ -45,6 +49,11 @@ struct target {
 	struct list_head lld_siblings;
 };
 
+/* LUNs that the peripheral and flat addressing methods can reach */
+#define ITN_LU_MAP_MAX		(1 << 14)
+#define ITN_LU_MAP_SHIFT	8
+#define ITN_LU_MAP_CHUNK	(1 << ITN_LU_MAP_SHIFT)
+
 struct it_nexus {
 	uint64_t itn_id;
 	long ctime;
@@ -60,6 +69,8 @@ struct it_nexus {
 	int host_no;
 
 	struct list_head itn_itl_info_list;
+	/* itn_itl_info_list by LUN, in chunks allocated on demand */
+	struct it_nexus_lu_info **lu_map[ITN_LU_MAP_MAX / ITN_LU_MAP_CHUNK];
 
 	/* only used for show operation */
 	char *info;
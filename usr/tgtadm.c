@@ -113,6 +113,7 @@ struct option const long_options[] = {
 	{"backing-store", required_argument, NULL, 'b'},
 	{"bstype", required_argument, NULL, 'E'},
 	{"bsoflags", required_argument, NULL, 'f'},
+	{"bsopts", required_argument, NULL, 'S'},
 	{"blocksize", required_argument, NULL, 'y'},
 	{"targetname", required_argument, NULL, 'T'},
 	{"initiator-address", required_argument, NULL, 'I'},
@@ -130,7 +131,7 @@ struct option const long_options[] = {
 };
 
 static char *short_options =
-		"dhVL:o:m:t:s:c:l:n:v:b:E:f:y:T:I:Q:u:p:H:F:P:B:Y:O:C:";
+		"dhVL:o:m:t:s:c:l:n:v:b:E:f:S:y:T:I:Q:u:p:H:F:P:B:Y:O:C:";
 
 static void usage(int status)
 {
@@ -162,6 +163,7 @@ static void usage(int status)
 		"\tdisable the specific permitted initiators.\n"
 		"--lld <driver> --mode logicalunit --op new --tid <id> --lun <lun>\n"
 		"  --backing-store <path> --bstype <type> --bsoflags <options>\n"
+		"  --bsopts <options>\n"
 		"\tadd a new logical unit with <lun> to the specific\n"
 		"\ttarget with <id>. The logical unit is offered\n"
 		"\tto the initiators. <path> must be block device files\n"
@@ -169,6 +171,8 @@ static void usage(int status)
 		"\tbstype option is optional.\n"
 		"\tbsoflags supported options are sync and direct\n"
 		"\t(sync:direct for both).\n"
+		"\tbsopts are options of the backing store type,\n"
+		"\tseparated by ';'.\n"
 		"--lld <driver> --mode logicalunit --op delete --tid <id> --lun <lun>\n"
 		"\tdelete the specific logical unit with <lun> that\n"
 		"\tthe target with <id> has.\n"
@@ -492,7 +496,7 @@ int main(int argc, char **argv)
 	uint64_t sid, lun, force;
 	char *name, *value, *path, *targetname, *address, *iqnname, *targetOps;
 	char *portalOps, *bstype;
-	char *bsoflags;
+	char *bsoflags, *bsopts;
 	char *blocksize;
 	char *user, *password;
 	struct tgtadm_req adm_req = {0}, *req = &adm_req;
@@ -507,7 +511,7 @@ int main(int argc, char **argv)
 	ac_dir = ACCOUNT_TYPE_INCOMING;
 	name = value = path = targetname = address = iqnname = NULL;
 	targetOps = portalOps = bstype = NULL;
-	bsoflags = blocksize = user = password = NULL;
+	bsoflags = bsopts = blocksize = user = password = NULL;
 	force = 0;
 
 	optind = 1;
@@ -588,6 +592,9 @@ int main(int argc, char **argv)
 		case 'f':
 			bsoflags = optarg;
 			break;
+		case 'S':
+			bsopts = optarg;
+			break;
 		case 'y':
 			blocksize = optarg;
 			break;
@@ -809,7 +816,7 @@ int main(int argc, char **argv)
 		}
 		switch (op) {
 		case OP_NEW:
-			rc = verify_mode_params(argc, argv, "LmofytlbEYC");
+			rc = verify_mode_params(argc, argv, "LmofSytlbEYC");
 			if (rc) {
 				eprintf("target mode: option '-%c' is not "
 					  "allowed/supported\n", rc);
@@ -954,6 +961,9 @@ int main(int argc, char **argv)
 	if (bsoflags)
 		concat_printf(&b, "%sbsoflags=%s", concat_delim(&b, ","),
 			      bsoflags);
+	if (bsopts)
+		concat_printf(&b, "%sbsopts=%s", concat_delim(&b, ","),
+			      bsopts);
 	if (blocksize)
 		concat_printf(&b, "%sblocksize=%s", concat_delim(&b, ","),
 			      blocksize);
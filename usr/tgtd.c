@@ -31,6 +31,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <sys/resource.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
@@ -45,26 +46,72 @@
 unsigned long pagesize, pageshift;
 
 int system_active = 1;
-#ifdef __linux__
-static int ep_fd;
-#else
+#ifndef __linux__
 static struct event_base *ev_base;
 #endif
 static char program_name[] = "tgtd";
-static LIST_HEAD(tgt_events_list);
-static LIST_HEAD(tgt_sched_events_list);
+
+#define TGT_MAX_REACTORS	64
+
+/*
+ * An event loop. Reactor 0 is run by the main thread and owns every
+ * event registered through the legacy tgt_event_* interface (mgmt,
+ * backing store completions, timers, listening sockets). Other
+ * reactors run in their own threads and only carry the fds that a
+ * transport explicitly hands to them.
+ */
+struct tgt_reactor {
+	int id;
+#ifdef __linux__
+	int ep_fd;
+	int wake_fd[2];
+#endif
+	pthread_t thread;
+	/* registered events indexed by fd */
+	struct event_data **fd_table;
+	int fd_table_size;
+	struct list_head sched_events_list;
+	/* deleted events, freed once the current epoll batch is done */
+	struct list_head zombie_list;
+	/* events posted by other threads, see tgt_reactor_post() */
+	pthread_mutex_t post_lock;
+	struct list_head post_list;
+	int post_woken;
+};
+
+int nr_reactors = 1;
+static struct tgt_reactor *reactors;
+static int next_reactor;
+static __thread struct tgt_reactor *current_reactor;
+
+/*
+ * A connection, and everything hanging off it, belongs to one reactor
+ * and only that reactor touches it, so event handlers need no lock of
+ * their own. The objects shared between reactors (LUs, I_T nexuses,
+ * the session tables) carry their own locks.
+ *
+ * Configuration changes and other work on objects owned by another
+ * reactor are done by the main reactor with tgt_config_lock held
+ * exclusively. Every reactor holds it shared while it dispatches a
+ * batch of events, so the main reactor waits until the others are
+ * parked in epoll_wait. Readers never block each other.
+ */
+static pthread_rwlock_t tgt_config_lock;
+static __thread int tgt_config_shared;
+static __thread int tgt_config_exclusive;
 
 static struct option const long_options[] = {
 	{"foreground", no_argument, 0, 'f'},
 	{"control-port", required_argument, 0, 'C'},
 	{"nr_iothreads", required_argument, 0, 't'},
+	{"reactors", required_argument, 0, 'R'},
 	{"debug", required_argument, 0, 'd'},
 	{"version", no_argument, 0, 'V'},
 	{"help", no_argument, 0, 'h'},
 	{0, 0, 0, 0},
 };
 
-static char *short_options = "fC:d:t:Vh";
+static char *short_options = "fC:d:t:R:Vh";
 static char *spare_args;
 
 static void usage(int status)
@@ -80,6 +127,7 @@ static void usage(int status)
 		"-f, --foreground        make the program run in the foreground\n"
 		"-C, --control-port NNNN use port NNNN for the mgmt channel\n"
 		"-t, --nr_iothreads NNNN specify the number of I/O threads\n"
+		"-R, --reactors NNNN     specify the number of event loops\n"
 		"-d, --debug debuglevel  print debugging information\n"
 		"-V, --version           print version and exit\n"
 		"-h, --help              display this help and exit\n",
@@ -171,7 +219,109 @@ set_rlimit:
 	return 0;
 }
 
-int tgt_event_add(int fd, int events, event_handler_t handler, void *data)
+static void tgt_config_read_lock(void)
+{
+	if (nr_reactors > 1) {
+		pthread_rwlock_rdlock(&tgt_config_lock);
+		tgt_config_shared = 1;
+	}
+}
+
+static void tgt_config_read_unlock(void)
+{
+	if (nr_reactors > 1) {
+		tgt_config_shared = 0;
+		pthread_rwlock_unlock(&tgt_config_lock);
+	}
+}
+
+/*
+ * Stop the other reactors between two event batches. Only the main
+ * reactor may call this; calls nest.
+ */
+void tgt_lock_exclusive(void)
+{
+	if (nr_reactors == 1 || tgt_config_exclusive++)
+		return;
+
+	if (current_reactor && current_reactor != tgt_main_reactor())
+		eprintf("BUG: exclusive lock taken by reactor %d\n",
+			current_reactor->id);
+
+	if (tgt_config_shared)
+		pthread_rwlock_unlock(&tgt_config_lock);
+	pthread_rwlock_wrlock(&tgt_config_lock);
+}
+
+void tgt_unlock_exclusive(void)
+{
+	if (nr_reactors == 1 || --tgt_config_exclusive)
+		return;
+
+	pthread_rwlock_unlock(&tgt_config_lock);
+	if (tgt_config_shared)
+		pthread_rwlock_rdlock(&tgt_config_lock);
+}
+
+int tgt_is_exclusive(void)
+{
+	return nr_reactors == 1 || tgt_config_exclusive;
+}
+
+struct tgt_reactor *tgt_main_reactor(void)
+{
+	return &reactors[0];
+}
+
+struct tgt_reactor *tgt_reactor_get(int id)
+{
+	return &reactors[id];
+}
+
+/* the reactor running on this thread, NULL for non event loop threads */
+struct tgt_reactor *tgt_current_reactor(void)
+{
+	return current_reactor;
+}
+
+struct tgt_reactor *tgt_reactor_pick(void)
+{
+	struct tgt_reactor *r;
+
+	r = &reactors[next_reactor];
+	next_reactor = (next_reactor + 1) % nr_reactors;
+
+	return r;
+}
+
+int tgt_reactor_id(struct tgt_reactor *r)
+{
+	return r->id;
+}
+
+static int tgt_fd_table_grow(struct tgt_reactor *r, int fd)
+{
+	struct event_data **table;
+	int size;
+
+	size = max(r->fd_table_size * 2, 1024);
+	while (size <= fd)
+		size *= 2;
+
+	table = realloc(r->fd_table, size * sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+
+	memset(table + r->fd_table_size, 0,
+	       (size - r->fd_table_size) * sizeof(*table));
+	r->fd_table = table;
+	r->fd_table_size = size;
+
+	return 0;
+}
+
+int tgt_reactor_event_add(struct tgt_reactor *r, int fd, int events,
+			  event_handler_t handler, void *data)
 {
 #ifdef __linux__
 	struct epoll_event ev;
@@ -179,6 +329,15 @@ int tgt_event_add(int fd, int events, event_handler_t handler, void *data)
 	struct event_data *tev;
 	int err;
 
+	if (fd < 0)
+		return -EINVAL;
+
+	if (fd >= r->fd_table_size) {
+		err = tgt_fd_table_grow(r, fd);
+		if (err)
+			return err;
+	}
+
 	tev = zalloc(sizeof(*tev));
 	if (!tev)
 		return -ENOMEM;
@@ -186,12 +345,14 @@ int tgt_event_add(int fd, int events, event_handler_t handler, void *data)
 	tev->data = data;
 	tev->handler = handler;
 	tev->fd = fd;
+	tev->events = events;
+	tev->reactor = r;
 
 #ifdef __linux__
 	memset(&ev, 0, sizeof(ev));
 	ev.events = events;
 	ev.data.ptr = tev;
-	err = epoll_ctl(ep_fd, EPOLL_CTL_ADD, fd, &ev);
+	err = epoll_ctl(r->ep_fd, EPOLL_CTL_ADD, fd, &ev);
 #else
 	event_set(&tev->ev, fd, EV_PERSIST|events, handler, data);
 	event_base_set(ev_base, &tev->ev);
@@ -201,64 +362,71 @@ int tgt_event_add(int fd, int events, event_handler_t handler, void *data)
 		eprintf("Cannot add fd, %m\n");
 		free(tev);
 	} else
-		list_add(&tev->e_list, &tgt_events_list);
+		r->fd_table[fd] = tev;
 
 	return err;
 }
 
-static struct event_data *tgt_event_lookup(int fd)
+static inline struct event_data *tgt_event_lookup(struct tgt_reactor *r,
+						  int fd)
 {
-	struct event_data *tev;
-
-	list_for_each_entry(tev, &tgt_events_list, e_list) {
-		if (tev->fd == fd)
-			return tev;
-	}
-	return NULL;
+	if (fd < 0 || fd >= r->fd_table_size)
+		return NULL;
+	return r->fd_table[fd];
 }
 
-void tgt_event_del(int fd)
+void tgt_reactor_event_del(struct tgt_reactor *r, int fd)
 {
 	struct event_data *tev;
 	int ret;
 
-	tev = tgt_event_lookup(fd);
+	tev = tgt_event_lookup(r, fd);
 	if (!tev) {
 		eprintf("Cannot find event %d\n", fd);
 		return;
 	}
 
 #ifdef __linux__
-	ret = epoll_ctl(ep_fd, EPOLL_CTL_DEL, fd, NULL);
+	ret = epoll_ctl(r->ep_fd, EPOLL_CTL_DEL, fd, NULL);
 #else
 	ret = event_del(&tev->ev);
 #endif
 	if (ret < 0)
 		eprintf("fail to remove epoll event, %s\n", strerror(errno));
 
-	list_del(&tev->e_list);
-	free(tev);
+	/*
+	 * The owning reactor may still hold this event in the batch
+	 * it is dispatching, so it frees it when the batch is done.
+	 */
+	tev->deleted = 1;
+	r->fd_table[fd] = NULL;
+	list_add(&tev->e_list, &r->zombie_list);
 }
 
-int tgt_event_modify(int fd, int events)
+int tgt_reactor_event_modify(struct tgt_reactor *r, int fd, int events)
 {
 #ifdef __linux__
 	struct epoll_event ev;
 #endif
 	struct event_data *tev;
 
-	tev = tgt_event_lookup(fd);
+	tev = tgt_event_lookup(r, fd);
 	if (!tev) {
 		eprintf("Cannot find event %d\n", fd);
 		return -EINVAL;
 	}
 
-#ifdef __linux
+	/* already armed for these events, save the syscall */
+	if (tev->events == events)
+		return 0;
+	tev->events = events;
+
+#ifdef __linux__
 	memset(&ev, 0, sizeof(ev));
 	ev.events = events;
 	ev.data.ptr = tev;
 
-	return epoll_ctl(ep_fd, EPOLL_CTL_MOD, fd, &ev);
+	return epoll_ctl(r->ep_fd, EPOLL_CTL_MOD, fd, &ev);
 #else
 	event_del(&tev->ev);
 	event_set(&tev->ev, fd, EV_PERSIST|events, tev->handler, tev->data);
@@ -267,20 +435,46 @@ int tgt_event_modify(int fd, int events)
 #endif
 }
 
+int tgt_event_add(int fd, int events, event_handler_t handler, void *data)
+{
+	return tgt_reactor_event_add(tgt_main_reactor(), fd, events, handler,
+				     data);
+}
+
+void tgt_event_del(int fd)
+{
+	tgt_reactor_event_del(tgt_main_reactor(), fd);
+}
+
+int tgt_event_modify(int fd, int events)
+{
+	return tgt_reactor_event_modify(tgt_main_reactor(), fd, events);
+}
+
 void tgt_init_sched_event(struct event_data *evt,
 			  sched_event_handler_t sched_handler, void *data)
 {
 	evt->sched_handler = sched_handler;
 	evt->scheduled = 0;
+	evt->posted = 0;
 	evt->data = data;
 	INIT_LIST_HEAD(&evt->e_list);
 }
 
+/*
+ * Scheduled events run on the reactor of the calling thread right
+ * before it goes back to epoll_wait.
+ */
 void tgt_add_sched_event(struct event_data *evt)
 {
+	struct tgt_reactor *r = current_reactor;
+
+	if (!r)
+		r = tgt_main_reactor();
+
 	if (!evt->scheduled) {
 		evt->scheduled = 1;
-		list_add_tail(&evt->e_list, &tgt_sched_events_list);
+		list_add_tail(&evt->e_list, &r->sched_events_list);
 	}
 }
 
@@ -292,6 +486,55 @@ void tgt_remove_sched_event(struct event_data *evt)
 	}
 }
 
+/*
+ * Run @evt as a scheduled event on reactor @r. This is the only way
+ * for another thread to hand work to a reactor. An event is either
+ * posted or scheduled locally, never both at once.
+ */
+void tgt_reactor_post(struct tgt_reactor *r, struct event_data *evt)
+{
+	int wake = 0, ret;
+
+	if (r == current_reactor) {
+		tgt_add_sched_event(evt);
+		return;
+	}
+
+	pthread_mutex_lock(&r->post_lock);
+	if (!evt->posted) {
+		evt->posted = 1;
+		list_add_tail(&evt->e_list, &r->post_list);
+		if (!r->post_woken)
+			wake = r->post_woken = 1;
+	}
+	pthread_mutex_unlock(&r->post_lock);
+
+	if (wake) {
+		ret = write(r->wake_fd[1], "x", 1);
+		if (ret < 0)
+			eprintf("can't wake up reactor %d, %m\n", r->id);
+	}
+}
+
+/*
+ * Take back an event posted to @r that has not run yet. Returns 1 if
+ * it was still pending.
+ */
+int tgt_reactor_unpost(struct tgt_reactor *r, struct event_data *evt)
+{
+	int pending;
+
+	pthread_mutex_lock(&r->post_lock);
+	pending = evt->posted;
+	if (pending) {
+		evt->posted = 0;
+		list_del_init(&evt->e_list);
+	}
+	pthread_mutex_unlock(&r->post_lock);
+
+	return pending;
+}
+
 /* strcpy, while eating multiple white spaces */
 void str_spacecpy(char **dest, const char *src)
 {
@@ -402,40 +645,55 @@ int call_program(const char *cmd, void (*callback)(void *data, int result),
 	return 0;
 }
 
-static int tgt_exec_scheduled(void)
+static int tgt_exec_scheduled(struct tgt_reactor *r)
 {
 	struct list_head *last_sched;
 	struct event_data *tev, *tevn;
 	int work_remains = 0;
 
-	if (!list_empty(&tgt_sched_events_list)) {
+	if (!list_empty(&r->sched_events_list)) {
 		/* execute only work scheduled till now */
-		last_sched = tgt_sched_events_list.prev;
-		list_for_each_entry_safe(tev, tevn, &tgt_sched_events_list,
+		last_sched = r->sched_events_list.prev;
+		list_for_each_entry_safe(tev, tevn, &r->sched_events_list,
 					 e_list) {
 			tgt_remove_sched_event(tev);
 			tev->sched_handler(tev);
 			if (&tev->e_list == last_sched)
 				break;
 		}
-		if (!list_empty(&tgt_sched_events_list))
+		if (!list_empty(&r->sched_events_list))
 			work_remains = 1;
 	}
 	return work_remains;
 }
 
-static void tgt_event_loop(void)
+static void tgt_reap_events(struct tgt_reactor *r)
+{
+	struct event_data *tev, *tevn;
+
+	list_for_each_entry_safe(tev, tevn, &r->zombie_list, e_list) {
+		list_del(&tev->e_list);
+		free(tev);
+	}
+}
+
+static void tgt_event_loop(struct tgt_reactor *r)
 {
 #ifdef __linux__
 	int nevent, i, sched_remains, timeout;
 	struct epoll_event events[1024];
 	struct event_data *tev;
 
+	current_reactor = r;
+
+	tgt_config_read_lock();
 retry:
-	sched_remains = tgt_exec_scheduled();
+	sched_remains = tgt_exec_scheduled(r);
 	timeout = sched_remains ? 0 : -1;
 
-	nevent = epoll_wait(ep_fd, events, ARRAY_SIZE(events), timeout);
+	tgt_config_read_unlock();
+	nevent = epoll_wait(r->ep_fd, events, ARRAY_SIZE(events), timeout);
+	tgt_config_read_lock();
 	if (nevent < 0) {
 		if (errno != EINTR) {
 			eprintf("%m\n");
@@ -444,17 +702,139 @@ retry:
 	} else if (nevent) {
 		for (i = 0; i < nevent; i++) {
 			tev = (struct event_data *) events[i].data.ptr;
+			if (tev->deleted)
+				continue;
 			tev->handler(tev->fd, events[i].events, tev->data);
 		}
 	}
 
+	tgt_reap_events(r);
+
 	if (system_active)
 		goto retry;
+	tgt_config_read_unlock();
 #else
 	event_base_dispatch(ev_base);
 #endif
 }
 
+static int tgt_reactor_init(struct tgt_reactor *r, int id)
+{
+	r->id = id;
+	INIT_LIST_HEAD(&r->sched_events_list);
+	INIT_LIST_HEAD(&r->zombie_list);
+	INIT_LIST_HEAD(&r->post_list);
+	pthread_mutex_init(&r->post_lock, NULL);
+
+#ifdef __linux__
+	r->ep_fd = epoll_create(4096);
+	if (r->ep_fd < 0) {
+		fprintf(stderr, "can't create epoll fd, %m\n");
+		return -1;
+	}
+	r->wake_fd[0] = r->wake_fd[1] = -1;
+#endif
+	return 0;
+}
+
+#ifdef __linux__
+static void tgt_reactor_wake_handler(int fd, int events, void *data)
+{
+	struct tgt_reactor *r = data;
+	struct event_data *evt, *next;
+	char buf[64];
+	int ret;
+
+	do {
+		ret = read(fd, buf, sizeof(buf));
+	} while (ret == sizeof(buf));
+
+	pthread_mutex_lock(&r->post_lock);
+	r->post_woken = 0;
+	list_for_each_entry_safe(evt, next, &r->post_list, e_list) {
+		list_del_init(&evt->e_list);
+		evt->posted = 0;
+		tgt_add_sched_event(evt);
+	}
+	pthread_mutex_unlock(&r->post_lock);
+}
+
+static void *tgt_reactor_thread_fn(void *arg)
+{
+	struct tgt_reactor *r = arg;
+	sigset_t set;
+
+	sigfillset(&set);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+	tgt_event_loop(r);
+
+	pthread_exit(NULL);
+}
+
+static int tgt_reactors_start(void)
+{
+	struct tgt_reactor *r;
+	int i, ret;
+
+	for (i = 0; i < nr_reactors; i++) {
+		r = &reactors[i];
+
+		ret = pipe(r->wake_fd);
+		if (ret) {
+			eprintf("can't create a pipe, %m\n");
+			return ret;
+		}
+		set_non_blocking(r->wake_fd[0]);
+
+		ret = tgt_reactor_event_add(r, r->wake_fd[0], EPOLLIN,
+					    tgt_reactor_wake_handler, r);
+		if (ret)
+			return ret;
+
+		if (!i)
+			continue;
+
+		ret = pthread_create(&r->thread, NULL, tgt_reactor_thread_fn,
+				     r);
+		if (ret) {
+			eprintf("can't create reactor thread %d, %s\n", i,
+				strerror(ret));
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void tgt_reactors_stop(void)
+{
+	struct tgt_reactor *r;
+	int i, ret;
+
+	for (i = 1; i < nr_reactors; i++) {
+		r = &reactors[i];
+		if (r->wake_fd[1] < 0)
+			continue;
+
+		ret = write(r->wake_fd[1], "x", 1);
+		if (ret < 0)
+			eprintf("can't wake up reactor %d, %m\n", i);
+		else
+			pthread_join(r->thread, NULL);
+	}
+}
+#else
+static int tgt_reactors_start(void)
+{
+	return 0;
+}
+
+static void tgt_reactors_stop(void)
+{
+}
+#endif
+
 int lld_init_one(int lld_index)
 {
 	int err;
@@ -535,7 +915,8 @@ int main(int argc, char **argv)
 {
 	struct sigaction sa_old;
 	struct sigaction sa_new;
-	int err, ch, longindex, nr_lld = 0;
+	pthread_rwlockattr_t rwattr;
+	int err, ch, longindex, nr_lld = 0, i;
 	int is_daemon = 1, is_debug = 0;
 	int ret;
 
@@ -568,6 +949,12 @@ int main(int argc, char **argv)
 			if (ret)
 				bad_optarg(ret, ch, optarg);
 			break;
+		case 'R':
+			ret = str_to_int(optarg, nr_reactors, 1,
+					 TGT_MAX_REACTORS);
+			if (ret)
+				bad_optarg(ret, ch, optarg);
+			break;
 		case 'd':
 			ret = str_to_int(optarg, is_debug, 0, 1);
 			if (ret)
@@ -591,13 +978,12 @@ int main(int argc, char **argv)
 		}
 	}
 
-#ifdef __linux__
-	ep_fd = epoll_create(4096);
-	if (ep_fd < 0) {
-		fprintf(stderr, "can't create epoll fd, %m\n");
+#ifndef __linux__
+	if (nr_reactors > 1) {
+		fprintf(stderr, "multiple reactors are not supported\n");
 		exit(1);
 	}
-#else
+
 	ev_base = event_base_new();
 	if (ev_base==NULL) {
 		fprintf(stderr, "can't create event_base\n");
@@ -605,6 +991,25 @@ int main(int argc, char **argv)
 	}
 #endif
 
+	reactors = zalloc(nr_reactors * sizeof(*reactors));
+	if (!reactors) {
+		fprintf(stderr, "can't allocate reactors\n");
+		exit(1);
+	}
+
+	for (i = 0; i < nr_reactors; i++) {
+		err = tgt_reactor_init(&reactors[i], i);
+		if (err)
+			exit(1);
+	}
+
+	/* don't let a stream of event batches starve the main reactor */
+	pthread_rwlockattr_init(&rwattr);
+	pthread_rwlockattr_setkind_np(&rwattr,
+				PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&tgt_config_lock, &rwattr);
+	pthread_rwlockattr_destroy(&rwattr);
+
 	spare_args = optind < argc ? argv[optind] : NULL;
 
 	err = ipc_init();
@@ -636,9 +1041,17 @@ int main(int argc, char **argv)
 	if (err)
 		exit(1);
 
-	bs_init();
+	err = bs_init();
+	if (err)
+		exit(1);
+
+	err = tgt_reactors_start();
+	if (err)
+		exit(1);
+
+	tgt_event_loop(tgt_main_reactor());
 
-	tgt_event_loop();
+	tgt_reactors_stop();
 
 	lld_exit();
 
@@ -1,6 +1,8 @@
 #ifndef __TARGET_DAEMON_H
 #define __TARGET_DAEMON_H
 
+#include <pthread.h>
+
 #include "log.h"
 #include "scsi_cmnd.h"
 #include "tgtadm_error.h"
@@ -192,11 +194,22 @@ struct scsi_lu {
 	uint64_t lun;
 	char *path;
 	int bsoflags;
+	/* options for the backing store, "key=value;..." */
+	char *bsopts;
 	unsigned int blk_shift;
+	/* commands the backing store runs at once, 0 for no limit */
+	int iodepth;
 
 	/* the list of devices belonging to a target */
 	struct list_head device_siblings;
 
+	/*
+	 * Commands from all the reactors meet here. This protects the
+	 * command queue, the reservation, PR and UA state, the
+	 * lu_itl_info_list and the backing store's own state.
+	 */
+	pthread_mutex_t lu_lock;
+
 	struct list_head lu_itl_info_list;
 
 	struct tgt_cmd_queue cmd_queue;
@@ -236,13 +249,6 @@ struct scsi_lu {
 	void (*cmd_done)(struct target *, struct scsi_cmd *);
 };
 
-struct mgmt_req {
-	uint64_t mid;
-	int busy;
-	int function;
-	int result;
-};
-
 enum mgmt_req_result {
 	MGMT_REQ_FAILED = -1,
 	MGMT_REQ_DONE,
@@ -295,6 +301,25 @@ typedef void (*event_handler_t)(int fd, short events, void *data);
 extern int tgt_event_add(int fd, int events, event_handler_t handler, void *data);
 extern void tgt_event_del(int fd);
 
+struct tgt_reactor;
+extern int nr_reactors;
+extern struct tgt_reactor *tgt_main_reactor(void);
+extern struct tgt_reactor *tgt_reactor_get(int id);
+extern struct tgt_reactor *tgt_current_reactor(void);
+extern struct tgt_reactor *tgt_reactor_pick(void);
+extern int tgt_reactor_id(struct tgt_reactor *r);
+extern int tgt_reactor_event_add(struct tgt_reactor *r, int fd, int events,
+				 event_handler_t handler, void *data);
+extern void tgt_reactor_event_del(struct tgt_reactor *r, int fd);
+extern int tgt_reactor_event_modify(struct tgt_reactor *r, int fd, int events);
+
+extern void tgt_reactor_post(struct tgt_reactor *r, struct event_data *evt);
+extern int tgt_reactor_unpost(struct tgt_reactor *r, struct event_data *evt);
+
+extern void tgt_lock_exclusive(void);
+extern void tgt_unlock_exclusive(void);
+extern int tgt_is_exclusive(void);
+
 extern void tgt_add_sched_event(struct event_data *evt);
 extern void tgt_remove_sched_event(struct event_data *evt);
 
@@ -324,6 +349,8 @@ extern int lu_prevent_removal(struct scsi_lu *lu);
 extern uint64_t scsi_get_devid(int lid, uint8_t *pdu);
 extern int scsi_cmd_perform(int host_no, struct scsi_cmd *cmd);
 extern void sense_data_build(struct scsi_cmd *cmd, uint8_t key, uint16_t asc);
+extern unsigned char *sense_buffer_alloc(struct scsi_cmd *cmd);
+extern void sense_buffer_free(struct scsi_cmd *cmd);
 extern uint64_t scsi_rw_offset(uint8_t *scb);
 extern uint32_t scsi_rw_count(uint8_t *scb);
 extern int scsi_is_io_opcode(unsigned char op);
@@ -377,6 +404,13 @@ extern int lld_init_one(int lld_index);
 extern int setup_param(char *name, int (*parser)(char *));
 
 extern int bs_init(void);
+extern void bs_cmd_done_post(struct scsi_cmd *cmd);
+/* memory kept as data buffers for good, see bs_buf_region_add() */
+#define BS_BUF_REGIONS_MAX	1024
+
+extern int bs_buf_region_add(void *addr, size_t len);
+extern int bs_buf_region_find(void *addr, size_t len);
+extern const struct iovec *bs_buf_region_table(int *nr);
 
 struct event_data {
 	union {
@@ -388,12 +422,34 @@ struct event_data {
 		int scheduled;
 	};
 	void *data;
+	struct tgt_reactor *reactor;
+	int events;
+	int deleted;
+	int posted;
 	struct list_head e_list;
 #ifndef __linux__
 	struct event ev;
 #endif
 };
 
+struct mgmt_req {
+	uint64_t mid;
+	int busy;
+	int function;
+	int result;
+
+	/* the request as the transport made it, see target_mgmt_request() */
+	int tid;
+	int lid;
+	uint64_t itn_id;
+	uint8_t lun[8];
+	uint64_t tag;
+	int host_no;
+	/* the reactor the transport is told the result on */
+	struct tgt_reactor *reactor;
+	struct event_data event;
+};
+
 int call_program(const char *cmd,
 		    void (*callback)(void *data, int result), void *data,
 		    char *output, int op_len, int flags);
@@ -108,6 +108,25 @@ static inline int between(uint32_t seq1, uint32_t seq2, uint32_t seq3)
 	return seq3 - seq2 >= seq1 - seq2;
 }
 
+/* FNV-1a, for hash tables keyed by names */
+#define HASH_INIT	2166136261U
+
+static inline uint32_t hash_mem(uint32_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--)
+		hash = (hash ^ *p++) * 16777619U;
+	return hash;
+}
+
+static inline uint32_t hash_str(uint32_t hash, const char *str)
+{
+	while (*str)
+		hash = (hash ^ (unsigned char)*str++) * 16777619U;
+	return hash;
+}
+
 extern unsigned long pagesize, pageshift;
 
 #if defined(__NR_signalfd) && defined(USE_SIGNALFD)